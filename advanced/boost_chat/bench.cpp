@@ -0,0 +1,243 @@
+#include "chat.h"
+#include "chat_client.h"
+#include "chat_server.h"
+
+#include <algorithm>
+#include <atomic>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <thread>
+
+// Benchmark of the chat. It is built against the callback version and the coroutine
+// version of the library, the code is the same. Compare the output of 'bench' and
+// 'bench_coro'.
+
+// Lightweight allocation counter. The heap help is too slow for a benchmark.
+static std::atomic_uint64_t theAllocCount(0);
+
+void*
+operator new(
+	std::size_t size)
+{
+	theAllocCount.fetch_add(1, std::memory_order_relaxed);
+	void* res = malloc(size == 0 ? 1 : size);
+	if (res == nullptr)
+		throw std::bad_alloc();
+	return res;
+}
+
+void
+operator delete(
+	void* ptr) noexcept
+{
+	free(ptr);
+}
+
+void
+operator delete(
+	void* ptr,
+	std::size_t /* size */) noexcept
+{
+	free(ptr);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+class io_core final
+{
+public:
+	~io_core() { stop(); }
+
+	void
+	start(
+		uint32_t thread_count)
+	{
+		for (uint32_t i = 0; i < thread_count; ++i)
+		{
+			m_workers.push_back(std::make_unique<std::thread>(std::bind(
+				&io_core::priv_worker_f, this)));
+		}
+	}
+
+	void
+	stop()
+	{
+		m_backend.stop();
+		for (std::unique_ptr<std::thread>& w : m_workers)
+			w->join();
+		m_workers.clear();
+	}
+
+	boost::asio::io_context& backend() { return m_backend; }
+
+private:
+	void
+	priv_worker_f()
+	{
+		boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work(
+			m_backend.get_executor());
+		m_backend.run();
+	}
+
+	boost::asio::io_context m_backend;
+	std::vector<std::unique_ptr<std::thread>> m_workers;
+};
+
+static uint64_t
+bench_now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void
+bench_connect(
+	chat_client& cli,
+	std::string_view endpoint)
+{
+	event ev;
+	chat_errcode err;
+	cli.connect_async(endpoint, [&](chat_errcode err_res) mutable {
+		err = err_res;
+		ev.send();
+	});
+	ev.recv();
+	if (err != CHAT_ERR_NONE) {
+		printf("Couldn't connect: %d\n", (int)err);
+		abort();
+	}
+}
+
+static std::unique_ptr<chat_message>
+bench_client_recv(
+	chat_client& cli)
+{
+	event ev;
+	std::unique_ptr<chat_message> msg;
+	cli.recv_async([&](chat_errcode err, std::unique_ptr<chat_message> msg_res) mutable {
+		if (err != CHAT_ERR_NONE)
+			abort();
+		msg = std::move(msg_res);
+		ev.send();
+	});
+	ev.recv();
+	return msg;
+}
+
+static uint32_t
+bench_server_recv_batch(
+	chat_server& server,
+	uint32_t max)
+{
+	event ev;
+	uint32_t count = 0;
+	server.recv_batch_async(max, [&](chat_errcode err,
+		std::vector<chat_message> msgs) mutable {
+		if (err != CHAT_ERR_NONE)
+			abort();
+		count = msgs.size();
+		ev.send();
+	});
+	ev.recv();
+	return count;
+}
+
+// One message at a time from one client to another via the server.
+static void
+bench_latency(
+	chat_server& server,
+	chat_client& src,
+	chat_client& dst,
+	uint32_t count)
+{
+	std::vector<uint64_t> lats;
+	lats.reserve(count);
+	uint64_t alloc_count = theAllocCount.load();
+	for (uint32_t i = 0; i < count; ++i) {
+		uint64_t t1 = bench_now_ns();
+		src.feed_async("ping\n");
+		bench_client_recv(dst);
+		lats.push_back(bench_now_ns() - t1);
+		// Don't let the server queue grow.
+		bench_server_recv_batch(server, 1);
+	}
+	alloc_count = theAllocCount.load() - alloc_count;
+	std::sort(lats.begin(), lats.end());
+	uint64_t sum = 0;
+	for (uint64_t l : lats)
+		sum += l;
+	printf("latency: avg %.1f us, p50 %.1f us, p99 %.1f us, %.1f allocs per msg\n",
+		sum / 1000.0 / count, lats[count / 2] / 1000.0, lats[count * 99 / 100] / 1000.0,
+		(double)alloc_count / count);
+}
+
+// Many messages at once from one client, consumed by the server and the other client.
+static void
+bench_throughput(
+	chat_server& server,
+	chat_client& src,
+	chat_client& dst,
+	uint32_t count)
+{
+	const uint32_t batch = 1000;
+	std::string text;
+	for (uint32_t i = 0; i < batch; ++i)
+		text += "message number " + std::to_string(i) + "\n";
+
+	uint64_t alloc_count = theAllocCount.load();
+	uint64_t t1 = bench_now_ns();
+	std::thread consumer([&]() {
+		uint32_t got = 0;
+		while (got < count) {
+			event ev;
+			dst.recv_batch_async(batch, [&](chat_errcode err,
+				std::vector<chat_message> msgs) mutable {
+				if (err != CHAT_ERR_NONE)
+					abort();
+				got += msgs.size();
+				ev.send();
+			});
+			ev.recv();
+		}
+	});
+	for (uint32_t i = 0; i < count; i += batch)
+		src.feed_async(text);
+	uint32_t got = 0;
+	while (got < count)
+		got += bench_server_recv_batch(server, batch);
+	consumer.join();
+	uint64_t duration = bench_now_ns() - t1;
+	alloc_count = theAllocCount.load() - alloc_count;
+	printf("throughput: %.0f msg/s, %.2f allocs per msg\n",
+		count * 1000000000.0 / duration, (double)alloc_count / count);
+}
+
+int
+main(void)
+{
+	io_core core;
+	core.start(3);
+
+	chat_server server(core.backend());
+	if (server.start(0) != CHAT_ERR_NONE)
+		abort();
+	std::string endpoint = "localhost:" + std::to_string(server.port());
+	chat_client src(core.backend(), "src");
+	bench_connect(src, endpoint);
+	chat_client dst(core.backend(), "dst");
+	bench_connect(dst, endpoint);
+	// Make sure the server knows both clients.
+	dst.feed_async("hello\n");
+	bench_client_recv(src);
+	bench_server_recv_batch(server, 1);
+
+	// Warmup.
+	bench_latency(server, src, dst, 1000);
+	bench_latency(server, src, dst, 20000);
+	bench_throughput(server, src, dst, 1000000);
+	return 0;
+}
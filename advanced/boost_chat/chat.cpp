@@ -1,5 +1,84 @@
 #include "chat.h"
 
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+std::string_view
+chat_trim(
+	std::string_view str)
+{
+	size_t begin = 0;
+	size_t end = str.length();
+	while (begin < end and isspace((unsigned char)str[begin]))
+		++begin;
+	while (end > begin and isspace((unsigned char)str[end - 1]))
+		--end;
+	return str.substr(begin, end - begin);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+chat_recv_buffer::chat_recv_buffer()
+	: m_begin(0)
+	, m_end(0)
+	, m_scan(0)
+{
+}
+
+char*
+chat_recv_buffer::reserve(
+	size_t size)
+{
+	if (m_begin == m_end) {
+		// Everything is consumed. Can start from the beginning for free.
+		m_begin = 0;
+		m_end = 0;
+		m_scan = 0;
+	}
+	if (m_buf.size() - m_end >= size)
+		return m_buf.data() + m_end;
+	size_t len = m_end - m_begin;
+	if (m_begin > 0) {
+		memmove(m_buf.data(), m_buf.data() + m_begin, len);
+		m_scan -= m_begin;
+		m_begin = 0;
+		m_end = len;
+	}
+	if (m_buf.size() - m_end < size)
+		m_buf.resize(std::max(m_buf.size() * 2, len + size));
+	return m_buf.data() + m_end;
+}
+
+void
+chat_recv_buffer::commit(
+	size_t size)
+{
+	assert(size <= m_buf.size() - m_end);
+	m_end += size;
+}
+
+bool
+chat_recv_buffer::pop_line(
+	std::string_view& line)
+{
+	const char* data = m_buf.data();
+	const char* end = (const char*)memchr(data + m_scan, '\n', m_end - m_scan);
+	if (end == nullptr) {
+		m_scan = m_end;
+		return false;
+	}
+	size_t pos = end - data;
+	line = std::string_view(data + m_begin, pos - m_begin);
+	m_begin = pos + 1;
+	m_scan = m_begin;
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 event::event() : m_is_set(false) {}
 
 void
@@ -7,6 +86,7 @@ event::send()
 {
 	std::unique_lock lock(m_mutex);
 	m_is_set = true;
+	m_cond.notify_all();
 }
 
 void
@@ -16,3 +96,42 @@ event::recv()
 	while (not m_is_set)
 		m_cond.wait(lock);
 }
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+chat_handler_memory::chat_handler_memory()
+{
+	for (std::atomic_bool& f : m_is_used)
+		f.store(false, std::memory_order_relaxed);
+}
+
+void*
+chat_handler_memory::allocate(
+	std::size_t size)
+{
+	if (size <= CHAT_HANDLER_SLOT_SIZE) {
+		for (int i = 0; i < CHAT_HANDLER_SLOT_COUNT; ++i) {
+			// Cheap check first to avoid bouncing the cache line of busy slots.
+			if (m_is_used[i].load(std::memory_order_relaxed))
+				continue;
+			if (not m_is_used[i].exchange(true, std::memory_order_acquire))
+				return m_slots[i].m_data;
+		}
+	}
+	return ::operator new(size);
+}
+
+void
+chat_handler_memory::deallocate(
+	void* ptr)
+{
+	uintptr_t addr = (uintptr_t)ptr;
+	uintptr_t begin = (uintptr_t)m_slots;
+	uintptr_t end = (uintptr_t)(m_slots + CHAT_HANDLER_SLOT_COUNT);
+	if (addr < begin or addr >= end) {
+		::operator delete(ptr);
+		return;
+	}
+	size_t idx = (addr - begin) / sizeof(slot);
+	m_is_used[idx].store(false, std::memory_order_release);
+}
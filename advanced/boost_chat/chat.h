@@ -1,12 +1,24 @@
 #pragma once
 
+#include <atomic>
+#include <cassert>
 #include <condition_variable>
+#include <cstddef>
 #include <mutex>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 enum
 {
 	CHAT_RECV_BUF_SIZE = 128,
+	// Handler memory slot size. Must fit the biggest asio operation object used by the
+	// chat, which is a socket operation wrapped into a strand binder.
+	CHAT_HANDLER_SLOT_SIZE = 512,
+	// Number of handlers which can be in flight at once without touching the heap.
+	CHAT_HANDLER_SLOT_COUNT = 8,
 };
 
 enum chat_errcode
@@ -32,6 +44,139 @@ struct chat_message
 	// <YOUR CODE IF NEEDED>
 };
 
+// FIFO queue on top of a cyclic array. Unlike std::list it doesn't allocate a node for
+// each element, and unlike std::deque it keeps its memory for reuse when gets empty.
+template<typename T>
+class chat_ring final
+{
+public:
+	chat_ring() : m_head(0), m_size(0) {}
+
+	bool
+	empty() const { return m_size == 0; }
+
+	size_t
+	size() const { return m_size; }
+
+	T&
+	front() { assert(m_size > 0); return m_data[m_head]; }
+
+	void
+	push_back(
+		T&& value)
+	{
+		if (m_size == m_data.size())
+			priv_grow();
+		m_data[(m_head + m_size) & (m_data.size() - 1)] = std::move(value);
+		++m_size;
+	}
+
+	T
+	pop_front()
+	{
+		assert(m_size > 0);
+		T res = std::move(m_data[m_head]);
+		m_head = (m_head + 1) & (m_data.size() - 1);
+		--m_size;
+		return res;
+	}
+
+private:
+	void
+	priv_grow()
+	{
+		// The capacity is always a power of 2 so as the index wrapping is just a mask.
+		std::vector<T> data(m_data.empty() ? 16 : m_data.size() * 2);
+		for (size_t i = 0; i < m_size; ++i)
+			data[i] = std::move(m_data[(m_head + i) & (m_data.size() - 1)]);
+		m_data = std::move(data);
+		m_head = 0;
+	}
+
+	std::vector<T> m_data;
+	size_t m_head;
+	size_t m_size;
+};
+
+// Trim spaces (see isspace()) from both sides of the string.
+std::string_view
+chat_trim(
+	std::string_view str);
+
+// Split the fed text into messages by '\n'. Each complete message is trimmed and passed
+// to the callback unless it is empty. The incomplete tail is accumulated in 'partial' and
+// is glued to the next fed text.
+template<typename OnMsg>
+void
+chat_split_feed(
+	std::string& partial,
+	std::string_view text,
+	OnMsg&& on_msg)
+{
+	size_t pos = 0;
+	while (true) {
+		size_t end = text.find('\n', pos);
+		if (end == std::string_view::npos) {
+			partial.append(text.substr(pos));
+			return;
+		}
+		std::string_view line = text.substr(pos, end - pos);
+		pos = end + 1;
+		if (not partial.empty()) {
+			partial.append(line);
+			line = partial;
+		}
+		line = chat_trim(line);
+		if (not line.empty())
+			on_msg(line);
+		partial.clear();
+	}
+}
+
+// Buffer for receiving line-separated data. The valid bytes are between the read and the
+// write cursors. Consumed lines only move the read cursor, so extracting a message costs
+// only its own length regardless of how much data is buffered. The unconsumed tail is
+// moved to the front only when the free space runs out, and then it is normally just an
+// incomplete last line.
+class chat_recv_buffer final
+{
+public:
+	chat_recv_buffer();
+
+	// Ensure at least the given number of free bytes after the write cursor and return
+	// pointer to them. More can be available, see free_size().
+	char*
+	reserve(
+		size_t size);
+
+	size_t
+	free_size() const { return m_buf.size() - m_end; }
+
+	// Mark the given number of bytes after the write cursor as received.
+	void
+	commit(
+		size_t size);
+
+	// Extract the next complete line without its '\n'. The view is valid until the next
+	// reserve().
+	bool
+	pop_line(
+		std::string_view& line);
+
+	size_t
+	size() const { return m_end - m_begin; }
+
+private:
+	std::string m_buf;
+	// Read cursor.
+	size_t m_begin;
+	// Write cursor.
+	size_t m_end;
+	// Bytes before this position are already known to have no '\n'. Saves from scanning
+	// the same incomplete line again after each receipt.
+	size_t m_scan;
+};
+
 struct event
 {
 public:
@@ -46,4 +191,116 @@ private:
 	std::mutex m_mutex;
 	std::condition_variable m_cond;
 	bool m_is_set;
-};
\ No newline at end of file
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Recycled memory for asio handlers. Each async operation and each post() makes asio
+// allocate an operation object which stores the handler. With this memory attached to a
+// handler via its associated allocator the operation objects reuse a few fixed slots
+// instead of going to the heap every time. Allocation and deallocation can happen in any
+// threads, because posts can be done from anywhere. When all the slots are busy, the
+// heap is used.
+//
+// The memory must outlive all the handlers using it. The simplest way to ensure that is
+// to keep it inside the object whose shared_ptr is captured by those handlers.
+//
+class chat_handler_memory final
+{
+public:
+	chat_handler_memory();
+	chat_handler_memory(
+		const chat_handler_memory&) = delete;
+	chat_handler_memory& operator=(
+		const chat_handler_memory&) = delete;
+
+	void*
+	allocate(
+		std::size_t size);
+
+	void
+	deallocate(
+		void* ptr);
+
+private:
+	struct alignas(std::max_align_t) slot
+	{
+		unsigned char m_data[CHAT_HANDLER_SLOT_SIZE];
+	};
+
+	slot m_slots[CHAT_HANDLER_SLOT_COUNT];
+	std::atomic_bool m_is_used[CHAT_HANDLER_SLOT_COUNT];
+};
+
+// Minimal allocator on top of the handler memory. Asio finds it via the handler's
+// allocator_type and get_allocator().
+template<typename T>
+class chat_handler_allocator final
+{
+public:
+	using value_type = T;
+
+	explicit chat_handler_allocator(
+		chat_handler_memory& mem) : m_mem(mem) {}
+
+	template<typename U>
+	chat_handler_allocator(
+		const chat_handler_allocator<U>& other) noexcept : m_mem(other.m_mem) {}
+
+	T*
+	allocate(
+		std::size_t n) const { return static_cast<T*>(m_mem.allocate(sizeof(T) * n)); }
+
+	void
+	deallocate(
+		T* ptr,
+		std::size_t /* n */) const { m_mem.deallocate(ptr); }
+
+	bool
+	operator==(
+		const chat_handler_allocator& other) const noexcept { return &m_mem == &other.m_mem; }
+
+	bool
+	operator!=(
+		const chat_handler_allocator& other) const noexcept { return &m_mem != &other.m_mem; }
+
+private:
+	chat_handler_memory& m_mem;
+
+	template<typename> friend class chat_handler_allocator;
+};
+
+// Wrapper attaching the handler memory to any handler. When the handler also needs an
+// executor, then the wrapper has to be inside of bind_executor(), not outside.
+template<typename Handler>
+class chat_alloc_handler final
+{
+public:
+	using allocator_type = chat_handler_allocator<Handler>;
+
+	chat_alloc_handler(
+		chat_handler_memory& mem,
+		Handler&& h) : m_mem(mem), m_handler(std::move(h)) {}
+
+	allocator_type
+	get_allocator() const noexcept { return allocator_type(m_mem); }
+
+	template<typename... Args>
+	void
+	operator()(
+		Args&&... args) { m_handler(std::forward<Args>(args)...); }
+
+private:
+	chat_handler_memory& m_mem;
+	Handler m_handler;
+};
+
+template<typename Handler>
+inline chat_alloc_handler<std::decay_t<Handler>>
+chat_make_alloc_handler(
+	chat_handler_memory& mem,
+	Handler&& h)
+{
+	return chat_alloc_handler<std::decay_t<Handler>>(mem, std::decay_t<Handler>(
+		std::forward<Handler>(h)));
+}
@@ -4,11 +4,13 @@
 
 #include <functional>
 #include <memory>
+#include <vector>
 
 namespace boost { namespace asio { class io_context; } }
 
 using chat_client_on_connect_f = std::function<void(chat_errcode err)>;
 using chat_client_on_msg_f = std::function<void(chat_errcode err, std::unique_ptr<chat_message> msg)>;
+using chat_client_on_batch_f = std::function<void(chat_errcode err, std::vector<chat_message> msgs)>;
 
 class chat_client_peer;
 
@@ -27,6 +29,13 @@ public:
 	recv_async(
 		chat_client_on_msg_f&& c);
 
+	// Receive all the ready messages, but not more than max, in one callback. It is
+	// invoked when at least one message is available.
+	void
+	recv_batch_async(
+		uint32_t max,
+		chat_client_on_batch_f&& cb);
+
 	void
 	feed_async(
 		std::string_view text);
@@ -0,0 +1,150 @@
+#include "chat_coro.h"
+#include "chat_client_impl.h"
+
+#include <boost/asio/write.hpp>
+
+// Coroutine version of the chat client IO. One coroutine connects and then keeps reading
+// the socket, another one sends the fed messages.
+
+class chat_client_peer_io final : public chat_client_peer
+{
+public:
+	chat_client_peer_io(
+		boost::asio::io_context& ioCtx,
+		std::string_view name);
+
+private:
+	void
+	priv_in_strand_connect(
+		std::string&& endpoint,
+		chat_client_on_connect_f&& cb) override;
+
+	void
+	priv_in_strand_start() override;
+
+	void
+	priv_in_strand_send() override;
+
+	chat_coro<void>
+	priv_coro_connect(
+		std::shared_ptr<chat_client_peer> ref,
+		std::string endpoint,
+		chat_client_on_connect_f cb);
+
+	chat_coro<void>
+	priv_coro_recv(
+		std::shared_ptr<chat_client_peer> ref);
+
+	chat_coro<void>
+	priv_coro_send(
+		std::shared_ptr<chat_client_peer> ref);
+
+	// Wakes the writer up when there is new data to send or the client is stopped.
+	chat_coro_signal m_out_signal;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+std::shared_ptr<chat_client_peer>
+chat_client_peer::create(
+	boost::asio::io_context& ioCtx,
+	std::string_view name)
+{
+	return std::make_shared<chat_client_peer_io>(ioCtx, name);
+}
+
+chat_client_peer_io::chat_client_peer_io(
+	boost::asio::io_context& ioCtx,
+	std::string_view name)
+	: chat_client_peer(ioCtx, name)
+	, m_out_signal(ioCtx)
+{
+}
+
+void
+chat_client_peer_io::priv_in_strand_connect(
+	std::string&& endpoint,
+	chat_client_on_connect_f&& cb)
+{
+	boost::asio::co_spawn(m_strand, priv_coro_connect(shared_from_this(),
+		std::move(endpoint), std::move(cb)), boost::asio::detached);
+}
+
+void
+chat_client_peer_io::priv_in_strand_start()
+{
+	boost::asio::co_spawn(m_strand, priv_coro_send(shared_from_this()),
+		boost::asio::detached);
+	boost::asio::co_spawn(m_strand, priv_coro_recv(shared_from_this()),
+		boost::asio::detached);
+}
+
+void
+chat_client_peer_io::priv_in_strand_send()
+{
+	m_out_signal.send();
+}
+
+chat_coro<void>
+chat_client_peer_io::priv_coro_connect(
+	std::shared_ptr<chat_client_peer> /* ref */,
+	std::string endpoint,
+	chat_client_on_connect_f cb)
+{
+	std::string host;
+	std::string port;
+	chat_errcode rc = priv_in_strand_on_connect_start(endpoint, host, port);
+	if (rc != CHAT_ERR_NONE) {
+		cb(rc);
+		co_return;
+	}
+	boost::system::error_code err;
+	boost::asio::ip::tcp::resolver::results_type results =
+		co_await m_resolver.async_resolve(host, port, chat_coro_token(err));
+	boost::asio::ip::tcp::endpoint addr;
+	rc = priv_in_strand_on_resolve(err, results, addr);
+	if (rc != CHAT_ERR_NONE) {
+		cb(rc);
+		co_return;
+	}
+	co_await m_sock.async_connect(addr, chat_coro_token(err));
+	cb(priv_in_strand_on_connect(err));
+}
+
+chat_coro<void>
+chat_client_peer_io::priv_coro_recv(
+	std::shared_ptr<chat_client_peer> /* ref */)
+{
+	boost::system::error_code err;
+	while (m_state == CHAT_CLIENT_STATE_CONNECTED) {
+		// Receive right into the free space in the end of the buffer.
+		char* dst = m_in_buf.reserve(CHAT_RECV_BUF_SIZE);
+		size_t size = co_await m_sock.async_receive(boost::asio::buffer(dst,
+			m_in_buf.free_size()), chat_coro_token(err));
+		if (not priv_in_strand_on_recv(err, size))
+			break;
+	}
+}
+
+chat_coro<void>
+chat_client_peer_io::priv_coro_send(
+	std::shared_ptr<chat_client_peer> /* ref */)
+{
+	boost::system::error_code err;
+	while (m_state == CHAT_CLIENT_STATE_CONNECTED) {
+		if (m_out_buf.empty()) {
+			co_await m_out_signal.wait();
+			continue;
+		}
+		// The buffers are swapped, not copied. Both keep their capacity for reuse.
+		m_out_sending.clear();
+		std::swap(m_out_sending, m_out_buf);
+		// Partial writes are handled inside.
+		co_await boost::asio::async_write(m_sock, boost::asio::buffer(m_out_sending),
+			chat_coro_token(err));
+		if (err) {
+			priv_in_strand_stop();
+			break;
+		}
+	}
+}
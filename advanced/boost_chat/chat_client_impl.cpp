@@ -0,0 +1,296 @@
+#include "chat_client_impl.h"
+
+#include <vector>
+
+chat_client::chat_client(
+	boost::asio::io_context& ioCtx,
+	std::string_view name)
+	: m_conn(chat_client_peer::create(ioCtx, name))
+{
+}
+
+chat_client::~chat_client()
+{
+	m_conn->stop();
+}
+
+void
+chat_client::connect_async(
+	std::string_view endpoint,
+	chat_client_on_connect_f&& cb)
+{
+	m_conn->connect_async(endpoint, std::move(cb));
+}
+
+void
+chat_client::recv_async(
+	chat_client_on_msg_f&& cb)
+{
+	m_conn->recv_async(std::move(cb));
+}
+
+void
+chat_client::recv_batch_async(
+	uint32_t max,
+	chat_client_on_batch_f&& cb)
+{
+	m_conn->recv_batch_async(max, std::move(cb));
+}
+
+void
+chat_client::feed_async(
+	std::string_view text)
+{
+	m_conn->feed_async(text);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+chat_client_peer::chat_client_peer(
+	boost::asio::io_context& ioCtx,
+	std::string_view name)
+	: m_state(CHAT_CLIENT_STATE_NEW)
+	, m_strand(ioCtx)
+	, m_sock(ioCtx)
+	, m_resolver(ioCtx)
+	, m_has_in_author(false)
+	, m_name(name)
+{
+}
+
+chat_client_peer::~chat_client_peer()
+{
+	while (not m_reqs.empty())
+		m_reqs.pop_front().cancel();
+}
+
+void
+chat_client_peer::connect_async(
+	std::string_view endpoint,
+	chat_client_on_connect_f&& cb)
+{
+	boost::asio::post(m_strand, chat_make_alloc_handler(m_handler_mem,
+		[ref = shared_from_this(), this, endpoint = std::string(endpoint),
+		cb = std::move(cb)]() mutable {
+		priv_in_strand_connect(std::move(endpoint), std::move(cb));
+	}));
+}
+
+void
+chat_client_peer::recv_async(
+	chat_client_on_msg_f&& cb)
+{
+	boost::asio::post(m_strand, chat_make_alloc_handler(m_handler_mem,
+		[ref = shared_from_this(), req = chat_client_request(std::move(cb)),
+		this]() mutable {
+		priv_in_strand_on_new_request(std::move(req));
+	}));
+}
+
+void
+chat_client_peer::recv_batch_async(
+	uint32_t max,
+	chat_client_on_batch_f&& cb)
+{
+	boost::asio::post(m_strand, chat_make_alloc_handler(m_handler_mem,
+		[ref = shared_from_this(), req = chat_client_request(max, std::move(cb)),
+		this]() mutable {
+		priv_in_strand_on_new_request(std::move(req));
+	}));
+}
+
+void
+chat_client_peer::feed_async(
+	std::string_view text)
+{
+	boost::asio::post(m_strand, chat_make_alloc_handler(m_handler_mem, std::bind(
+		&chat_client_peer::priv_in_strand_on_new_feed, shared_from_this(),
+		std::string(text))));
+}
+
+void
+chat_client_peer::stop()
+{
+	boost::asio::post(m_strand, chat_make_alloc_handler(m_handler_mem, std::bind(
+		&chat_client_peer::priv_in_strand_stop, shared_from_this())));
+}
+
+chat_errcode
+chat_client_peer::priv_in_strand_on_connect_start(
+	std::string_view endpoint,
+	std::string& host,
+	std::string& port)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state != CHAT_CLIENT_STATE_NEW) {
+		return m_state == CHAT_CLIENT_STATE_STOPPED ? CHAT_ERR_CANCELED :
+			CHAT_ERR_ALREADY_STARTED;
+	}
+	size_t pos = endpoint.rfind(':');
+	if (pos == std::string::npos)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	host = endpoint.substr(0, pos);
+	port = endpoint.substr(pos + 1);
+	m_state = CHAT_CLIENT_STATE_CONNECTING;
+	return CHAT_ERR_NONE;
+}
+
+chat_errcode
+chat_client_peer::priv_in_strand_on_resolve(
+	const boost::system::error_code& err,
+	const boost::asio::ip::tcp::resolver::results_type& results,
+	boost::asio::ip::tcp::endpoint& addr)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state != CHAT_CLIENT_STATE_CONNECTING)
+		return CHAT_ERR_CANCELED;
+	if (err) {
+		m_state = CHAT_CLIENT_STATE_NEW;
+		return CHAT_ERR_NO_ADDR;
+	}
+	// Only IPv4 is supported.
+	for (const boost::asio::ip::tcp::resolver::results_type::value_type& entry : results) {
+		if (entry.endpoint().address().is_v4()) {
+			addr = entry.endpoint();
+			return CHAT_ERR_NONE;
+		}
+	}
+	m_state = CHAT_CLIENT_STATE_NEW;
+	return CHAT_ERR_NO_ADDR;
+}
+
+chat_errcode
+chat_client_peer::priv_in_strand_on_connect(
+	const boost::system::error_code& err)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state != CHAT_CLIENT_STATE_CONNECTING)
+		return CHAT_ERR_CANCELED;
+	if (err) {
+		boost::system::error_code close_err;
+		m_sock.close(close_err);
+		m_state = CHAT_CLIENT_STATE_NEW;
+		return CHAT_ERR_SYS;
+	}
+	m_state = CHAT_CLIENT_STATE_CONNECTED;
+	// The name goes first, before anything fed while the connection was in progress.
+	m_out_buf.insert(0, m_name + '\n');
+	priv_in_strand_start();
+	return CHAT_ERR_NONE;
+}
+
+void
+chat_client_peer::priv_in_strand_on_new_request(
+	chat_client_request&& req)
+{
+	assert(m_strand.running_in_this_thread());
+	if (req.m_max == 0) {
+		req.m_batch_cb(CHAT_ERR_INVALID_ARGUMENT, {});
+		return;
+	}
+	// Older requests are served first to preserve the FIFO order. If there are no ready
+	// messages, the request waits for the next ones. The socket is being read all the
+	// time while connected.
+	m_reqs.push_back(std::move(req));
+	priv_in_strand_serve();
+	if (m_state == CHAT_CLIENT_STATE_STOPPED) {
+		// Nothing will ever arrive.
+		priv_in_strand_cancel_requests();
+	}
+}
+
+void
+chat_client_peer::priv_in_strand_serve()
+{
+	assert(m_strand.running_in_this_thread());
+	while (not m_reqs.empty() and not m_in_msgs.empty()) {
+		chat_client_request req = m_reqs.pop_front();
+		if (not req.m_batch_cb) {
+			req.m_cb(CHAT_ERR_NONE, std::make_unique<chat_message>(
+				m_in_msgs.pop_front()));
+			continue;
+		}
+		size_t count = std::min<size_t>(req.m_max, m_in_msgs.size());
+		std::vector<chat_message> msgs;
+		msgs.reserve(count);
+		for (size_t i = 0; i < count; ++i)
+			msgs.emplace_back(m_in_msgs.pop_front());
+		req.m_batch_cb(CHAT_ERR_NONE, std::move(msgs));
+	}
+}
+
+void
+chat_client_peer::priv_in_strand_cancel_requests()
+{
+	assert(m_strand.running_in_this_thread());
+	while (not m_reqs.empty())
+		m_reqs.pop_front().cancel();
+}
+
+bool
+chat_client_peer::priv_in_strand_on_recv(
+	const boost::system::error_code& err,
+	std::size_t size)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state != CHAT_CLIENT_STATE_CONNECTED)
+		return false;
+	if (err) {
+		priv_in_strand_stop();
+		return false;
+	}
+	m_in_buf.commit(size);
+	std::string_view line;
+	while (m_in_buf.pop_line(line))
+		priv_in_strand_on_line(line);
+	priv_in_strand_serve();
+	return true;
+}
+
+void
+chat_client_peer::priv_in_strand_on_line(
+	std::string_view line)
+{
+	assert(m_strand.running_in_this_thread());
+	if (not m_has_in_author) {
+		m_in_author = line;
+		m_has_in_author = true;
+		return;
+	}
+	chat_message msg;
+	msg.m_author = std::move(m_in_author);
+	msg.m_data = line;
+	m_in_msgs.push_back(std::move(msg));
+	m_in_author.clear();
+	m_has_in_author = false;
+}
+
+void
+chat_client_peer::priv_in_strand_on_new_feed(
+	std::string_view text)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state == CHAT_CLIENT_STATE_STOPPED)
+		return;
+	chat_split_feed(m_feed_buf, text, [this](std::string_view msg) {
+		m_out_buf.append(msg);
+		m_out_buf.push_back('\n');
+	});
+	priv_in_strand_send();
+}
+
+void
+chat_client_peer::priv_in_strand_stop()
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state == CHAT_CLIENT_STATE_STOPPED)
+		return;
+	m_state = CHAT_CLIENT_STATE_STOPPED;
+	m_resolver.cancel();
+	boost::system::error_code err;
+	m_sock.close(err);
+	priv_in_strand_send();
+	// Pending requests mean there are no received messages. And there won't be any new.
+	assert(m_reqs.empty() or m_in_msgs.empty());
+	priv_in_strand_cancel_requests();
+}
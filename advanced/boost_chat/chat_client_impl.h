@@ -0,0 +1,173 @@
+#pragma once
+
+// Private part of the chat client shared by the callback and the coroutine versions. They
+// only differ in how the IO is done: connecting, receiving and sending. Each version
+// defines it in a subclass of chat_client_peer.
+
+#include "chat_client.h"
+#include "chat_impl.h"
+
+// Request for either one message or a batch of them.
+struct chat_client_request final
+{
+	chat_client_request() : m_max(0) {}
+
+	chat_client_request(
+		chat_client_on_msg_f&& cb) : m_cb(std::move(cb)), m_max(1) {}
+
+	chat_client_request(
+		uint32_t max,
+		chat_client_on_batch_f&& cb) : m_batch_cb(std::move(cb)), m_max(max) {}
+
+	void
+	cancel()
+	{
+		if (m_batch_cb)
+			m_batch_cb(CHAT_ERR_CANCELED, {});
+		else
+			m_cb(CHAT_ERR_CANCELED, {});
+	}
+
+	chat_client_on_msg_f m_cb;
+	chat_client_on_batch_f m_batch_cb;
+	uint32_t m_max;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+enum chat_client_state
+{
+	CHAT_CLIENT_STATE_NEW,
+	CHAT_CLIENT_STATE_CONNECTING,
+	CHAT_CLIENT_STATE_CONNECTED,
+	CHAT_CLIENT_STATE_STOPPED,
+};
+
+class chat_client_peer : public std::enable_shared_from_this<chat_client_peer>
+{
+public:
+	// Is defined by each version to create its own peer.
+	static std::shared_ptr<chat_client_peer>
+	create(
+		boost::asio::io_context& ioCtx,
+		std::string_view name);
+
+	virtual ~chat_client_peer();
+
+	void
+	connect_async(
+		std::string_view endpoint,
+		chat_client_on_connect_f&& cb);
+
+	void
+	recv_async(
+		chat_client_on_msg_f&& cb);
+
+	void
+	recv_batch_async(
+		uint32_t max,
+		chat_client_on_batch_f&& cb);
+
+	void
+	feed_async(
+		std::string_view text);
+
+	void
+	stop();
+
+protected:
+	chat_client_peer(
+		boost::asio::io_context& ioCtx,
+		std::string_view name);
+
+	// Resolve the endpoint and connect to it.
+	virtual void
+	priv_in_strand_connect(
+		std::string&& endpoint,
+		chat_client_on_connect_f&& cb) = 0;
+
+	// Start receiving and sending when connected.
+	virtual void
+	priv_in_strand_start() = 0;
+
+	// Send the output buffer if it isn't being sent already. Is also called after the
+	// stop, to let the sending see it and end.
+	virtual void
+	priv_in_strand_send() = 0;
+
+	// The connection steps. Each one returns CHAT_ERR_NONE if the connection can go on,
+	// or the error to complete it with. The last one starts the IO when connected.
+	chat_errcode
+	priv_in_strand_on_connect_start(
+		std::string_view endpoint,
+		std::string& host,
+		std::string& port);
+
+	chat_errcode
+	priv_in_strand_on_resolve(
+		const boost::system::error_code& err,
+		const boost::asio::ip::tcp::resolver::results_type& results,
+		boost::asio::ip::tcp::endpoint& addr);
+
+	chat_errcode
+	priv_in_strand_on_connect(
+		const boost::system::error_code& err);
+
+	// Handle the result of a receipt into the input buffer. Returns false if the client
+	// is stopped and the receiving must end.
+	bool
+	priv_in_strand_on_recv(
+		const boost::system::error_code& err,
+		std::size_t size);
+
+	void
+	priv_in_strand_stop();
+
+	chat_client_state m_state;
+
+	chat_strand m_strand;
+	boost::asio::ip::tcp::socket m_sock;
+
+	// Input buffer for reading the next incoming messages.
+	chat_recv_buffer m_in_buf;
+	// Output buffer for prearing the next outgoing messages.
+	std::string m_out_buf;
+	// Data being sent right now. Must stay unchanged until the sending is complete.
+	std::string m_out_sending;
+
+	boost::asio::ip::tcp::resolver m_resolver;
+
+	chat_handler_memory m_handler_mem;
+
+private:
+	void
+	priv_in_strand_on_new_request(
+		chat_client_request&& req);
+
+	void
+	priv_in_strand_serve();
+
+	void
+	priv_in_strand_cancel_requests();
+
+	void
+	priv_in_strand_on_line(
+		std::string_view line);
+
+	void
+	priv_in_strand_on_new_feed(
+		std::string_view text);
+
+	// Requests which are waiting for data.
+	chat_ring<chat_client_request> m_reqs;
+	// Full messages waiting to be delivered to requests.
+	chat_ring<chat_message> m_in_msgs;
+	// The server sends each message as 2 lines: author and data. This is the author of
+	// the message whose data is not received yet.
+	std::string m_in_author;
+	bool m_has_in_author;
+	// Incomplete tail of the fed text.
+	std::string m_feed_buf;
+
+	const std::string m_name;
+};
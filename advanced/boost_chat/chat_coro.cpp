@@ -0,0 +1,25 @@
+#include "chat_coro.h"
+
+chat_coro_signal::chat_coro_signal(
+	boost::asio::io_context& ioCtx)
+	: m_timer(ioCtx)
+	, m_is_waiting(false)
+{
+}
+
+chat_coro<void>
+chat_coro_signal::wait()
+{
+	m_timer.expires_at(boost::asio::steady_timer::time_point::max());
+	m_is_waiting = true;
+	boost::system::error_code err;
+	co_await m_timer.async_wait(chat_coro_token(err));
+	m_is_waiting = false;
+}
+
+void
+chat_coro_signal::send()
+{
+	if (m_is_waiting)
+		m_timer.cancel();
+}
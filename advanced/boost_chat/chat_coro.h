@@ -0,0 +1,52 @@
+#pragma once
+
+// Common part of the coroutine version of the chat.
+//
+// The coroutine frames are allocated by asio. It recycles the last freed frame in each
+// thread, the rest go to the heap. Asio has no public hook to change that. So in the
+// latency case of the benchmark this version does ~6.0 allocations per message against
+// 2.0 of the callback version, at about the same speed.
+
+#include "chat_impl.h"
+
+#include <utility>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+// The coroutines are bound to the concrete strand type. With the default polymorphic
+// executor each copy of the executor, and asio does many, would go to the heap.
+template<typename T>
+using chat_coro = boost::asio::awaitable<T, chat_strand>;
+
+// Completion token returning the error into the given variable instead of throwing it.
+static inline auto
+chat_coro_token(
+	boost::system::error_code& err)
+{
+	return boost::asio::redirect_error(boost::asio::use_awaitable_t<chat_strand>(),
+		err);
+}
+
+// Wakeup signal for a coroutine waiting for more work in the same strand. The waiting
+// is done on a timer which never expires, and the wakeup is its cancellation.
+class chat_coro_signal final
+{
+public:
+	chat_coro_signal(
+		boost::asio::io_context& ioCtx);
+
+	chat_coro<void>
+	wait();
+
+	void
+	send();
+
+private:
+	boost::asio::steady_timer m_timer;
+	bool m_is_waiting;
+};
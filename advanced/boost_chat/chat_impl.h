@@ -0,0 +1,22 @@
+#pragma once
+
+// Private part of the chat shared by the client and the server, in both the callback and
+// the coroutine versions.
+
+#include "chat.h"
+
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/io_context_strand.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+
+// Strand "serializes" all callbacks associated with it. It means the strand will invoke
+// them one by one, never in more than one thread at a time. That in turn means, that
+// inside strand callbacks you don't need to protect its data with any mutexes.
+//
+// It is the io_context's own strand, not the generic strand<> template. The latter in
+// this asio version posts its internal invoker via the thread-local recycling allocator
+// instead of the handler's one. Then with several threads it goes to the heap now and
+// then, regardless of the handler memory.
+using chat_strand = boost::asio::io_context::strand;
@@ -3,12 +3,15 @@
 #include "chat.h"
 
 #include <functional>
+#include <memory>
+#include <vector>
 
 namespace boost { namespace asio { class io_context; } }
 
 class chat_server_ctx;
 
 using chat_server_on_msg_f = std::function<void(chat_errcode err, std::unique_ptr<chat_message> msg)>;
+using chat_server_on_batch_f = std::function<void(chat_errcode err, std::vector<chat_message> msgs)>;
 
 class chat_server final
 {
@@ -28,6 +31,13 @@ public:
 	recv_async(
 		chat_server_on_msg_f&& cb);
 
+	// Receive all the ready messages, but not more than max, in one callback. It is
+	// invoked when at least one message is available.
+	void
+	recv_batch_async(
+		uint32_t max,
+		chat_server_on_batch_f&& cb);
+
 	void
 	feed_async(
 		std::string_view text);
@@ -0,0 +1,122 @@
+#include "chat_coro.h"
+#include "chat_server_impl.h"
+
+#include <boost/asio/write.hpp>
+
+// Coroutine version of the chat server IO. Each peer is served by 2 coroutines: a reader
+// and a writer. And one more coroutine accepts new clients.
+
+class chat_server_peer_io final : public chat_server_peer
+{
+public:
+	chat_server_peer_io(
+		boost::asio::ip::tcp::socket&& sock,
+		const std::shared_ptr<chat_server_ctx>& server);
+
+	void
+	start() override;
+
+private:
+	chat_coro<void>
+	priv_coro_recv(
+		std::shared_ptr<chat_server_peer> ref);
+
+	chat_coro<void>
+	priv_coro_send(
+		std::shared_ptr<chat_server_peer> ref);
+
+	void
+	priv_in_strand_send() override;
+
+	// Wakes the writer up when there is new data to send or the peer is stopped.
+	chat_coro_signal m_out_signal;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+std::shared_ptr<chat_server_peer>
+chat_server_peer::create(
+	boost::asio::ip::tcp::socket&& sock,
+	const std::shared_ptr<chat_server_ctx>& server)
+{
+	return std::make_shared<chat_server_peer_io>(std::move(sock), server);
+}
+
+chat_server_peer_io::chat_server_peer_io(
+	boost::asio::ip::tcp::socket&& sock,
+	const std::shared_ptr<chat_server_ctx>& server)
+	: chat_server_peer(std::move(sock), server)
+	, m_out_signal(static_cast<boost::asio::io_context&>(m_sock.get_executor().context()))
+{
+}
+
+void
+chat_server_peer_io::start()
+{
+	boost::asio::co_spawn(m_strand, priv_coro_recv(shared_from_this()),
+		boost::asio::detached);
+	boost::asio::co_spawn(m_strand, priv_coro_send(shared_from_this()),
+		boost::asio::detached);
+}
+
+chat_coro<void>
+chat_server_peer_io::priv_coro_recv(
+	std::shared_ptr<chat_server_peer> /* ref */)
+{
+	boost::system::error_code err;
+	while (m_state == CHAT_SERVER_PEER_STATE_CONNECTED) {
+		// Receive right into the free space in the end of the buffer.
+		char* dst = m_in_buf.reserve(CHAT_RECV_BUF_SIZE);
+		size_t size = co_await m_sock.async_receive(boost::asio::buffer(dst,
+			m_in_buf.free_size()), chat_coro_token(err));
+		if (not priv_in_strand_on_recv(err, size))
+			break;
+	}
+}
+
+chat_coro<void>
+chat_server_peer_io::priv_coro_send(
+	std::shared_ptr<chat_server_peer> /* ref */)
+{
+	boost::system::error_code err;
+	while (m_state == CHAT_SERVER_PEER_STATE_CONNECTED) {
+		if (m_out_buf.empty()) {
+			co_await m_out_signal.wait();
+			continue;
+		}
+		// The buffers are swapped, not copied. Both keep their capacity for reuse.
+		m_out_sending.clear();
+		std::swap(m_out_sending, m_out_buf);
+		// Partial writes are handled inside.
+		co_await boost::asio::async_write(m_sock, boost::asio::buffer(m_out_sending),
+			chat_coro_token(err));
+		if (err) {
+			priv_in_strand_stop();
+			break;
+		}
+	}
+}
+
+void
+chat_server_peer_io::priv_in_strand_send()
+{
+	m_out_signal.send();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void
+chat_server_ctx::priv_in_strand_accept()
+{
+	assert(m_strand.running_in_this_thread());
+	boost::asio::co_spawn(m_strand, [ref = shared_from_this(), this]() ->
+		chat_coro<void> {
+		boost::system::error_code err;
+		while (m_state == CHAT_SERVER_STATE_LISTEN) {
+			boost::asio::ip::tcp::socket sock = co_await m_sock.async_accept(
+				chat_coro_token(err));
+			if (not priv_in_strand_on_accept(err, std::move(sock)))
+				break;
+		}
+	}, boost::asio::detached);
+}
@@ -0,0 +1,475 @@
+#include "chat_server_impl.h"
+
+#include <atomic>
+#include <iostream>
+
+// Author of the messages fed by the server itself.
+static constexpr std::string_view theServerAuthor = "server";
+
+// The clients get the author and the message as 2 lines.
+static inline void
+chat_server_encode_msg(
+	std::string& out,
+	std::string_view author,
+	std::string_view data)
+{
+	out.append(author);
+	out.push_back('\n');
+	out.append(data);
+	out.push_back('\n');
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+chat_server::chat_server(
+	boost::asio::io_context& ioCtx)
+	: m_ctx(std::make_shared<chat_server_ctx>(ioCtx))
+{
+}
+
+chat_server::~chat_server()
+{
+	m_ctx->stop();
+}
+
+chat_errcode
+chat_server::start(
+	uint16_t port)
+{
+	return m_ctx->start(port);
+}
+
+uint16_t
+chat_server::port() const
+{
+	return m_ctx->port();
+}
+
+void
+chat_server::recv_async(
+	chat_server_on_msg_f&& cb)
+{
+	m_ctx->recv_async(std::move(cb));
+}
+
+void
+chat_server::recv_batch_async(
+	uint32_t max,
+	chat_server_on_batch_f&& cb)
+{
+	m_ctx->recv_batch_async(max, std::move(cb));
+}
+
+void
+chat_server::feed_async(
+	std::string_view text)
+{
+	m_ctx->feed_async(text);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+chat_server_peer::chat_server_peer(
+	boost::asio::ip::tcp::socket&& sock,
+	const std::shared_ptr<chat_server_ctx>& server)
+	: m_state(CHAT_SERVER_PEER_STATE_CONNECTED)
+	, m_strand(static_cast<boost::asio::io_context&>(sock.get_executor().context()))
+	, m_sock(std::move(sock))
+	, m_server(server)
+	, m_has_name(false)
+	, m_server_idx(0)
+{
+}
+
+chat_server_peer::~chat_server_peer() = default;
+
+void
+chat_server_peer::stop()
+{
+	boost::asio::post(m_strand, chat_make_alloc_handler(m_handler_mem, std::bind(
+		&chat_server_peer::priv_in_strand_stop, shared_from_this())));
+}
+
+void
+chat_server_peer::feed_async(
+	std::shared_ptr<const std::string> data)
+{
+	boost::asio::post(m_strand, chat_make_alloc_handler(m_handler_mem,
+		[ref = shared_from_this(), this, data = std::move(data)]() {
+		priv_in_strand_on_new_feed(*data);
+	}));
+}
+
+void
+chat_server_peer::priv_in_strand_on_new_feed(
+	const std::string& data)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+		return;
+	// The shared buffer is released right after this. A peer which is slow to send keeps
+	// its own copy, and doesn't hold the buffer from reuse.
+	m_out_buf.append(data);
+	priv_in_strand_send();
+}
+
+void
+chat_server_peer::priv_server_on_recv_done(
+	std::vector<chat_message>&& msgs)
+{
+	boost::asio::post(m_strand, chat_make_alloc_handler(m_handler_mem,
+		[ref = shared_from_this(), this, msgs = std::move(msgs)]() mutable {
+		priv_in_strand_server_on_recv_done(std::move(msgs));
+	}));
+}
+
+void
+chat_server_peer::priv_in_strand_server_on_recv_done(
+	std::vector<chat_message>&& msgs)
+{
+	assert(m_strand.running_in_this_thread());
+	assert(msgs.empty());
+	assert(m_in_msgs.empty());
+	if (m_in_msgs.capacity() == 0)
+		m_in_msgs = std::move(msgs);
+	else
+		m_in_msgs_free.push_back(std::move(msgs));
+}
+
+bool
+chat_server_peer::priv_in_strand_on_recv(
+	const boost::system::error_code& err,
+	std::size_t size)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+		return false;
+	if (err) {
+		// EOF is a normal disconnect, everything else is a broken connection. Either way
+		// the peer is gone.
+		priv_in_strand_stop();
+		return false;
+	}
+	std::shared_ptr<chat_server_ctx> server = m_server.lock();
+	if (not server) {
+		priv_in_strand_stop();
+		return false;
+	}
+	m_in_buf.commit(size);
+	std::string_view line;
+	while (m_in_buf.pop_line(line))
+		priv_in_strand_on_line(line);
+	// One hop to the server strand for all the messages received at once.
+	if (m_in_msgs.empty())
+		return true;
+	server->priv_peer_on_recv(shared_from_this(), std::move(m_in_msgs));
+	m_in_msgs.clear();
+	if (not m_in_msgs_free.empty())
+		m_in_msgs = m_in_msgs_free.pop_front();
+	return true;
+}
+
+void
+chat_server_peer::priv_in_strand_on_line(
+	std::string_view line)
+{
+	assert(m_strand.running_in_this_thread());
+	if (not m_has_name) {
+		m_name = line;
+		m_has_name = true;
+		return;
+	}
+	chat_message& msg = m_in_msgs.emplace_back();
+	msg.m_author = m_name;
+	msg.m_data = line;
+}
+
+void
+chat_server_peer::priv_in_strand_stop()
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state != CHAT_SERVER_PEER_STATE_CONNECTED)
+		return;
+	m_state = CHAT_SERVER_PEER_STATE_STOPPED;
+	boost::system::error_code err;
+	m_sock.close(err);
+	priv_in_strand_send();
+	if (std::shared_ptr<chat_server_ctx> server = m_server.lock())
+		server->priv_peer_on_close(shared_from_this());
+	m_server.reset();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+chat_server_ctx::chat_server_ctx(
+	boost::asio::io_context& ioCtx)
+	: m_state(CHAT_SERVER_STATE_NEW)
+	, m_strand(ioCtx)
+	, m_sock(ioCtx)
+	, m_port(0)
+{
+}
+
+chat_server_ctx::~chat_server_ctx()
+{
+	// The requests still pending are dropped without being called. The server object
+	// owning them is already deleted, and their callbacks often reference it.
+}
+
+chat_errcode
+chat_server_ctx::start(
+	uint16_t port)
+{
+	if (m_state != CHAT_SERVER_STATE_NEW)
+		return CHAT_ERR_ALREADY_STARTED;
+
+	boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port);
+	boost::system::error_code err;
+	m_sock.open(endpoint.protocol(), err);
+	if (err)
+		return CHAT_ERR_SYS;
+	m_sock.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true), err);
+	if (err)
+		return CHAT_ERR_SYS;
+	m_sock.bind(endpoint, err);
+	if (err == boost::asio::error::address_in_use)
+		return CHAT_ERR_PORT_BUSY;
+	if (err)
+		return CHAT_ERR_SYS;
+	m_port = m_sock.local_endpoint(err).port();
+	if (err)
+		return CHAT_ERR_SYS;
+	m_sock.listen(boost::asio::socket_base::max_listen_connections, err);
+	if (err)
+		return CHAT_ERR_SYS;
+	m_state = CHAT_SERVER_STATE_LISTEN;
+	boost::asio::post(m_strand, chat_make_alloc_handler(m_handler_mem, std::bind(
+		&chat_server_ctx::priv_in_strand_accept, shared_from_this())));
+	return CHAT_ERR_NONE;
+}
+
+uint16_t
+chat_server_ctx::port() const
+{
+	assert(m_state != CHAT_SERVER_STATE_NEW);
+	return m_port;
+}
+
+void
+chat_server_ctx::stop()
+{
+	boost::asio::post(m_strand, chat_make_alloc_handler(m_handler_mem, std::bind(
+		&chat_server_ctx::priv_in_strand_stop, shared_from_this())));
+}
+
+void
+chat_server_ctx::recv_async(
+	chat_server_on_msg_f&& cb)
+{
+	boost::asio::post(m_strand, chat_make_alloc_handler(m_handler_mem,
+		[ref = shared_from_this(), req = chat_server_request(std::move(cb)),
+		this]() mutable {
+		priv_in_strand_on_new_request(std::move(req));
+	}));
+}
+
+void
+chat_server_ctx::recv_batch_async(
+	uint32_t max,
+	chat_server_on_batch_f&& cb)
+{
+	boost::asio::post(m_strand, chat_make_alloc_handler(m_handler_mem,
+		[ref = shared_from_this(), req = chat_server_request(max, std::move(cb)),
+		this]() mutable {
+		priv_in_strand_on_new_request(std::move(req));
+	}));
+}
+
+void
+chat_server_ctx::feed_async(
+	std::string_view text)
+{
+	boost::asio::post(m_strand, chat_make_alloc_handler(m_handler_mem, std::bind(
+		&chat_server_ctx::priv_in_strand_on_new_feed, shared_from_this(),
+		std::string(text))));
+}
+
+bool
+chat_server_ctx::priv_in_strand_on_accept(
+	const boost::system::error_code& err,
+	boost::asio::ip::tcp::socket&& sock)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state == CHAT_SERVER_STATE_STOPPED)
+		return false;
+	if (err) {
+		std::cout << "Chat server accept error: boost " << err << '\n';
+		// There are no normal accept errors which could be handled greacefully. All of
+		// them are critical.
+		abort();
+	}
+	std::shared_ptr<chat_server_peer> peer = chat_server_peer::create(std::move(sock),
+		shared_from_this());
+	peer->start();
+	peer->m_server_idx = m_peers.size();
+	m_peers.emplace_back(std::move(peer));
+	return true;
+}
+
+void
+chat_server_ctx::priv_in_strand_stop()
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state == CHAT_SERVER_STATE_STOPPED)
+		return;
+	m_state = CHAT_SERVER_STATE_STOPPED;
+	boost::system::error_code err;
+	m_sock.close(err);
+	for (std::shared_ptr<chat_server_peer>& p : m_peers)
+		p->stop();
+	m_peers.clear();
+}
+
+void
+chat_server_ctx::priv_in_strand_on_new_request(
+	chat_server_request&& req)
+{
+	assert(m_strand.running_in_this_thread());
+	if (req.m_max == 0) {
+		req.m_batch_cb(CHAT_ERR_INVALID_ARGUMENT, {});
+		return;
+	}
+	m_reqs.push_back(std::move(req));
+	priv_in_strand_serve();
+}
+
+void
+chat_server_ctx::priv_in_strand_serve()
+{
+	assert(m_strand.running_in_this_thread());
+	while (not m_reqs.empty() and not m_in_msgs.empty()) {
+		chat_server_request req = m_reqs.pop_front();
+		if (not req.m_batch_cb) {
+			req.m_cb(CHAT_ERR_NONE, std::make_unique<chat_message>(
+				m_in_msgs.pop_front()));
+			continue;
+		}
+		size_t count = std::min<size_t>(req.m_max, m_in_msgs.size());
+		std::vector<chat_message> msgs;
+		msgs.reserve(count);
+		for (size_t i = 0; i < count; ++i)
+			msgs.emplace_back(m_in_msgs.pop_front());
+		req.m_batch_cb(CHAT_ERR_NONE, std::move(msgs));
+	}
+}
+
+void
+chat_server_ctx::priv_peer_on_recv(
+	std::shared_ptr<chat_server_peer>&& origin,
+	std::vector<chat_message>&& msgs)
+{
+	chat_handler_memory& mem = origin->m_handler_mem;
+	boost::asio::post(m_strand, chat_make_alloc_handler(mem,
+		[ref = shared_from_this(), this, origin = std::move(origin),
+		msgs = std::move(msgs)]() mutable {
+		priv_in_strand_peer_on_recv(std::move(origin), std::move(msgs));
+	}));
+}
+
+void
+chat_server_ctx::priv_in_strand_peer_on_recv(
+	std::shared_ptr<chat_server_peer>&& origin,
+	std::vector<chat_message>&& msgs)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state == CHAT_SERVER_STATE_STOPPED)
+		return;
+	std::shared_ptr<std::string> data = priv_in_strand_take_out_buf();
+	for (const chat_message& msg : msgs)
+		chat_server_encode_msg(*data, msg.m_author, msg.m_data);
+	priv_in_strand_broadcast(origin.get(), data);
+	for (chat_message& msg : msgs)
+		m_in_msgs.push_back(std::move(msg));
+	msgs.clear();
+	origin->priv_server_on_recv_done(std::move(msgs));
+	priv_in_strand_serve();
+}
+
+void
+chat_server_ctx::priv_peer_on_close(
+	std::shared_ptr<chat_server_peer> peer)
+{
+	chat_handler_memory& mem = peer->m_handler_mem;
+	boost::asio::post(m_strand, chat_make_alloc_handler(mem,
+		[ref = shared_from_this(), this, peer = std::move(peer)]() mutable {
+		priv_in_strand_peer_on_close(std::move(peer));
+	}));
+}
+
+void
+chat_server_ctx::priv_in_strand_peer_on_close(
+	std::shared_ptr<chat_server_peer> peer)
+{
+	assert(m_strand.running_in_this_thread());
+	size_t idx = peer->m_server_idx;
+	if (idx >= m_peers.size() or m_peers[idx] != peer) {
+		// The peers are dropped all at once when the server is stopped.
+		if (m_state == CHAT_SERVER_STATE_STOPPED)
+			return;
+		// Unreachable. If it is reachable, then you have a bug.
+		abort();
+	}
+	if (idx != m_peers.size() - 1) {
+		m_peers[idx] = std::move(m_peers.back());
+		m_peers[idx]->m_server_idx = idx;
+	}
+	m_peers.pop_back();
+}
+
+void
+chat_server_ctx::priv_in_strand_on_new_feed(
+	std::string_view text)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state != CHAT_SERVER_STATE_LISTEN)
+		return;
+	std::shared_ptr<std::string> data = priv_in_strand_take_out_buf();
+	chat_split_feed(m_feed_buf, text, [&data](std::string_view msg) {
+		chat_server_encode_msg(*data, theServerAuthor, msg);
+	});
+	priv_in_strand_broadcast(nullptr, data);
+}
+
+std::shared_ptr<std::string>
+chat_server_ctx::priv_in_strand_take_out_buf()
+{
+	assert(m_strand.running_in_this_thread());
+	for (const std::shared_ptr<std::string>& buf : m_out_bufs) {
+		if (buf.use_count() > 1)
+			continue;
+		// The peers release the buffer in their own threads. The count is read relaxed,
+		// so the fence is needed for their reads of the data to happen before the reuse.
+		std::atomic_thread_fence(std::memory_order_acquire);
+		buf->clear();
+		return buf;
+	}
+	// All the buffers are still being fed to the peers. There are as many of them as
+	// broadcasts in flight, so normally just a few.
+	return m_out_bufs.emplace_back(std::make_shared<std::string>());
+}
+
+void
+chat_server_ctx::priv_in_strand_broadcast(
+	const chat_server_peer* origin,
+	const std::shared_ptr<std::string>& data)
+{
+	assert(m_strand.running_in_this_thread());
+	if (data->empty())
+		return;
+	// All the peers share the same buffer. No copies, and each post fits into the
+	// handler memory of its peer.
+	for (std::shared_ptr<chat_server_peer>& p : m_peers) {
+		if (p.get() != origin)
+			p->feed_async(data);
+	}
+}
@@ -0,0 +1,251 @@
+#pragma once
+
+// Private part of the chat server shared by the callback and the coroutine versions. They
+// only differ in how the IO is done: accepting the clients and receiving and sending
+// their data. Each version defines the peer's IO in a subclass of chat_server_peer, and
+// chat_server_ctx::priv_in_strand_accept().
+
+#include "chat_impl.h"
+#include "chat_server.h"
+
+#include <vector>
+
+enum chat_server_state
+{
+	CHAT_SERVER_STATE_NEW,
+	CHAT_SERVER_STATE_LISTEN,
+	CHAT_SERVER_STATE_STOPPED,
+};
+
+enum chat_server_peer_state
+{
+	CHAT_SERVER_PEER_STATE_CONNECTED,
+	CHAT_SERVER_PEER_STATE_STOPPED,
+};
+
+class chat_server_peer : public std::enable_shared_from_this<chat_server_peer>
+{
+public:
+	// Is defined by each version to create its own peers.
+	static std::shared_ptr<chat_server_peer>
+	create(
+		boost::asio::ip::tcp::socket&& sock,
+		const std::shared_ptr<chat_server_ctx>& server);
+
+	virtual ~chat_server_peer();
+
+	// Start the IO.
+	virtual void
+	start() = 0;
+
+	void
+	stop();
+
+	// Send the encoded messages. The buffer is shared by all the peers getting it, and
+	// must not change until they release it.
+	void
+	feed_async(
+		std::shared_ptr<const std::string> data);
+
+protected:
+	chat_server_peer(
+		boost::asio::ip::tcp::socket&& sock,
+		const std::shared_ptr<chat_server_ctx>& server);
+
+	// Send the output buffer if it isn't being sent already. Is also called after the
+	// stop, to let the sending see it and end.
+	virtual void
+	priv_in_strand_send() = 0;
+
+	// Handle the result of a receipt into the input buffer. Returns false if the peer is
+	// stopped and the receiving must end.
+	bool
+	priv_in_strand_on_recv(
+		const boost::system::error_code& err,
+		std::size_t size);
+
+	void
+	priv_in_strand_stop();
+
+	chat_server_peer_state m_state;
+
+	chat_strand m_strand;
+	boost::asio::ip::tcp::socket m_sock;
+
+	// Received bytes not parsed into messages yet.
+	chat_recv_buffer m_in_buf;
+	// Output buffer for new data while the older one is being sent.
+	std::string m_out_buf;
+	// Data being sent right now. Must stay unchanged until the sending is complete.
+	std::string m_out_sending;
+
+	chat_handler_memory m_handler_mem;
+
+private:
+	void
+	priv_in_strand_on_new_feed(
+		const std::string& data);
+
+	// The server is done with the messages handed to it, and returns their vector for
+	// reuse.
+	void
+	priv_server_on_recv_done(
+		std::vector<chat_message>&& msgs);
+
+	void
+	priv_in_strand_server_on_recv_done(
+		std::vector<chat_message>&& msgs);
+
+	void
+	priv_in_strand_on_line(
+		std::string_view line);
+
+	// The server keeps strong references to its peers. A strong reference back would
+	// make a cycle which could never be broken if the io context is stopped first.
+	std::weak_ptr<chat_server_ctx> m_server;
+
+	// The first line sent by the client is its name. All the next ones are messages.
+	std::string m_name;
+	bool m_has_name;
+	// Messages extracted from the last received data. They are handed to the server all
+	// together, and the server gives the vector back.
+	std::vector<chat_message> m_in_msgs;
+	// Vectors given back by the server while the current one was in use. There can be a
+	// few when the data comes faster than the server handles it.
+	chat_ring<std::vector<chat_message>> m_in_msgs_free;
+	// Position in the server's peer array. Is owned by the server and is only accessed in
+	// its strand.
+	size_t m_server_idx;
+
+	friend chat_server_ctx;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Request for either one message or a batch of them.
+struct chat_server_request final
+{
+	chat_server_request() : m_max(0) {}
+
+	chat_server_request(
+		chat_server_on_msg_f&& cb) : m_cb(std::move(cb)), m_max(1) {}
+
+	chat_server_request(
+		uint32_t max,
+		chat_server_on_batch_f&& cb) : m_batch_cb(std::move(cb)), m_max(max) {}
+
+	chat_server_on_msg_f m_cb;
+	chat_server_on_batch_f m_batch_cb;
+	uint32_t m_max;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+class chat_server_ctx final : public std::enable_shared_from_this<chat_server_ctx>
+{
+public:
+	chat_server_ctx(
+		boost::asio::io_context& ioCtx);
+	~chat_server_ctx();
+
+	chat_errcode
+	start(
+		uint16_t port);
+
+	uint16_t
+	port() const;
+
+	void
+	stop();
+
+	void
+	recv_async(
+		chat_server_on_msg_f&& cb);
+
+	void
+	recv_batch_async(
+		uint32_t max,
+		chat_server_on_batch_f&& cb);
+
+	void
+	feed_async(
+		std::string_view text);
+
+private:
+	// Is defined by each version. Accepts the clients while the server is listening.
+	void
+	priv_in_strand_accept();
+
+	// Handle the result of an accept. Returns false if the server is stopped and the
+	// accepting must end.
+	bool
+	priv_in_strand_on_accept(
+		const boost::system::error_code& err,
+		boost::asio::ip::tcp::socket&& sock);
+
+	void
+	priv_in_strand_stop();
+
+	void
+	priv_in_strand_on_new_request(
+		chat_server_request&& req);
+
+	void
+	priv_in_strand_serve();
+
+	// The posts done on behalf of a peer use its handler memory. Then the server's own
+	// memory isn't exhausted by many peers at once.
+	void
+	priv_peer_on_recv(
+		std::shared_ptr<chat_server_peer>&& origin,
+		std::vector<chat_message>&& msgs);
+
+	void
+	priv_in_strand_peer_on_recv(
+		std::shared_ptr<chat_server_peer>&& origin,
+		std::vector<chat_message>&& msgs);
+
+	void
+	priv_peer_on_close(
+		std::shared_ptr<chat_server_peer> peer);
+
+	void
+	priv_in_strand_peer_on_close(
+		std::shared_ptr<chat_server_peer> peer);
+
+	void
+	priv_in_strand_on_new_feed(
+		std::string_view text);
+
+	// Empty buffer for the next broadcast.
+	std::shared_ptr<std::string>
+	priv_in_strand_take_out_buf();
+
+	void
+	priv_in_strand_broadcast(
+		const chat_server_peer* origin,
+		const std::shared_ptr<std::string>& data);
+
+	chat_server_state m_state;
+
+	chat_strand m_strand;
+	boost::asio::ip::tcp::acceptor m_sock;
+	uint16_t m_port;
+
+	// Dense array of the peers. Each peer knows its index, so removal is done by moving
+	// the last peer in place of the removed one.
+	std::vector<std::shared_ptr<chat_server_peer>> m_peers;
+
+	chat_ring<chat_server_request> m_reqs;
+	chat_ring<chat_message> m_in_msgs;
+
+	// Incomplete tail of the server's own feed.
+	std::string m_feed_buf;
+	// Buffers for the encoded messages to broadcast. One buffer is shared by all the
+	// peers, and is reused when none of them holds it anymore.
+	std::vector<std::shared_ptr<std::string>> m_out_bufs;
+
+	chat_handler_memory m_handler_mem;
+
+	friend chat_server_peer;
+};
@@ -1,10 +1,20 @@
 #include "chat.h"
 #include "chat_client.h"
 #include "chat_server.h"
+#include "heap_help.h"
 #include "unitpp.h"
 
+#include <boost/asio/bind_executor.hpp>
 #include <boost/asio/executor_work_guard.hpp>
 #include <boost/asio/io_context.hpp>
+#include <boost/asio/io_context_strand.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/connect_pair.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/write.hpp>
+#include <cstring>
 #include <thread>
 
 enum
@@ -65,9 +75,9 @@ struct test_msg final
 		len += TEST_MSG_ID_LEN + 1;
 		m_data.resize(len);
 		memset(m_data.data(), '0', TEST_MSG_ID_LEN);
-		for (size_t i = TEST_MSG_ID_LEN; i < len; ++i)
+		for (size_t i = TEST_MSG_ID_LEN; i < len - 1; ++i)
 			m_data[i] = 'a' + i % ('z' - 'a' + 1);
-		m_data[len] = '\n';
+		m_data[len - 1] = '\n';
 	}
 
 	void
@@ -160,6 +170,44 @@ client_recv_blocking(
 	return msg;
 }
 
+static std::vector<chat_message>
+server_recv_batch_blocking(
+	chat_server& server,
+	uint32_t max)
+{
+	event ev;
+	chat_errcode err;
+	std::vector<chat_message> msgs;
+	server.recv_batch_async(max, [&](chat_errcode err_res,
+		std::vector<chat_message> msgs_res) mutable {
+		err = err_res;
+		msgs = std::move(msgs_res);
+		ev.send();
+	});
+	ev.recv();
+	unit_assert(err == CHAT_ERR_NONE);
+	return msgs;
+}
+
+static std::vector<chat_message>
+client_recv_batch_blocking(
+	chat_client& cli,
+	uint32_t max)
+{
+	event ev;
+	chat_errcode err;
+	std::vector<chat_message> msgs;
+	cli.recv_batch_async(max, [&](chat_errcode err_res,
+		std::vector<chat_message> msgs_res) mutable {
+		err = err_res;
+		msgs = std::move(msgs_res);
+		ev.send();
+	});
+	ev.recv();
+	unit_assert(err == CHAT_ERR_NONE);
+	return msgs;
+}
+
 static chat_errcode
 client_connect_blocking(
 	chat_client& cli,
@@ -175,6 +223,76 @@ client_connect_blocking(
 	return err;
 }
 
+static void
+test_recv_buffer()
+{
+	unit_test_start();
+
+	chat_recv_buffer buf;
+	std::string_view line;
+	unit_check(not buf.pop_line(line), "empty");
+	//
+	// Lines split between receipts in all possible ways.
+	//
+	std::string text;
+	for (int i = 0; i < 100; ++i)
+		text += "line" + std::to_string(i) + "\n";
+	for (size_t chunk = 1; chunk <= 16; ++chunk) {
+		int next = 0;
+		for (size_t pos = 0; pos < text.length(); pos += chunk) {
+			size_t size = std::min(chunk, text.length() - pos);
+			char* dst = buf.reserve(size);
+			unit_assert(buf.free_size() >= size);
+			memcpy(dst, text.data() + pos, size);
+			buf.commit(size);
+			while (buf.pop_line(line)) {
+				unit_assert(line == "line" + std::to_string(next));
+				++next;
+			}
+		}
+		unit_assert(next == 100);
+		unit_assert(buf.size() == 0);
+	}
+	unit_msg("lines split between receipts");
+	//
+	// Incomplete line survives compaction.
+	//
+	char* dst = buf.reserve(5);
+	memcpy(dst, "a\nbcd", 5);
+	buf.commit(5);
+	unit_check(buf.pop_line(line) and line == "a", "first line");
+	unit_check(not buf.pop_line(line), "no second line yet");
+	dst = buf.reserve(buf.free_size() + 1);
+	memcpy(dst, "e\n", 2);
+	buf.commit(2);
+	unit_check(buf.pop_line(line) and line == "bcde", "second line");
+	//
+	// The memory is reused when the data is consumed as fast as it arrives.
+	//
+	const char* msg = "hello\n";
+	size_t msg_len = strlen(msg);
+	uint64_t alloc_count = 0;
+	for (int i = 0; i < 100000; ++i) {
+		if (i == 1000)
+			alloc_count = heaph_get_alloc_total_count();
+		// Several messages and a part of the next one per receipt.
+		for (int j = 0; j < 3; ++j) {
+			dst = buf.reserve(msg_len);
+			memcpy(dst, msg, msg_len);
+			buf.commit(msg_len);
+		}
+		dst = buf.reserve(2);
+		memcpy(dst, msg, 2);
+		buf.commit(2);
+		int count = 0;
+		while (buf.pop_line(line))
+			++count;
+		unit_assert(count >= 3);
+		unit_assert(buf.size() <= msg_len);
+	}
+	unit_check(heaph_get_alloc_total_count() == alloc_count, "no allocations");
+}
+
 static void
 test_trivial()
 {
@@ -373,7 +491,7 @@ test_multi_client(void)
 
 	unit_msg("Connect clients");
 	std::vector<std::unique_ptr<chat_client>> clis;
-	clis.resize(client_count);
+	clis.reserve(client_count);
 	for (uint32_t i = 0; i < client_count; ++i) {
 		clis.emplace_back(std::make_unique<chat_client>(
 			core.backend(), "cli_" + std::to_string(i)));
@@ -438,6 +556,54 @@ test_multi_client(void)
 	}
 }
 
+static void
+test_peer_disconnect()
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(3);
+
+	chat_server server(core.backend());
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+	std::string endpoint = make_addr_str(server.port());
+
+	uint32_t client_count = 30;
+	unit_msg("Connect clients");
+	std::vector<std::unique_ptr<chat_client>> clis;
+	clis.reserve(client_count);
+	for (uint32_t i = 0; i < client_count; ++i) {
+		clis.emplace_back(std::make_unique<chat_client>(
+			core.backend(), "cli_" + std::to_string(i)));
+		unit_assert(client_connect_blocking(*clis.back(), endpoint) == CHAT_ERR_NONE);
+		// Make sure the server knows the peer before the next ones come.
+		clis.back()->feed_async("hello\n");
+		unit_assert(server_recv_blocking(server)->m_data == "hello");
+	}
+
+	unit_msg("Disconnect the first, the last, and every third client");
+	std::vector<std::unique_ptr<chat_client>> alive;
+	for (uint32_t i = 0; i < client_count; ++i) {
+		if (i == 0 or i == client_count - 1 or i % 3 == 1)
+			clis[i].reset();
+		else
+			alive.emplace_back(std::move(clis[i]));
+	}
+	clis.clear();
+
+	unit_msg("Remaining clients still get the messages");
+	server.feed_async("bye\n");
+	for (std::unique_ptr<chat_client>& cli : alive) {
+		// Drain the greetings of the clients connected later.
+		std::unique_ptr<chat_message> msg;
+		do {
+			msg = client_recv_blocking(*cli);
+		} while (msg->m_data == "hello");
+		unit_assert(msg->m_data == "bye");
+		unit_assert(msg->m_author == "server");
+	}
+}
+
 struct test_stress_ctx final
 {
 	uint32_t msg_count;
@@ -561,7 +727,7 @@ test_big_author()
 
 	cli1.feed_async(body);
 	std::unique_ptr<chat_message> rsp = server_recv_blocking(server);
-	body[body_len] = 0;
+	body.resize(body_len);
 	unit_check(rsp->m_data == body, "msg data");
 	unit_check(rsp->m_author == author1, "msg author");
 
@@ -570,17 +736,307 @@ test_big_author()
 	unit_check(rsp->m_author == author1, "msg author");
 }
 
+struct test_handler_memory_ctx final
+{
+	test_handler_memory_ctx(
+		boost::asio::io_context& io_ctx)
+		: strand(io_ctx), sock1(io_ctx), sock2(io_ctx), cycle_count(0) {}
+
+	void
+	post_next();
+
+	void
+	send_next();
+
+	void
+	recv_next();
+
+	boost::asio::io_context::strand strand;
+	boost::asio::local::stream_protocol::socket sock1;
+	boost::asio::local::stream_protocol::socket sock2;
+	chat_handler_memory mem;
+	char buf;
+	uint32_t cycle_count;
+};
+
+void
+test_handler_memory_ctx::post_next()
+{
+	if (--cycle_count == 0)
+		return;
+	boost::asio::post(strand, chat_make_alloc_handler(mem,
+		std::bind(&test_handler_memory_ctx::post_next, this)));
+}
+
+void
+test_handler_memory_ctx::send_next()
+{
+	if (cycle_count == 0)
+		return;
+	buf = 'x';
+	sock1.async_send(boost::asio::buffer(&buf, 1), boost::asio::bind_executor(strand,
+		chat_make_alloc_handler(mem, [this](const boost::system::error_code& err,
+			size_t size) {
+		unit_assert(not err && size == 1);
+		recv_next();
+	})));
+}
+
+void
+test_handler_memory_ctx::recv_next()
+{
+	sock2.async_receive(boost::asio::buffer(&buf, 1), boost::asio::bind_executor(strand,
+		chat_make_alloc_handler(mem, [this](const boost::system::error_code& err,
+			size_t size) {
+		unit_assert(not err && size == 1);
+		--cycle_count;
+		send_next();
+	})));
+}
+
+static void
+test_handler_memory()
+{
+	unit_test_start();
+
+	boost::asio::io_context io_ctx;
+	test_handler_memory_ctx ctx(io_ctx);
+	boost::asio::local::connect_pair(ctx.sock1, ctx.sock2);
+	//
+	// Warmup so as all the lazily created internal objects of asio are in place.
+	//
+	ctx.cycle_count = 100;
+	ctx.post_next();
+	io_ctx.run();
+	io_ctx.restart();
+	ctx.cycle_count = 100;
+	ctx.send_next();
+	io_ctx.run();
+	io_ctx.restart();
+	//
+	// In the steady state the handlers are only recycling the memory.
+	//
+	const uint32_t count = 10000;
+	uint64_t alloc_count = heaph_get_alloc_total_count();
+	ctx.cycle_count = count;
+	ctx.post_next();
+	io_ctx.run();
+	io_ctx.restart();
+	unit_check(heaph_get_alloc_total_count() == alloc_count, "no mallocs in posts");
+
+	ctx.cycle_count = count;
+	ctx.send_next();
+	io_ctx.run();
+	io_ctx.restart();
+	unit_check(heaph_get_alloc_total_count() == alloc_count,
+		"no mallocs in send and recv");
+	//
+	// When all the slots are busy, the heap is used.
+	//
+	std::vector<void*> ptrs;
+	for (int i = 0; i < CHAT_HANDLER_SLOT_COUNT + 1; ++i)
+		ptrs.push_back(ctx.mem.allocate(CHAT_HANDLER_SLOT_SIZE));
+	for (void* p : ptrs)
+		ctx.mem.deallocate(p);
+	unit_check(heaph_get_alloc_total_count() > alloc_count, "fallback to the heap");
+}
+
+static void
+test_broadcast_memory()
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(3);
+
+	chat_server server(core.backend());
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+	//
+	// Plain sockets are the clients, so as only the server's allocations are counted. The
+	// names and the messages are short to fit into std::string without the heap.
+	//
+	const uint32_t peer_count = 4;
+	boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(),
+		server.port());
+	std::vector<boost::asio::ip::tcp::socket> socks;
+	std::vector<std::string> expected;
+	socks.reserve(peer_count);
+	for (uint32_t i = 0; i < peer_count; ++i) {
+		boost::asio::ip::tcp::socket& sock = socks.emplace_back(core.backend());
+		sock.connect(endpoint);
+		std::string name = "c" + std::to_string(i);
+		boost::asio::write(sock, boost::asio::buffer(name + "\nhello\n"));
+		unit_assert(server_recv_blocking(server)->m_author == name);
+		expected.push_back(name + "\nmsg\n");
+	}
+	// All the peers are known to the server now. Skip whatever they got before the sync.
+	server.feed_async("sync\n");
+	for (boost::asio::ip::tcp::socket& sock : socks) {
+		std::string data;
+		boost::asio::read_until(sock, boost::asio::dynamic_buffer(data),
+			"server\nsync\n");
+	}
+	//
+	// Each message is broadcast to all the other peers.
+	//
+	char buf[16];
+	auto broadcast = [&](uint32_t sender) {
+		boost::asio::write(socks[sender], boost::asio::buffer("msg\n", 4));
+		const std::string& msg = expected[sender];
+		for (uint32_t i = 0; i < peer_count; ++i) {
+			if (i == sender)
+				continue;
+			boost::asio::read(socks[i], boost::asio::buffer(buf, msg.length()));
+			unit_assert(memcmp(buf, msg.data(), msg.length()) == 0);
+		}
+	};
+	auto drain = [&](uint32_t count) {
+		while (count > 0)
+			count -= server_recv_batch_blocking(server, count).size();
+	};
+	// Warmup. The server also keeps the messages for its own recv, and its queue gets
+	// enough capacity here.
+	const uint32_t count = 2000;
+	for (uint32_t i = 0; i < count; ++i)
+		broadcast(i % peer_count);
+	drain(count);
+
+	uint64_t alloc_count = heaph_get_alloc_total_count();
+	for (uint32_t i = 0; i < count; ++i)
+		broadcast(i % peer_count);
+	alloc_count = heaph_get_alloc_total_count() - alloc_count;
+#if CHAT_TEST_CORO
+	// Asio allocates the coroutine frames of each async operation on the heap, see
+	// chat_coro.h. Only the callback version can do without mallocs.
+	unit_msg("coroutine version: " << (double)alloc_count / count << " mallocs per msg");
+#else
+	unit_check(alloc_count == 0, "no mallocs in broadcast");
+#endif
+	drain(count);
+}
+
+static void
+test_batch()
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(3);
+
+	chat_server server(core.backend());
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+	std::string endpoint = make_addr_str(server.port());
+	chat_client cli1(core.backend(), "c1");
+	unit_assert(client_connect_blocking(cli1, endpoint) == CHAT_ERR_NONE);
+	chat_client cli2(core.backend(), "c2");
+	unit_assert(client_connect_blocking(cli2, endpoint) == CHAT_ERR_NONE);
+	// Make sure both clients are known to the server before sending anything.
+	cli1.feed_async("hello\n");
+	unit_assert(server_recv_blocking(server)->m_author == "c1");
+	unit_assert(client_recv_blocking(cli2)->m_data == "hello");
+	cli2.feed_async("hello\n");
+	unit_assert(server_recv_blocking(server)->m_author == "c2");
+	unit_assert(client_recv_blocking(cli1)->m_data == "hello");
+	//
+	// Zero max is not allowed.
+	//
+	{
+		event ev;
+		chat_errcode err = CHAT_ERR_NONE;
+		server.recv_batch_async(0, [&](chat_errcode err_res,
+			std::vector<chat_message> msgs) mutable {
+			err = err_res;
+			unit_assert(msgs.empty());
+			ev.send();
+		});
+		ev.recv();
+		unit_check(err == CHAT_ERR_INVALID_ARGUMENT, "server zero batch");
+		cli1.recv_batch_async(0, [&](chat_errcode err_res,
+			std::vector<chat_message> msgs) mutable {
+			err = err_res;
+			unit_assert(msgs.empty());
+			ev.send();
+		});
+		ev.recv();
+		unit_check(err == CHAT_ERR_INVALID_ARGUMENT, "client zero batch");
+	}
+	//
+	// Many messages sent at once are delivered in order in batches not bigger than max.
+	//
+	const uint32_t count = 5000;
+	const uint32_t max = 64;
+	std::string text;
+	for (uint32_t i = 0; i < count; ++i)
+		text += "msg" + std::to_string(i) + "\n";
+	cli1.feed_async(text);
+
+	uint32_t next = 0;
+	uint32_t batch_count = 0;
+	while (next < count) {
+		std::vector<chat_message> msgs = server_recv_batch_blocking(server, max);
+		unit_assert(not msgs.empty() and msgs.size() <= max);
+		for (const chat_message& msg : msgs) {
+			unit_assert(msg.m_author == "c1");
+			unit_assert(msg.m_data == "msg" + std::to_string(next));
+			++next;
+		}
+		++batch_count;
+	}
+	unit_check(next == count, "server got all in order");
+	unit_check(batch_count < count, "server got batches");
+
+	next = 0;
+	while (next < count) {
+		std::vector<chat_message> msgs = client_recv_batch_blocking(cli2, max);
+		unit_assert(not msgs.empty() and msgs.size() <= max);
+		for (const chat_message& msg : msgs) {
+			unit_assert(msg.m_author == "c1");
+			unit_assert(msg.m_data == "msg" + std::to_string(next));
+			++next;
+		}
+	}
+	unit_check(next == count, "client got all in order");
+	//
+	// Single and batch requests are served in the order of their creation.
+	//
+	event ev;
+	std::vector<chat_message> batch;
+	std::unique_ptr<chat_message> single;
+	cli2.recv_batch_async(max, [&](chat_errcode err,
+		std::vector<chat_message> msgs) mutable {
+		unit_assert(err == CHAT_ERR_NONE);
+		batch = std::move(msgs);
+	});
+	cli2.recv_async([&](chat_errcode err, std::unique_ptr<chat_message> msg) mutable {
+		unit_assert(err == CHAT_ERR_NONE);
+		single = std::move(msg);
+		ev.send();
+	});
+	cli1.feed_async("first\n");
+	unit_assert(server_recv_blocking(server)->m_data == "first");
+	cli1.feed_async("second\n");
+	unit_assert(server_recv_blocking(server)->m_data == "second");
+	ev.recv();
+	unit_check(batch.size() == 1 and batch[0].m_data == "first", "batch first");
+	unit_check(single and single->m_data == "second", "single second");
+}
+
 int
 main(void)
 {
 	unit_test_start();
 
+	test_handler_memory();
+	test_broadcast_memory();
+	test_recv_buffer();
 	test_trivial();
 	test_basic();
 	test_big_messages();
 	test_multi_feed();
 	test_multi_client();
+	test_peer_disconnect();
 	test_stress();
 	test_big_author();
+	test_batch();
 	return 0;
 }
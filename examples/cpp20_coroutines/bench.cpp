@@ -0,0 +1,550 @@
+#include "iocoro.h"
+#include "libcoro.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+// Benchmark of the C++20 stackless coroutines of IOCore against the stackful ones from
+// 1/libcoro.cpp, on the same workloads:
+//
+// - switch: a coroutine suspends and gets resumed again, nothing else;
+// - frame: an empty coroutine is created and destroyed, with the frame from the heap
+//   and from the IOCore's frame pool. Only for IOCore, libcoro has no such thing;
+// - pingpong: 2 coroutines send 1 byte back and forth via a socketpair. Each round trip
+//   is timed on its own, and the percentiles of the latency are printed;
+// - throughput: N clients, each sends 1 byte to its peer coroutine and waits for it back.
+//
+// All runs in one thread. The results are printed as CSV.
+
+static constexpr uint64_t theSwitchCount = 10'000'000;
+static constexpr uint64_t theFrameCount = 10'000'000;
+static constexpr uint64_t thePingPongCount = 200'000;
+static constexpr uint64_t theThroughputMsgCount = 200'000;
+static constexpr uint32_t theClientCounts[] = {1, 10, 100, 1000, 10000};
+
+#if IOCORE_USE_URING
+static constexpr const char *theIOCoreName = "iocoro-uring";
+#else
+static constexpr const char *theIOCoreName = "iocoro-epoll";
+#endif
+static constexpr const char *theLibcoroName = "libcoro";
+
+static uint64_t
+getNsec();
+
+static void
+makeFdNonblock(
+	int fd);
+
+static void
+printResult(
+	const char *impl,
+	const char *name,
+	uint32_t clientCount,
+	uint64_t opCount,
+	uint64_t duration);
+
+static void
+printLatency(
+	const char *impl,
+	const char *name,
+	std::vector<uint64_t> &latencies);
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Socket pairs, one per client. The client's end is even, its peer's end is odd. The
+// sockets are closed by the benchmark which uses them.
+struct BenchSockets
+{
+	BenchSockets(
+		uint32_t count);
+
+	std::vector<int> myFds;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// IOCore
+
+// Remembers the suspended coroutine, which is then resumed by the benchmark directly.
+struct BenchYield
+{
+	bool
+	await_ready() { return false; }
+
+	void
+	await_suspend(
+		std::coroutine_handle<> coro) { *myHandle = coro; }
+
+	void
+	await_resume() {}
+
+	std::coroutine_handle<> *myHandle;
+};
+
+static IOCoroutine
+iocoreSwitchF(
+	std::coroutine_handle<> *handle,
+	uint64_t count)
+{
+	for (uint64_t i = 0; i < count; ++i)
+		co_await BenchYield{handle};
+	co_return;
+}
+
+static void
+iocoreBenchSwitch()
+{
+	std::coroutine_handle<> handle;
+	uint64_t t1 = getNsec();
+	iocoreSwitchF(&handle, theSwitchCount);
+	// The last resume lets the coroutine end.
+	for (uint64_t i = 0; i < theSwitchCount; ++i)
+		handle.resume();
+	printResult(theIOCoreName, "switch", 1, theSwitchCount, getNsec() - t1);
+}
+
+static IOCoroutine
+iocoreEmptyF() { co_return; }
+
+static uint64_t
+iocoreCreateMany(
+	uint64_t count)
+{
+	uint64_t t1 = getNsec();
+	for (uint64_t i = 0; i < count; ++i)
+		iocoreEmptyF();
+	return getNsec() - t1;
+}
+
+// The frames come from the pool of the core running in the current thread.
+static IOCoroutine
+iocoreFramePoolF(
+	IOCore *core,
+	uint64_t *duration,
+	uint64_t *missCount)
+{
+	co_await core->schedule();
+	assert(IOCore::current() == core);
+	*missCount = core->framePool().missCount();
+	*duration = iocoreCreateMany(theFrameCount);
+	*missCount = core->framePool().missCount() - *missCount;
+	core->stop();
+	co_return;
+}
+
+static void
+iocoreBenchFrame()
+{
+	// Outside of any core the frames come from the heap.
+	assert(IOCore::current() == nullptr);
+	uint64_t duration = iocoreCreateMany(theFrameCount);
+	printResult(theIOCoreName, "frame-heap", 1, theFrameCount, duration);
+
+	IOCore core;
+	uint64_t missCount = 0;
+	iocoreFramePoolF(&core, &duration, &missCount);
+	while (!core.isStopped())
+		core.roll();
+	// Only the first frame of its size class is a miss.
+	assert(missCount <= 1);
+	MAYBE_UNUSED(missCount);
+	printResult(theIOCoreName, "frame-pool", 1, theFrameCount, duration);
+}
+
+struct IOCoreBench
+{
+	IOCore myCore;
+	uint32_t myActiveCount;
+};
+
+// The client sends first, the peer sends back, 'count' times each. If the latencies are
+// given, the client saves the time of each round trip there.
+static IOCoroutine
+iocoreExchangeF(
+	IOCoreBench *bench,
+	IOTask *task,
+	uint64_t count,
+	bool isFirst,
+	uint64_t *latencies)
+{
+	uint8_t data = 0;
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		ssize_t rc;
+		uint64_t t1 = latencies != nullptr ? getNsec() : 0;
+		if (isFirst)
+		{
+			rc = co_await task->asyncSend(&data, 1);
+			assert(rc == 1);
+		}
+		rc = co_await task->asyncRecv(&data, 1);
+		assert(rc == 1);
+		if (!isFirst)
+		{
+			rc = co_await task->asyncSend(&data, 1);
+			assert(rc == 1);
+		}
+		else if (latencies != nullptr)
+		{
+			latencies[i] = getNsec() - t1;
+		}
+		MAYBE_UNUSED(rc);
+	}
+	if (--bench->myActiveCount == 0)
+		bench->myCore.stop();
+	co_return;
+}
+
+static uint64_t
+iocoreRunExchange(
+	const BenchSockets &sockets,
+	uint64_t countPerClient,
+	uint64_t *latencies = nullptr)
+{
+	IOCoreBench bench;
+	std::vector<IOTask *> tasks;
+	tasks.reserve(sockets.myFds.size());
+	for (int fd : sockets.myFds)
+		tasks.push_back(bench.myCore.subscribe(fd));
+	bench.myActiveCount = tasks.size();
+
+	uint64_t t1 = getNsec();
+	for (size_t i = 0; i < tasks.size(); ++i)
+		iocoreExchangeF(&bench, tasks[i], countPerClient, i % 2 == 0, latencies);
+	while (!bench.myCore.isStopped())
+		bench.myCore.roll();
+	uint64_t duration = getNsec() - t1;
+
+	// The tasks own the sockets.
+	for (IOTask *task : tasks)
+		task->close();
+	return duration;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// libcoro
+
+static void *
+libcoroSwitchF(
+	void *arg)
+{
+	uint64_t count = *(uint64_t *)arg;
+	for (uint64_t i = 0; i < count; ++i)
+		coro_yield();
+	return nullptr;
+}
+
+static void
+libcoroBenchSwitch()
+{
+	uint64_t count = theSwitchCount;
+	coro_sched_init();
+	uint64_t t1 = getNsec();
+	coro *c = coro_new(libcoroSwitchF, &count);
+	coro_sched_run();
+	uint64_t duration = getNsec() - t1;
+	coro_join(c);
+	coro_sched_destroy();
+	printResult(theLibcoroName, "switch", 1, theSwitchCount, duration);
+}
+
+// libcoro has no IO of its own. The sockets are polled by a separate coroutine via epoll,
+// which wakes up the coroutines waiting for them. It blocks in epoll_wait() only when all
+// the workers are waiting, otherwise it just yields.
+struct LibcoroBench
+{
+	int myEpollFd;
+	uint32_t myWorkerCount;
+	uint32_t myWaitCount;
+};
+
+struct LibcoroSocket
+{
+	LibcoroBench *myBench;
+	int myFd;
+	coro *myWaiter;
+	uint64_t myCount;
+	bool myIsFirst;
+	// Round trip times of the first side, if needed.
+	uint64_t *myLatencies;
+};
+
+static void
+libcoroWait(
+	LibcoroSocket *sock)
+{
+	assert(sock->myWaiter == nullptr);
+	sock->myWaiter = coro_this();
+	++sock->myBench->myWaitCount;
+	coro_suspend();
+}
+
+static void
+libcoroRecv(
+	LibcoroSocket *sock,
+	uint8_t *data)
+{
+	ssize_t rc;
+	while ((rc = recv(sock->myFd, data, 1, 0)) < 0)
+	{
+		assert(errno == EAGAIN);
+		libcoroWait(sock);
+	}
+	assert(rc == 1);
+}
+
+static void
+libcoroSend(
+	LibcoroSocket *sock,
+	const uint8_t *data)
+{
+	ssize_t rc;
+	while ((rc = send(sock->myFd, data, 1, 0)) < 0)
+	{
+		assert(errno == EAGAIN);
+		libcoroWait(sock);
+	}
+	assert(rc == 1);
+}
+
+static void *
+libcoroExchangeF(
+	void *arg)
+{
+	LibcoroSocket *sock = (LibcoroSocket *)arg;
+	uint8_t data = 0;
+	for (uint64_t i = 0; i < sock->myCount; ++i)
+	{
+		uint64_t t1 = sock->myLatencies != nullptr ? getNsec() : 0;
+		if (sock->myIsFirst)
+			libcoroSend(sock, &data);
+		libcoroRecv(sock, &data);
+		if (!sock->myIsFirst)
+			libcoroSend(sock, &data);
+		else if (sock->myLatencies != nullptr)
+			sock->myLatencies[i] = getNsec() - t1;
+	}
+	--sock->myBench->myWorkerCount;
+	return nullptr;
+}
+
+static void *
+libcoroPollF(
+	void *arg)
+{
+	LibcoroBench *bench = (LibcoroBench *)arg;
+	epoll_event events[128];
+	while (bench->myWorkerCount > 0)
+	{
+		int timeout = bench->myWaitCount == bench->myWorkerCount ? -1 : 0;
+		int count = epoll_wait(bench->myEpollFd, events, 128, timeout);
+		assert(count >= 0);
+		for (int i = 0; i < count; ++i)
+		{
+			LibcoroSocket *sock = (LibcoroSocket *)events[i].data.ptr;
+			if (sock->myWaiter == nullptr)
+				continue;
+			coro_wakeup(sock->myWaiter);
+			sock->myWaiter = nullptr;
+			--bench->myWaitCount;
+		}
+		coro_yield();
+	}
+	return nullptr;
+}
+
+static uint64_t
+libcoroRunExchange(
+	const BenchSockets &sockets,
+	uint64_t countPerClient,
+	uint64_t *latencies = nullptr)
+{
+	LibcoroBench bench;
+	bench.myEpollFd = epoll_create1(0);
+	assert(bench.myEpollFd >= 0);
+	bench.myWorkerCount = sockets.myFds.size();
+	bench.myWaitCount = 0;
+	std::vector<LibcoroSocket> socks(sockets.myFds.size());
+	for (size_t i = 0; i < socks.size(); ++i)
+	{
+		LibcoroSocket &sock = socks[i];
+		sock.myBench = &bench;
+		sock.myFd = sockets.myFds[i];
+		sock.myWaiter = nullptr;
+		sock.myCount = countPerClient;
+		sock.myIsFirst = i % 2 == 0;
+		sock.myLatencies = latencies;
+		epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.ptr = &sock;
+		int rc = epoll_ctl(bench.myEpollFd, EPOLL_CTL_ADD, sock.myFd, &ev);
+		assert(rc == 0);
+		MAYBE_UNUSED(rc);
+	}
+
+	coro_sched_init();
+	std::vector<coro *> coros;
+	coros.reserve(socks.size() + 1);
+	uint64_t t1 = getNsec();
+	for (LibcoroSocket &sock : socks)
+		coros.push_back(coro_new(libcoroExchangeF, &sock));
+	coros.push_back(coro_new(libcoroPollF, &bench));
+	coro_sched_run();
+	uint64_t duration = getNsec() - t1;
+	for (coro *c : coros)
+		coro_join(c);
+	coro_sched_destroy();
+
+	close(bench.myEpollFd);
+	for (int fd : sockets.myFds)
+		close(fd);
+	return duration;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static void
+benchPingPong()
+{
+	std::vector<uint64_t> latencies(thePingPongCount);
+	BenchSockets sockets(1);
+	iocoreRunExchange(sockets, thePingPongCount, latencies.data());
+	printLatency(theIOCoreName, "pingpong", latencies);
+
+	BenchSockets sockets2(1);
+	libcoroRunExchange(sockets2, thePingPongCount, latencies.data());
+	printLatency(theLibcoroName, "pingpong", latencies);
+}
+
+static void
+benchThroughput()
+{
+	// Each client takes 2 descriptors. Keep a few for the epoll, io_uring, stdio.
+	rlimit lim;
+	int rc = getrlimit(RLIMIT_NOFILE, &lim);
+	assert(rc == 0);
+	MAYBE_UNUSED(rc);
+	uint32_t maxClientCount = (lim.rlim_cur - 32) / 2;
+	for (uint32_t clientCount : theClientCounts)
+	{
+		if (clientCount > maxClientCount)
+		{
+			fprintf(stderr, "%u clients don't fit into the descriptor limit %llu, "
+				"using %u\n", clientCount, (unsigned long long)lim.rlim_cur,
+				maxClientCount);
+			clientCount = maxClientCount;
+		}
+		uint64_t countPerClient = std::max<uint64_t>(
+			theThroughputMsgCount / clientCount, 1);
+		uint64_t opCount = countPerClient * clientCount;
+		{
+			BenchSockets sockets(clientCount);
+			uint64_t duration = iocoreRunExchange(sockets, countPerClient);
+			printResult(theIOCoreName, "throughput", clientCount, opCount, duration);
+		}
+		{
+			BenchSockets sockets(clientCount);
+			uint64_t duration = libcoroRunExchange(sockets, countPerClient);
+			printResult(theLibcoroName, "throughput", clientCount, opCount, duration);
+		}
+	}
+}
+
+int main()
+{
+	printf("impl,case,clients,ops,ns_per_op,ops_per_sec\n");
+	iocoreBenchSwitch();
+	libcoroBenchSwitch();
+	iocoreBenchFrame();
+	benchPingPong();
+	benchThroughput();
+	assert(IOCoroutinePromise::theCount.load(std::memory_order_relaxed) == 0);
+	assert(IOTask::theCount.load(std::memory_order_relaxed) == 0);
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+BenchSockets::BenchSockets(
+	uint32_t count)
+{
+	myFds.reserve(count * 2);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		int fds[2];
+		int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+		assert(rc == 0);
+		MAYBE_UNUSED(rc);
+		makeFdNonblock(fds[0]);
+		makeFdNonblock(fds[1]);
+		myFds.push_back(fds[0]);
+		myFds.push_back(fds[1]);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t
+getNsec()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1'000'000'000 + t.tv_nsec;
+}
+
+static void
+makeFdNonblock(
+	int fd)
+{
+	int rc = fcntl(fd, F_GETFL, 0);
+	assert(rc >= 0);
+	rc = fcntl(fd, F_SETFL, rc | O_NONBLOCK);
+	assert(rc == 0);
+}
+
+static void
+printResult(
+	const char *impl,
+	const char *name,
+	uint32_t clientCount,
+	uint64_t opCount,
+	uint64_t duration)
+{
+	printf("%s,%s,%u,%llu,%.1f,%.0f\n", impl, name, clientCount,
+		(unsigned long long)opCount, (double)duration / opCount,
+		opCount * 1'000'000'000.0 / duration);
+	fflush(stdout);
+}
+
+// One row per percentile, like "pingpong-p99". The time per operation there is the
+// latency of that percentile, and the operations are the round trips.
+static void
+printLatency(
+	const char *impl,
+	const char *name,
+	std::vector<uint64_t> &latencies)
+{
+	static constexpr struct
+	{
+		const char *mySuffix;
+		double myQuantile;
+	} thePercentiles[] = {
+		{"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}, {"max", 1},
+	};
+	std::sort(latencies.begin(), latencies.end());
+	uint64_t count = latencies.size();
+	for (const auto &p : thePercentiles)
+	{
+		uint64_t idx = std::min<uint64_t>(p.myQuantile * count, count - 1);
+		char fullName[64];
+		snprintf(fullName, sizeof(fullName), "%s-%s", name, p.mySuffix);
+		printResult(impl, fullName, 1, count, latencies[idx] * count);
+	}
+}
@@ -1,32 +1,590 @@
 #include "iocoro.h"
 
+#include <algorithm>
 #include <cassert>
+#include <climits>
 #include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#if IOCORE_USE_URING
+#include <linux/io_uring.h>
+#endif
+#include <pthread.h>
+#include <sched.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/sendfile.h>
 
+// Initial and minimal size of the epoll_wait() batch.
 static constexpr int theEpollBatchSize = 128;
+static constexpr int theEpollBatchMaxSize = 8192;
+#if IOCORE_USE_URING
+static constexpr uint32_t theUringEntryCount = 4096;
+// Completions which aren't operations.
+static constexpr uint64_t theUringEventTag = 0;
+static constexpr uint64_t theUringCancelTag = 1;
+#endif
 
 std::atomic_int IOCoroutinePromise::theCount{0};
+std::atomic_int TaskPromiseBase::theCount{0};
 std::atomic_int IOTask::theCount{0};
 
+static thread_local IOCore *theCurrentCore = nullptr;
+
+static uint64_t
+getMsec()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000 + t.tv_nsec / 1'000'000;
+}
+
+static uint64_t
+getUsec()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1'000'000 + t.tv_nsec / 1000;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Each frame is prefixed with its owner and size class. The header size keeps the frame
+// aligned as the coroutine expects.
+struct IOCoroFrameHeader
+{
+	alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) IOCoroFramePool *myOwner;
+	uint32_t myClass;
+};
+
+// A free frame stores the list link in its body.
+struct IOCoroFrame
+{
+	IOCoroFrameHeader myHeader;
+	IOCoroFrame *myNext;
+};
+
+static constexpr size_t theCoroFrameHeaderSize = sizeof(IOCoroFrameHeader);
+
+IOCoroFramePool::IOCoroFramePool()
+	: myHitCount(0)
+	, myMissCount(0)
+{
+	for (size_t i = 0; i < theCoroFrameClassCount; ++i)
+	{
+		myLists[i] = nullptr;
+		myRemoteLists[i].store(nullptr, std::memory_order_relaxed);
+	}
+}
+
+IOCoroFramePool::~IOCoroFramePool()
+{
+	for (size_t i = 0; i < theCoroFrameClassCount; ++i)
+	{
+		IOCoroFrame *lists[2] = {myLists[i],
+			myRemoteLists[i].exchange(nullptr, std::memory_order_acquire)};
+		for (IOCoroFrame *next : lists)
+		{
+			while (next != nullptr)
+			{
+				IOCoroFrame *frame = next;
+				next = frame->myNext;
+				::operator delete(frame);
+			}
+		}
+		myLists[i] = nullptr;
+	}
+}
+
+void *
+IOCoroFramePool::allocate(
+	size_t size)
+{
+	IOCore *core = theCurrentCore;
+	if (core != nullptr && size + theCoroFrameHeaderSize <= theCoroFrameMaxSize)
+		return core->framePool().popFrame(size);
+	IOCoroFrame *frame = (IOCoroFrame *)::operator new(size + theCoroFrameHeaderSize);
+	frame->myHeader.myOwner = nullptr;
+	return (char *)frame + theCoroFrameHeaderSize;
+}
+
+void
+IOCoroFramePool::deallocate(
+	void *ptr)
+{
+	IOCoroFrame *frame = (IOCoroFrame *)((char *)ptr - theCoroFrameHeaderSize);
+	IOCoroFramePool *owner = frame->myHeader.myOwner;
+	if (owner == nullptr)
+	{
+		::operator delete(frame);
+		return;
+	}
+	IOCore *core = theCurrentCore;
+	if (core == nullptr || &core->framePool() != owner)
+	{
+		owner->pushFrameRemote(frame);
+		return;
+	}
+	IOCoroFrame *&list = owner->myLists[frame->myHeader.myClass];
+	frame->myNext = list;
+	list = frame;
+}
+
+void *
+IOCoroFramePool::popFrame(
+	size_t size)
+{
+	uint32_t cls = (size + theCoroFrameHeaderSize - 1) / theCoroFrameAlign;
+	IOCoroFrame *&list = myLists[cls];
+	if (list == nullptr)
+	{
+		// Single consumer takes the whole list at once, so there is no ABA problem.
+		list = myRemoteLists[cls].exchange(nullptr, std::memory_order_acquire);
+	}
+	IOCoroFrame *frame = list;
+	if (frame != nullptr)
+	{
+		list = frame->myNext;
+		++myHitCount;
+	}
+	else
+	{
+		// The full class size, so as the frame could be reused for any size of the class.
+		frame = (IOCoroFrame *)::operator new((cls + 1) * theCoroFrameAlign);
+		frame->myHeader.myOwner = this;
+		frame->myHeader.myClass = cls;
+		++myMissCount;
+	}
+	return (char *)frame + theCoroFrameHeaderSize;
+}
+
+void
+IOCoroFramePool::pushFrameRemote(
+	IOCoroFrame *frame)
+{
+	std::atomic<IOCoroFrame *> &list = myRemoteLists[frame->myHeader.myClass];
+	IOCoroFrame *head = list.load(std::memory_order_relaxed);
+	do
+	{
+		frame->myNext = head;
+	} while (!list.compare_exchange_weak(head, frame, std::memory_order_release,
+		std::memory_order_relaxed));
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 AsyncOperation::AsyncOperation(IOTask *sub)
 	: myTask(sub)
+	, myTimerIdx(-1)
+	, myDeadlineMs(0)
+	, myCancelToken(nullptr)
+	, myCancelPrev(nullptr)
+	, myCancelNext(nullptr)
+#if IOCORE_USE_URING
+	, myIsSubmitted(false)
+	, myCancelErr(0)
+#endif
 {
 }
 
 bool
 AsyncOperation::await_suspend(
 	std::coroutine_handle<> coro)
+{
+	startWaiting(coro);
+#if IOCORE_USE_URING
+	myTask->myCore.submitOperation(this);
+#endif
+	return true;
+}
+
+void
+AsyncOperation::startWaiting(
+	std::coroutine_handle<> coro)
 {
 	assert(myTask->myAsyncOp == nullptr);
 	myCoro = coro;
 	myTask->myAsyncOp = this;
+}
+
+void
+AsyncOperation::setTimeout(
+	uint64_t timeoutMs)
+{
+	assert(myTask->myAsyncOp == this);
+	assert(myTimerIdx < 0);
+	myDeadlineMs = getMsec() + timeoutMs;
+	myTask->myCore.addTimer(this);
+}
+
+void
+AsyncOperation::setCancelToken(
+	IOCancelToken *token)
+{
+	assert(myTask->myAsyncOp == this);
+	assert(myCancelToken == nullptr);
+	myCancelToken = token;
+	myCancelPrev = nullptr;
+	myCancelNext = token->myOps;
+	if (myCancelNext != nullptr)
+		myCancelNext->myCancelPrev = this;
+	token->myOps = this;
+}
+
+void
+AsyncOperation::removeCancelToken()
+{
+	if (myCancelPrev != nullptr)
+		myCancelPrev->myCancelNext = myCancelNext;
+	else
+		myCancelToken->myOps = myCancelNext;
+	if (myCancelNext != nullptr)
+		myCancelNext->myCancelPrev = myCancelPrev;
+	myCancelToken = nullptr;
+	myCancelPrev = nullptr;
+	myCancelNext = nullptr;
+}
+
+void
+AsyncOperation::onTimer()
+{
+	cancel(ETIMEDOUT);
+}
+
+void
+AsyncOperation::cancel(
+	int err)
+{
+	IOTask *s = myTask;
+	assert(s->myAsyncOp == this);
+#if IOCORE_USE_URING
+	if (myIsSubmitted)
+	{
+		// The operation ends when the kernel confirms the cancellation. The first reason
+		// wins.
+		if (myCancelErr == 0)
+		{
+			myCancelErr = err;
+			s->myCore.cancelOperation(this);
+		}
+		return;
+	}
+#endif
+	s->myAsyncOp = nullptr;
+	onCancel(err);
+}
+
+void
+AsyncOperation::resume()
+{
+	if (myTimerIdx >= 0)
+		myTask->myCore.removeTimer(this);
+	if (myCancelToken != nullptr)
+		removeCancelToken();
+	myCoro.resume();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+IOCancelToken::~IOCancelToken()
+{
+	assert(myOps == nullptr);
+}
+
+void
+IOCancelToken::cancel()
+{
+	myIsCancelled = true;
+	while (myOps != nullptr)
+	{
+		AsyncOperation *op = myOps;
+		op->removeCancelToken();
+		op->cancel(ECANCELED);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncSyscall::AsyncSyscall(
+	IOTask *sub,
+	IOEventBit event)
+	: AsyncOperation(sub)
+	, myRes(-1)
+	, myEvent(event)
+	, myIsDone(false)
+	, myErr(0)
+{
+}
+
+ssize_t
+AsyncSyscall::await_resume()
+{
+	if (myRes < 0)
+		errno = myErr;
+	return myRes;
+}
+
+int
+AsyncSyscall::taskFd() const
+{
+	return myTask->myFd;
+}
+
+void
+AsyncSyscall::execute()
+{
+	while (!myIsDone && (myTask->myEventsReady & myEvent) != 0)
+	{
+		ssize_t rc = doSyscall();
+		if (rc >= 0)
+		{
+			myIsDone = onSyscallDone(rc);
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno == EWOULDBLOCK || errno == EAGAIN)
+		{
+			// The event is consumed. Wait for a new one.
+			myTask->myEventsReady &= ~myEvent;
+			return;
+		}
+		myRes = -1;
+		myErr = errno;
+		myIsDone = true;
+	}
+}
+
+bool
+AsyncSyscall::onSyscallDone(
+	ssize_t rc)
+{
+	myRes = rc;
+	return true;
+}
+
+bool
+AsyncSyscall::onIOEvent()
+{
+	if ((myTask->myEventsReady & myEvent) == 0)
+	{
+		if (myTask->myState == IO_TASK_STATE_DELETING)
+		{
+			onCancel(ECANCELED);
+			return true;
+		}
+		return false;
+	}
+	execute();
+	// Could be a spurious wakeup or a partial progress.
+	if (!myIsDone)
+		return false;
+	resume();
 	return true;
 }
 
+void
+AsyncSyscall::onCancel(
+	int err)
+{
+	finishWithError(err);
+}
+
+void
+AsyncSyscall::finishWithError(
+	int err)
+{
+	myRes = -1;
+	myErr = err;
+	myIsDone = true;
+	resume();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncRecvv::AsyncRecvv(
+	IOTask *sub,
+	const iovec *vecs,
+	int count)
+	: AsyncSyscall(sub, IO_EVENT_READ)
+	, myVecs(vecs)
+	, myCount(count)
+{
+	execute();
+}
+
+ssize_t
+AsyncRecvv::doSyscall()
+{
+	return readv(taskFd(), myVecs, myCount);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncSendv::AsyncSendv(
+	IOTask *sub,
+	const iovec *vecs,
+	int count)
+	: AsyncSyscall(sub, IO_EVENT_WRITE)
+	, myVecs(vecs)
+	, myCount(count)
+{
+	execute();
+}
+
+ssize_t
+AsyncSendv::doSyscall()
+{
+	return writev(taskFd(), myVecs, myCount);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncSendAll::AsyncSendAll(
+	IOTask *sub,
+	iovec *vecs,
+	int count)
+	: AsyncSyscall(sub, IO_EVENT_WRITE)
+	, myVecs(vecs)
+	, myCount(count)
+	, myTotal(0)
+{
+	for (int i = 0; i < count; ++i)
+		myTotal += vecs[i].iov_len;
+	execute();
+}
+
+AsyncSendAll::AsyncSendAll(
+	IOTask *sub,
+	const void *data,
+	size_t size)
+	: AsyncSyscall(sub, IO_EVENT_WRITE)
+	, myVecs(&myVec)
+	, myCount(1)
+	, myTotal(size)
+{
+	myVec.iov_base = (void *)data;
+	myVec.iov_len = size;
+	execute();
+}
+
+ssize_t
+AsyncSendAll::doSyscall()
+{
+	return writev(taskFd(), myVecs, std::min(myCount, IOV_MAX));
+}
+
+bool
+AsyncSendAll::onSyscallDone(
+	ssize_t rc)
+{
+	size_t size = rc;
+	while (myCount > 0 && size >= myVecs->iov_len)
+	{
+		size -= myVecs->iov_len;
+		++myVecs;
+		--myCount;
+	}
+	if (myCount == 0)
+	{
+		myRes = myTotal;
+		return true;
+	}
+	myVecs->iov_base = (char *)myVecs->iov_base + size;
+	myVecs->iov_len -= size;
+	return false;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncSendfile::AsyncSendfile(
+	IOTask *sub,
+	int fileFd,
+	off_t *offset,
+	size_t size)
+	: AsyncSyscall(sub, IO_EVENT_WRITE)
+	, myFileFd(fileFd)
+	, myOffset(offset)
+	, mySize(size)
+{
+	execute();
+}
+
+ssize_t
+AsyncSendfile::doSyscall()
+{
+	return sendfile(taskFd(), myFileFd, myOffset, mySize);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncSplice::AsyncSplice(
+	IOTask *sub,
+	int pipeFd,
+	size_t size)
+	: AsyncSyscall(sub, IO_EVENT_WRITE)
+	, myPipeFd(pipeFd)
+	, mySize(size)
+{
+	execute();
+}
+
+ssize_t
+AsyncSplice::doSyscall()
+{
+	return splice(myPipeFd, nullptr, taskFd(), nullptr, mySize,
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncSleep::AsyncSleep(
+	IOTask *sub,
+	uint64_t durationMs)
+	: AsyncOperation(sub)
+	, myDurationMs(durationMs)
+	, myRes(-1)
+{
+}
+
+bool
+AsyncSleep::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	// Only a timer, nothing to wait from the kernel.
+	startWaiting(coro);
+	setTimeout(myDurationMs);
+	return true;
+}
+
+bool
+AsyncSleep::onIOEvent()
+{
+	// IO events don't matter for sleeping. Only the task closure.
+	if (myTask->myState != IO_TASK_STATE_DELETING)
+		return false;
+	onCancel(ECANCELED);
+	return true;
+}
+
+void
+AsyncSleep::onCancel(
+	int err)
+{
+	myRes = -1;
+	errno = err;
+	resume();
+}
+
+void
+AsyncSleep::onTimer()
+{
+	assert(myTask->myAsyncOp == this);
+	myTask->myAsyncOp = nullptr;
+	myRes = 0;
+	resume();
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 AsyncRecv::AsyncRecv(
@@ -61,9 +619,7 @@ AsyncRecv::onIOEvent()
 	{
 		if (myTask->myState == IO_TASK_STATE_DELETING)
 		{
-			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
+			onCancel(ECANCELED);
 			return true;
 		}
 		return false;
@@ -72,10 +628,19 @@ AsyncRecv::onIOEvent()
 	// Could be a spurious wakeup.
 	if (myRes < 0)
 		return false;
-	myCoro.resume();
+	resume();
 	return true;
 }
 
+void
+AsyncRecv::onCancel(
+	int err)
+{
+	myRes = -1;
+	errno = err;
+	resume();
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 AsyncSend::AsyncSend(
@@ -110,9 +675,7 @@ AsyncSend::onIOEvent()
 	{
 		if (myTask->myState == IO_TASK_STATE_DELETING)
 		{
-			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
+			onCancel(ECANCELED);
 			return true;
 		}
 		return false;
@@ -121,10 +684,19 @@ AsyncSend::onIOEvent()
 	// Could be a spurious wakeup.
 	if (myRes < 0)
 		return false;
-	myCoro.resume();
+	resume();
 	return true;
 }
 
+void
+AsyncSend::onCancel(
+	int err)
+{
+	myRes = -1;
+	errno = err;
+	resume();
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 AsyncAccept::AsyncAccept(
@@ -159,9 +731,7 @@ AsyncAccept::onIOEvent()
 	{
 		if (myTask->myState == IO_TASK_STATE_DELETING)
 		{
-			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
+			onCancel(ECANCELED);
 			return true;
 		}
 		return false;
@@ -170,10 +740,19 @@ AsyncAccept::onIOEvent()
 	// Could be a spurious wakeup.
 	if (myRes < 0)
 		return false;
-	myCoro.resume();
+	resume();
 	return true;
 }
 
+void
+AsyncAccept::onCancel(
+	int err)
+{
+	myRes = -1;
+	errno = err;
+	resume();
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 AsyncConnect::AsyncConnect(
@@ -181,9 +760,17 @@ AsyncConnect::AsyncConnect(
 	const sockaddr *addr,
 	socklen_t size)
 	: AsyncOperation(sub)
+#if IOCORE_USE_URING
+	, myAddr(addr)
+	, mySize(size)
+#endif
 	, myIsDone(false)
 	, myRes(-1)
 {
+#if IOCORE_USE_URING
+	// Connect is submitted with the coroutine suspension.
+	MAYBE_UNUSED(addr, size);
+#else
 	int rc = connect(myTask->myFd, addr, size);
 	if (rc == 0)
 	{
@@ -196,6 +783,7 @@ AsyncConnect::AsyncConnect(
 	assert(errno == EINPROGRESS);
 	// Apparently, it is not writable yet.
 	myTask->myEventsReady &= ~IO_EVENT_WRITE;
+#endif
 }
 
 bool
@@ -205,30 +793,55 @@ AsyncConnect::onIOEvent()
 	{
 		if (myTask->myState == IO_TASK_STATE_DELETING)
 		{
-			// Cancellation.
-			myIsDone = true;
-			myRes = -1;
-			myCoro.resume();
+			onCancel(ECANCELED);
 			return true;
 		}
 		return false;
 	}
 	myIsDone = true;
 	myRes = 0;
-	myCoro.resume();
+	resume();
 	return true;
 }
 
+void
+AsyncConnect::onCancel(
+	int err)
+{
+	myIsDone = true;
+	myRes = -1;
+	errno = err;
+	resume();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+bool
+AsyncSchedule::await_ready() const noexcept
+{
+	return IOCore::current() == &myCore;
+}
+
+void
+AsyncSchedule::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	myCoro = coro;
+	myCore.pushSchedule(this);
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 IOTask::IOTask(
 	IOCore &core,
 	int fd)
 	: myState(IO_TASK_STATE_NEW)
+	, myQueueState(IO_TASK_STATE_NEW)
 	, myFd(fd)
 	, myIdx(-1)
 	, myEventsReady(0)
 	, myAsyncOp(nullptr)
+	, myQueueNext(nullptr)
 	, myCore(core)
 {
 	LOG_DEBUG("IOTask create");
@@ -255,28 +868,80 @@ IOTask::close()
 //////////////////////////////////////////////////////////////////////////////////////////
 
 IOCore::IOCore()
+#if IOCORE_USE_URING
+	: myFd(-1)
+#else
 	: myFd(epoll_create1(0))
+#endif
+	, myQueueHead(nullptr)
+	, myScheduleHead(nullptr)
+	, myTaskCount(0)
+	, myBusyPollUsec(0)
+	, myStats()
+#if IOCORE_USE_URING
+	, myRing(theUringEntryCount)
+	, myInFlightCount(0)
+	, myEventBuf(0)
+#else
+	, myEvents(theEpollBatchSize)
+#endif
 {
 	LOG_DEBUG("IOCore create");
 	myIsStopped = false;
 	// Eventfd is used to wakeup from epoll_wait() for handling non-kernel events. For
 	// example, to let IOCore know, that there are new or deleting tasks to process.
+#if IOCORE_USE_URING
+	// With io_uring it is just read, and the read completes on the wakeup.
+	myEventFd = eventfd(0, 0);
+	myEventSub = nullptr;
+	submitEventRead();
+#else
 	myEventFd = eventfd(0, EFD_NONBLOCK);
 	myEventSub = subscribe(myEventFd);
+#endif
 }
 
 IOCore::~IOCore()
 {
 	LOG_DEBUG("IOCore destroy");
+#if IOCORE_USE_URING
+	// Cancel the pending eventfd read and wait for the kernel to release everything.
+	int eventFd = myEventFd;
+	myEventFd = -1;
+	io_uring_sqe *sqe = myRing.getSqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = theUringEventTag;
+	sqe->user_data = theUringCancelTag;
+	++myInFlightCount;
+	processQueues();
+	while (myInFlightCount > 0)
+	{
+		myRing.enter(1, -1);
+		uint64_t userData;
+		int res;
+		while (myRing.popCqe(&userData, &res))
+			handleCompletion(userData, res);
+	}
+	int rc = close(eventFd);
+	assert(rc == 0);
+#else
+	// The core could be stopped before rolling even once. Then the eventfd task is still
+	// in the queue, and it can only be unsubscribed after being added.
+	processQueues();
 	unsubscribe(myEventSub);
 	myEventSub = nullptr;
 	myEventFd = -1;
 	processQueues();
+#endif
 	assert(myTasks.empty());
-	assert(myQueue.empty());
+	assert(myQueueHead.load(std::memory_order_relaxed) == nullptr);
+	assert(myScheduleHead.load(std::memory_order_relaxed) == nullptr);
+	assert(myTimers.empty());
+#if !IOCORE_USE_URING
 	assert(myFd >= 0);
 	int rc = close(myFd);
 	assert(rc == 0);
+#endif
 }
 
 void
@@ -291,15 +956,9 @@ IOTask *
 IOCore::subscribe(
 	int fd)
 {
-	std::unique_lock lock(myMutex);
-	for (IOTask *s : myTasks)
-		assert(s->myFd != fd);
-	for (IOTask *s : myQueue)
-		assert(s->myFd != fd);
 	IOTask *s = new IOTask(*this, fd);
-	myQueue.push_back(s);
-	mySize.fetch_add(1, std::memory_order_relaxed);
-	wakeup();
+	myTaskCount.fetch_add(1, std::memory_order_relaxed);
+	pushQueue(s);
 	return s;
 }
 
@@ -307,37 +966,301 @@ void
 IOCore::unsubscribe(
 	IOTask *s)
 {
-	std::unique_lock lock(myMutex);
-	for (IOTask *is : myQueue)
-		assert(is != s);
-	assert(myTasks[s->myIdx] == s);
-	assert(s->myState == IO_TASK_STATE_WORKING);
-	s->myState = IO_TASK_STATE_DELETING;
-	myQueue.push_back(s);
-	mySize.fetch_add(1, std::memory_order_relaxed);
-	wakeup();
+	// The state is changed by the core itself. A working task in the queue means the
+	// deletion.
+	IOTaskState state = IO_TASK_STATE_WORKING;
+	bool ok = s->myQueueState.compare_exchange_strong(state, IO_TASK_STATE_DELETING,
+		std::memory_order_acquire);
+	assert(ok);
+	pushQueue(s);
+}
+
+void
+IOCore::pushQueue(
+	IOTask *s)
+{
+	assert(s->myQueueNext == nullptr);
+	IOTask *head = myQueueHead.load(std::memory_order_relaxed);
+	do
+	{
+		s->myQueueNext = head;
+	} while (!myQueueHead.compare_exchange_weak(head, s, std::memory_order_release,
+		std::memory_order_relaxed));
+	// Only the producer which found the queue empty wakes the core up. The others are
+	// covered by its wakeup, because the core takes the entire queue at once.
+	if (head == nullptr)
+		wakeup();
+}
+
+void
+IOCore::pushSchedule(
+	AsyncSchedule *op)
+{
+	AsyncSchedule *head = myScheduleHead.load(std::memory_order_relaxed);
+	do
+	{
+		op->myNext = head;
+	} while (!myScheduleHead.compare_exchange_weak(head, op, std::memory_order_release,
+		std::memory_order_relaxed));
+	if (head == nullptr)
+		wakeup();
+}
+
+void
+IOCore::addTimer(
+	AsyncOperation *op)
+{
+	assert(op->myTimerIdx < 0);
+	int idx = myTimers.size();
+	myTimers.push_back(op);
+	op->myTimerIdx = idx;
+	timerSiftUp(idx);
+}
+
+void
+IOCore::removeTimer(
+	AsyncOperation *op)
+{
+	int idx = op->myTimerIdx;
+	assert(idx >= 0 && myTimers[idx] == op);
+	op->myTimerIdx = -1;
+	AsyncOperation *last = myTimers.back();
+	myTimers.pop_back();
+	if (last == op)
+		return;
+	// Put the last one in place of the removed one and restore the heap from there.
+	timerSet(idx, last);
+	timerSiftUp(idx);
+	timerSiftDown(last->myTimerIdx);
+}
+
+void
+IOCore::processTimers()
+{
+	if (myTimers.empty())
+		return;
+	uint64_t now = getMsec();
+	while (!myTimers.empty() && myTimers[0]->myDeadlineMs <= now)
+	{
+		AsyncOperation *op = myTimers[0];
+		removeTimer(op);
+		op->onTimer();
+	}
+}
+
+int
+IOCore::timerWaitMs() const
+{
+	if (myTimers.empty())
+		return -1;
+	uint64_t deadline = myTimers[0]->myDeadlineMs;
+	uint64_t now = getMsec();
+	if (deadline <= now)
+		return 0;
+	return std::min<uint64_t>(deadline - now, INT_MAX);
+}
+
+uint64_t
+IOCore::spinDeadlineUsec(
+	uint32_t busyPollUsec) const
+{
+	uint64_t deadline = getUsec() + busyPollUsec;
+	if (myTimers.empty())
+		return deadline;
+	// Spinning past the nearest timer would make it late.
+	return std::min<uint64_t>(deadline, myTimers[0]->myDeadlineMs * 1000);
+}
+
+void
+IOCore::timerSiftUp(
+	int idx)
+{
+	AsyncOperation *op = myTimers[idx];
+	while (idx > 0)
+	{
+		int parentIdx = (idx - 1) / 2;
+		AsyncOperation *parent = myTimers[parentIdx];
+		if (parent->myDeadlineMs <= op->myDeadlineMs)
+			break;
+		timerSet(idx, parent);
+		idx = parentIdx;
+	}
+	timerSet(idx, op);
+}
+
+void
+IOCore::timerSiftDown(
+	int idx)
+{
+	AsyncOperation *op = myTimers[idx];
+	int size = myTimers.size();
+	while (true)
+	{
+		int childIdx = idx * 2 + 1;
+		if (childIdx >= size)
+			break;
+		if (childIdx + 1 < size &&
+			myTimers[childIdx + 1]->myDeadlineMs < myTimers[childIdx]->myDeadlineMs)
+			++childIdx;
+		AsyncOperation *child = myTimers[childIdx];
+		if (op->myDeadlineMs <= child->myDeadlineMs)
+			break;
+		timerSet(idx, child);
+		idx = childIdx;
+	}
+	timerSet(idx, op);
+}
+
+void
+IOCore::timerSet(
+	int idx,
+	AsyncOperation *op)
+{
+	myTimers[idx] = op;
+	op->myTimerIdx = idx;
+}
+
+#if IOCORE_USE_URING
+
+void
+IOCore::submitOperation(
+	AsyncOperation *op)
+{
+	assert(!op->myIsSubmitted);
+	io_uring_sqe *sqe = myRing.getSqe();
+	op->prepareSqe(sqe);
+	sqe->user_data = (uint64_t)op;
+	op->myIsSubmitted = true;
+	++myInFlightCount;
+}
+
+void
+IOCore::cancelOperation(
+	AsyncOperation *op)
+{
+	assert(op->myIsSubmitted);
+	io_uring_sqe *sqe = myRing.getSqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uint64_t)op;
+	sqe->user_data = theUringCancelTag;
+	++myInFlightCount;
+}
+
+void
+IOCore::submitEventRead()
+{
+	io_uring_sqe *sqe = myRing.getSqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = myEventFd;
+	sqe->addr = (uint64_t)&myEventBuf;
+	sqe->len = sizeof(myEventBuf);
+	sqe->user_data = theUringEventTag;
+	++myInFlightCount;
+}
+
+void
+IOCore::handleCompletion(
+	uint64_t userData,
+	int res)
+{
+	assert(myInFlightCount > 0);
+	--myInFlightCount;
+	if (userData == theUringEventTag)
+	{
+		// A wakeup. Keep listening unless the core is being destroyed.
+		if (myEventFd >= 0)
+			submitEventRead();
+		return;
+	}
+	if (userData == theUringCancelTag)
+	{
+		// The cancelled operation gets its own completion.
+		return;
+	}
+	AsyncOperation *op = (AsyncOperation *)userData;
+	assert(op->myIsSubmitted);
+	op->myIsSubmitted = false;
+	IOTask *s = op->myTask;
+	assert(s->myAsyncOp == op);
+	// Nullify in case the coroutine would try to start a new async operation.
+	s->myAsyncOp = nullptr;
+	if (s->myState == IO_TASK_STATE_DELETING)
+	{
+		op->onCancel(ECANCELED);
+		LOG_THIS_DEBUG(IOCore, handleCompletion, "drop " << s);
+		delete s;
+		return;
+	}
+	if (op->myCancelErr != 0 && res < 0)
+	{
+		op->onCancel(op->myCancelErr);
+		return;
+	}
+	if (op->onCompletion(res))
+		return;
+	// Partial progress or a spurious wakeup. Not worth retrying after the cancellation.
+	if (op->myCancelErr != 0)
+	{
+		op->onCancel(op->myCancelErr);
+		return;
+	}
+	s->myAsyncOp = op;
+	submitOperation(op);
+}
+
+#endif
+
+IOCore *
+IOCore::current()
+{
+	return theCurrentCore;
 }
 
 void
 IOCore::roll()
 {
+	// The coroutines created and freed while handling the events use this core's frame
+	// pool.
+	struct CurrentGuard
+	{
+		CurrentGuard(IOCore *core) : myPrev(theCurrentCore) { theCurrentCore = core; }
+		~CurrentGuard() { theCurrentCore = myPrev; }
+		IOCore *const myPrev;
+	} guard(this);
+
 	processQueues();
-	epoll_event evs[theEpollBatchSize];
-	int rc = epoll_wait(myFd, evs, theEpollBatchSize, -1);
+	++myStats.myRollCount;
+#if IOCORE_USE_URING
+	waitEvents();
+	uint64_t userData;
+	int res;
+	while (myRing.popCqe(&userData, &res))
+	{
+		++myStats.myEventCount;
+		handleCompletion(userData, res);
+	}
+#else
+	int rc = waitEvents();
 	if (rc < 0 && errno == EINTR)
 		return;
 	assert(rc >= 0);
 	LOG_THIS_DEBUG(IOCore, roll, rc << " events");
+	myStats.myEventCount += rc;
 	for (int i = 0; i < rc; ++i)
 	{
-		epoll_event& ev = evs[i];
+		epoll_event& ev = myEvents[i];
 		IOTask *s = (IOTask *)ev.data.ptr;
 		int mask = 0;
 		if ((ev.events & EPOLLIN) != 0)
 			mask |= IO_EVENT_READ;
 		if ((ev.events & EPOLLOUT) != 0)
 			mask |= IO_EVENT_WRITE;
-		assert((ev.events & ~(EPOLLIN | EPOLLOUT)) == 0);
+		// A socket can be added to epoll before its connect is started, when the task is
+		// subscribed in one thread and used in another. Such a socket is reported as hung
+		// up. Let the operations try and see the actual state.
+		if ((ev.events & (EPOLLHUP | EPOLLERR)) != 0)
+			mask |= IO_EVENT_READ | IO_EVENT_WRITE;
+		assert((ev.events & ~(EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR)) == 0);
 		assert(mask != 0);
 		const char *eventStr = "[empty]";
 		if ((mask & IO_EVENT_READ) && (mask & IO_EVENT_WRITE))
@@ -365,36 +1288,124 @@ IOCore::roll()
 				s->myAsyncOp = op;
 		}
 	}
+	// A full batch means there could be more events ready. A small one means the buffer
+	// is too big for the current load.
+	int batchSize = myEvents.size();
+	if (rc == batchSize && batchSize < theEpollBatchMaxSize)
+		myEvents.resize(batchSize * 2);
+	else if (rc < batchSize / 4 && batchSize > theEpollBatchSize)
+		myEvents.resize(batchSize / 2);
+#endif
+	processTimers();
+}
+
+int
+IOCore::waitEvents()
+{
+	int timeoutMs = timerWaitMs();
+	uint32_t busyPollUsec = myBusyPollUsec.load(std::memory_order_relaxed);
+#if IOCORE_USE_URING
+	// The completions are visible in the shared memory, the spinning costs no syscalls.
+	// Only the new submissions are sent first.
+	if (busyPollUsec > 0 && timeoutMs != 0)
+	{
+		myRing.enter(0, 0);
+		uint64_t deadline = spinDeadlineUsec(busyPollUsec);
+		while (true)
+		{
+			++myStats.mySpinCount;
+			if (myRing.hasCqe())
+				return 0;
+			if (getUsec() >= deadline)
+				break;
+		}
+		timeoutMs = timerWaitMs();
+	}
+	// All the operations started since the last roll are submitted by this one syscall,
+	// which also waits for the results.
+	if (timeoutMs != 0)
+		++myStats.mySleepCount;
+	myRing.enter(1, timeoutMs);
+	return 0;
+#else
+	if (busyPollUsec > 0 && timeoutMs != 0)
+	{
+		uint64_t deadline = spinDeadlineUsec(busyPollUsec);
+		while (true)
+		{
+			++myStats.mySpinCount;
+			int rc = epoll_wait(myFd, myEvents.data(), myEvents.size(), 0);
+			if (rc != 0)
+				return rc;
+			if (getUsec() >= deadline)
+				break;
+		}
+		timeoutMs = timerWaitMs();
+	}
+	if (timeoutMs != 0)
+		++myStats.mySleepCount;
+	return epoll_wait(myFd, myEvents.data(), myEvents.size(), timeoutMs);
+#endif
 }
 
 void
 IOCore::processQueues()
 {
-	if (mySize.load(std::memory_order_relaxed) == 0)
-		return;
-	std::unique_lock lock(myMutex);
-	if (myQueue.empty())
+	// Tasks go first, so as a coroutine scheduled right after a subscription would find
+	// its task, most likely, already working.
+	processTaskQueue();
+	processScheduleQueue();
+}
+
+void
+IOCore::processTaskQueue()
+{
+	if (myQueueHead.load(std::memory_order_relaxed) == nullptr)
 		return;
-	for (IOTask *s : myQueue)
+	// The producers push to the head. Reverse the list to handle the tasks in the order
+	// of their pushing. For example, so as a task added and closed right away would be
+	// deleted after its addition.
+	IOTask *next = myQueueHead.exchange(nullptr, std::memory_order_acquire);
+	IOTask *queue = nullptr;
+	while (next != nullptr)
 	{
+		IOTask *s = next;
+		next = s->myQueueNext;
+		s->myQueueNext = queue;
+		queue = s;
+	}
+	while (queue != nullptr)
+	{
+		IOTask *s = queue;
+		queue = s->myQueueNext;
+		s->myQueueNext = nullptr;
 		if (s->myState == IO_TASK_STATE_NEW)
 		{
 			LOG_THIS_DEBUG(IOCore, processQueues, "add " << s);
 			s->myState = IO_TASK_STATE_WORKING;
+			s->myIdx = myTasks.size();
+			s->myQueueState.store(IO_TASK_STATE_WORKING, std::memory_order_release);
+#if IOCORE_USE_URING
+			// Nothing to register. The operations are submitted as they come.
+			s->myEventsReady = 0;
+#else
 			// Assume that in a new socket all the events are there. The task will clear
 			// those which are not really available yet.
 			s->myEventsReady = IO_EVENT_READ | IO_EVENT_WRITE;
-			s->myIdx = myTasks.size();
 			epoll_event ev;
 			memset(&ev, 0, sizeof(ev));
 			ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
 			ev.data.ptr = (void *)s;
 			int rc = epoll_ctl(myFd, EPOLL_CTL_ADD, s->myFd, &ev);
 			assert(rc == 0);
+#endif
 			myTasks.push_back(s);
 		}
-		else if (s->myState == IO_TASK_STATE_DELETING)
+		else if (s->myState == IO_TASK_STATE_WORKING)
 		{
+			assert(s->myQueueState.load(std::memory_order_relaxed) ==
+				IO_TASK_STATE_DELETING);
+			s->myState = IO_TASK_STATE_DELETING;
 			assert(myTasks.size() > s->myIdx);
 			assert(myTasks[s->myIdx] == s);
 			assert(s->myFd >= 0);
@@ -402,8 +1413,21 @@ IOCore::processQueues()
 			// Cyclic deletion, for O(1).
 			myTasks.back()->myIdx = s->myIdx;
 			myTasks[s->myIdx] = myTasks.back();
+			myTasks.resize(myTasks.size() - 1);
+			myTaskCount.fetch_sub(1, std::memory_order_relaxed);
+#if IOCORE_USE_URING
+			if (s->myAsyncOp != nullptr && s->myAsyncOp->myIsSubmitted)
+			{
+				// The kernel still uses the operation. The task is deleted when the
+				// cancelled operation completes.
+				LOG_THIS_DEBUG(IOCore, processQueues, "cancel " << s);
+				cancelOperation(s->myAsyncOp);
+				continue;
+			}
+#else
 			int rc = epoll_ctl(myFd, EPOLL_CTL_DEL, s->myFd, nullptr);
 			assert(rc == 0);
+#endif
 			if (s->myAsyncOp != nullptr)
 			{
 				LOG_THIS_DEBUG(IOCore, processQueues, "cancel " << s);
@@ -412,13 +1436,137 @@ IOCore::processQueues()
 				s->myAsyncOp = nullptr;
 			}
 			delete s;
-			myTasks.resize(myTasks.size() - 1);
 		}
 		else
 		{
 			assert(false);
 		}
 	}
-	myQueue.clear();
-	mySize.store(myTasks.size(), std::memory_order_relaxed);
+}
+
+void
+IOCore::processScheduleQueue()
+{
+	if (myScheduleHead.load(std::memory_order_relaxed) == nullptr)
+		return;
+	AsyncSchedule *next = myScheduleHead.exchange(nullptr, std::memory_order_acquire);
+	AsyncSchedule *queue = nullptr;
+	while (next != nullptr)
+	{
+		AsyncSchedule *op = next;
+		next = op->myNext;
+		op->myNext = queue;
+		queue = op;
+	}
+	while (queue != nullptr)
+	{
+		AsyncSchedule *op = queue;
+		// The operation is a part of the coroutine and is gone after its resume.
+		queue = op->myNext;
+		op->myCoro.resume();
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+IOCoreGroup::IOCoreGroup(
+	uint32_t coreCount,
+	IOCoreBalance balance)
+	: myBalance(balance)
+	, myNextIdx(0)
+{
+	// The process can be limited to some of the CPUs, and their numbers don't have to
+	// be contiguous. Only those are used for pinning.
+	std::vector<int> cpus;
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+	{
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		{
+			if (CPU_ISSET(cpu, &allowed))
+				cpus.push_back(cpu);
+		}
+	}
+	else
+	{
+		LOG_ERROR("IOCoreGroup: sched_getaffinity() failed, the cores are not pinned: "
+			<< strerror(errno));
+	}
+	if (coreCount == 0)
+	{
+		coreCount = cpus.size();
+		if (coreCount == 0)
+			coreCount = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	myCores.reserve(coreCount);
+	for (uint32_t i = 0; i < coreCount; ++i)
+		myCores.push_back(std::make_unique<IOCore>());
+	myThreads.reserve(coreCount);
+	for (uint32_t i = 0; i < coreCount; ++i)
+	{
+		int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+		myThreads.emplace_back(workerF, myCores[i].get(), cpu);
+	}
+}
+
+IOCoreGroup::~IOCoreGroup()
+{
+	stop();
+}
+
+IOCore&
+IOCoreGroup::pickCore()
+{
+	if (myBalance == IO_CORE_BALANCE_ROUND_ROBIN)
+	{
+		uint32_t idx = myNextIdx.fetch_add(1, std::memory_order_relaxed);
+		return *myCores[idx % myCores.size()];
+	}
+	assert(myBalance == IO_CORE_BALANCE_LEAST_LOADED);
+	IOCore *res = myCores[0].get();
+	uint64_t minCount = res->taskCount();
+	for (uint32_t i = 1; i < myCores.size() && minCount > 0; ++i)
+	{
+		uint64_t count = myCores[i]->taskCount();
+		if (count < minCount)
+		{
+			minCount = count;
+			res = myCores[i].get();
+		}
+	}
+	return *res;
+}
+
+void
+IOCoreGroup::stop()
+{
+	for (std::unique_ptr<IOCore> &core : myCores)
+		core->stop();
+	for (std::thread &t : myThreads)
+		t.join();
+	myThreads.clear();
+}
+
+void
+IOCoreGroup::workerF(
+	IOCore *core,
+	int cpu)
+{
+	if (cpu >= 0)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		// Not critical if fails, the core just works unpinned. But then the CPU caches
+		// are shared with the other cores, so better let the user know.
+		int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (rc != 0)
+		{
+			LOG_ERROR("IOCoreGroup: couldn't pin a core to CPU " << cpu << ": "
+				<< strerror(rc));
+		}
+	}
+	while (!core->isStopped())
+		core->roll();
 }
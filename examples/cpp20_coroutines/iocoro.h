@@ -1,16 +1,31 @@
 #pragma once
 
 #include <atomic>
+#include <cerrno>
 #include <coroutine>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <sstream>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #define MAYBE_UNUSED(...) ((void)sizeof(1, ##__VA_ARGS__))
 
+// The backend of IOCore. By default it is epoll: the kernel reports readiness of the
+// sockets and the operations then do their syscalls. With io_uring the operations are
+// submitted to the kernel and IOCore gets their results.
+#ifndef IOCORE_USE_URING
+#define IOCORE_USE_URING 0
+#endif
+
 #define LOG_IMPL(...)                                                                     \
 	do                                                                                    \
 	{                                                                                     \
@@ -23,13 +38,19 @@
 
 // Enable the logging using LOG_IMPL if needed.
 #define LOG_DEBUG LOG_NOP
+#define LOG_ERROR LOG_IMPL
 #define LOG_OBJ_DEBUG(name, obj, method, ...) LOG_NOP(#name "(" << obj << ")::" #method << ": " << __VA_ARGS__)
 #define LOG_THIS_DEBUG(name, ...) LOG_OBJ_DEBUG(name, this, __VA_ARGS__)
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+class IOCancelToken;
 class IOCore;
 class IOTask;
+#if IOCORE_USE_URING
+struct io_uring_cqe;
+struct io_uring_sqe;
+#endif
 
 enum IOEventBit
 {
@@ -46,6 +67,67 @@ enum IOTaskState
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// Coroutine frames are rounded up to this size in the frame pools. Each size class has its
+// own free list.
+static constexpr size_t theCoroFrameAlign = 64;
+// Bigger frames go to the heap directly.
+static constexpr size_t theCoroFrameMaxSize = 2048;
+static constexpr size_t theCoroFrameClassCount = theCoroFrameMaxSize / theCoroFrameAlign;
+
+struct IOCoroFrame;
+
+// Free lists of the coroutine frames created in the thread of one IOCore. A new frame
+// costs a pop from the list of its size class. A frame can be freed in any thread. In
+// the owner core's thread it is pushed back to the same list. Other threads push it to a
+// lock-free list of remote frees which the owner takes at once when its own list is
+// empty. The frames are kept until the core is destroyed, and the core must outlive all
+// the coroutines created in its thread.
+//
+class IOCoroFramePool
+{
+public:
+	IOCoroFramePool();
+	~IOCoroFramePool();
+	IOCoroFramePool(
+		const IOCoroFramePool&) = delete;
+	IOCoroFramePool& operator=(
+		const IOCoroFramePool&) = delete;
+
+	// Get a frame from the pool of the IOCore running in the current thread, or from the
+	// heap if there is no such core.
+	static void *
+	allocate(
+		size_t size);
+
+	// Return the frame to the pool which created it.
+	static void
+	deallocate(
+		void *ptr);
+
+	// Statistics, only valid in the owner core's thread.
+	uint64_t
+	hitCount() const { return myHitCount; }
+
+	uint64_t
+	missCount() const { return myMissCount; }
+
+private:
+	void *
+	popFrame(
+		size_t size);
+
+	void
+	pushFrameRemote(
+		IOCoroFrame *frame);
+
+	IOCoroFrame *myLists[theCoroFrameClassCount];
+	std::atomic<IOCoroFrame *> myRemoteLists[theCoroFrameClassCount];
+	uint64_t myHitCount;
+	uint64_t myMissCount;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 struct IOCoroutinePromise;
 
 // C++20 coroutine has to be inherited from std::coroutine_handle with a promise type
@@ -105,10 +187,226 @@ struct IOCoroutinePromise
 	void
 	unhandled_exception() { abort(); }
 
+	// The compiler allocates the coroutine frame via the promise's operators if they are
+	// defined.
+	static void *
+	operator new(
+		size_t size) { return IOCoroFramePool::allocate(size); }
+
+	static void
+	operator delete(
+		void *ptr) { IOCoroFramePool::deallocate(ptr); }
+
+	// Keep track of the promise count to ensure there are no memory leaks.
+	static std::atomic_int theCount;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Nested coroutine. Unlike IOCoroutine it can be awaited by another coroutine. It allows
+// to split the coroutine code into functions which themselves can co_await any async
+// operations. The task starts only when it is awaited and gets resumed right in the
+// place of the async operation completion, not via IOCore or any other scheduler.
+//
+// Switching between the caller and the task is done via symmetric transfer: the
+// await_suspend() functions don't resume the next coroutine directly, but hand it to a
+// trampoline loop. It resumes the coroutines one after another, so a loop awaiting
+// millions of tasks completing without suspension doesn't overflow the stack. Returning
+// the next coroutine from await_suspend() would do the same, but only if the compiler
+// turns its resume into a tail call, which GCC does only with optimizations.
+//
+template<typename T>
+class Task;
+
+struct TaskTrampoline
+{
+	// Resume the coroutine. If a trampoline loop is already running in this thread, the
+	// coroutine is resumed by it after the current one suspends. Otherwise the loop is
+	// started here.
+	static void
+	resume(
+		std::coroutine_handle<> coro)
+	{
+		if (theIsActive)
+		{
+			if (!theNext)
+			{
+				theNext = coro;
+				return;
+			}
+			// A coroutine resumed by the running one in its own way transfers to
+			// another one. Rare, so it can nest.
+			coro.resume();
+			return;
+		}
+		theIsActive = true;
+		while (coro)
+		{
+			coro.resume();
+			coro = std::exchange(theNext, nullptr);
+		}
+		theIsActive = false;
+	}
+
+	static inline thread_local bool theIsActive = false;
+	static inline thread_local std::coroutine_handle<> theNext = nullptr;
+};
+
+struct TaskPromiseBase
+{
+	TaskPromiseBase()
+		: myCancelToken(nullptr)
+	{
+		LOG_DEBUG("TaskPromise create " << this);
+		theCount.fetch_add(1, std::memory_order_relaxed);
+	}
+	~TaskPromiseBase()
+	{
+		LOG_DEBUG("TaskPromise destroy " << this);
+		theCount.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// When the task ends, it switches straight back to the awaiting coroutine.
+	struct FinalAwaiter
+	{
+		bool
+		await_ready() noexcept { return false; }
+
+		void
+		await_resume() noexcept {}
+
+		template<typename Promise>
+		void
+		await_suspend(
+			std::coroutine_handle<Promise> coro) noexcept
+		{
+			TaskTrampoline::resume(coro.promise().myContinuation);
+		}
+	};
+
+	// Lazy start. The task body is entered only when the task is awaited.
+	std::suspend_always
+	initial_suspend() noexcept { return {}; }
+
+	FinalAwaiter
+	final_suspend() noexcept { return {}; }
+
+	void
+	unhandled_exception() { abort(); }
+
+	static void *
+	operator new(
+		size_t size) { return IOCoroFramePool::allocate(size); }
+
+	static void
+	operator delete(
+		void *ptr) { IOCoroFramePool::deallocate(ptr); }
+
+	// Every co_await inside the task goes through here. The async operations get bound to
+	// the task's cancellation token, and the nested tasks inherit it.
+	template<typename A>
+	decltype(auto)
+	await_transform(
+		A&& awaitable);
+
+	// The coroutine awaiting this task.
+	std::coroutine_handle<> myContinuation;
+	IOCancelToken *myCancelToken;
+
 	// Keep track of the promise count to ensure there are no memory leaks.
 	static std::atomic_int theCount;
 };
 
+template<typename T>
+struct TaskPromise final : public TaskPromiseBase
+{
+	Task<T>
+	get_return_object();
+
+	template<typename V>
+	void
+	return_value(
+		V&& value) { myValue.emplace(std::forward<V>(value)); }
+
+	T
+	takeValue() { return std::move(*myValue); }
+
+	std::optional<T> myValue;
+};
+
+template<>
+struct TaskPromise<void> final : public TaskPromiseBase
+{
+	Task<void>
+	get_return_object();
+
+	void
+	return_void() {}
+
+	void
+	takeValue() {}
+};
+
+// The task owns its coroutine frame. Hence it must stay alive until the task is
+// finished, which is naturally the case when it is used like 'co_await someTask()'.
+//
+template<typename T>
+class Task
+{
+public:
+	using promise_type = TaskPromise<T>;
+
+	explicit Task(
+		std::coroutine_handle<promise_type> coro) : myCoro(coro) {}
+	Task(
+		Task&& other) noexcept : myCoro(std::exchange(other.myCoro, nullptr)) {}
+	Task(
+		const Task&) = delete;
+	Task& operator=(
+		const Task&) = delete;
+	~Task() { if (myCoro) myCoro.destroy(); }
+
+	bool
+	await_ready() const noexcept { return false; }
+
+	// Start the task. The caller is resumed by the task when it ends.
+	void
+	await_suspend(
+		std::coroutine_handle<> caller) noexcept
+	{
+		myCoro.promise().myContinuation = caller;
+		TaskTrampoline::resume(myCoro);
+	}
+
+	T
+	await_resume() { return myCoro.promise().takeValue(); }
+
+	// All the operations awaited by the task and by its nested tasks are cancelled by the
+	// token. Must be set before the task is awaited.
+	void
+	setCancelToken(
+		IOCancelToken *token) { myCoro.promise().myCancelToken = token; }
+
+	IOCancelToken *
+	cancelToken() const { return myCoro.promise().myCancelToken; }
+
+private:
+	std::coroutine_handle<promise_type> myCoro;
+};
+
+template<typename T>
+inline Task<T>
+TaskPromise<T>::get_return_object()
+{
+	return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void>
+TaskPromise<void>::get_return_object()
+{
+	return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 struct AsyncOperation
@@ -127,14 +425,83 @@ struct AsyncOperation
 	await_suspend(
 		std::coroutine_handle<> coro);
 
+	// Cancel the operation if it isn't done in the given time. The coroutine then gets
+	// -1 and errno ETIMEDOUT. Must be called when the operation is suspended.
+	void
+	setTimeout(
+		uint64_t timeoutMs);
+
+	// Cancel the operation when the token is cancelled. The coroutine then gets -1 and
+	// errno ECANCELED. Must be called when the operation is suspended.
+	void
+	setCancelToken(
+		IOCancelToken *token);
+
 private:
 	virtual bool
 	onIOEvent() = 0;
 
+	// Complete the operation with the given error and resume the coroutine.
+	virtual void
+	onCancel(
+		int err) = 0;
+
+	// The deadline is reached.
+	virtual void
+	onTimer();
+
+	// Stop waiting and complete the operation with the given error. With io_uring it
+	// happens when the kernel confirms the cancellation.
+	void
+	cancel(
+		int err);
+
+	void
+	removeCancelToken();
+
+#if IOCORE_USE_URING
+	// Fill the submission entry of the operation. Is called when the coroutine gets
+	// suspended.
+	virtual void
+	prepareSqe(
+		io_uring_sqe *sqe);
+
+	// Handle the result of the submission. Returns true if the operation is complete and
+	// the coroutine is resumed. Otherwise the operation is submitted again.
+	virtual bool
+	onCompletion(
+		int res);
+#endif
+
 protected:
+	// Make the operation the current one of the task and remember the coroutine to
+	// resume.
+	void
+	startWaiting(
+		std::coroutine_handle<> coro);
+
+	// Resume the coroutine. The operation object is gone after that, so it is removed
+	// from everywhere beforehand.
+	void
+	resume();
+
 	IOTask *const myTask;
 	std::coroutine_handle<> myCoro;
-
+	// Place in the core's timer heap. Negative when there is no timer.
+	int myTimerIdx;
+	uint64_t myDeadlineMs;
+	// Links in the list of the operations bound to the same token.
+	IOCancelToken *myCancelToken;
+	AsyncOperation *myCancelPrev;
+	AsyncOperation *myCancelNext;
+#if IOCORE_USE_URING
+	// The kernel owns the operation until its completion arrives.
+	bool myIsSubmitted;
+	// The error to complete with, when the cancellation is requested from the kernel.
+	int myCancelErr;
+#endif
+
+	friend IOCancelToken;
 	friend IOCore;
 };
 
@@ -166,6 +533,20 @@ private:
 	bool
 	onIOEvent() final;
 
+	void
+	onCancel(
+		int err) final;
+
+#if IOCORE_USE_URING
+	void
+	prepareSqe(
+		io_uring_sqe *sqe) final;
+
+	bool
+	onCompletion(
+		int res) final;
+#endif
+
 	void *const myData;
 	const size_t mySize;
 	ssize_t myRes;
@@ -197,6 +578,20 @@ private:
 	bool
 	onIOEvent() final;
 
+	void
+	onCancel(
+		int err) final;
+
+#if IOCORE_USE_URING
+	void
+	prepareSqe(
+		io_uring_sqe *sqe) final;
+
+	bool
+	onCompletion(
+		int res) final;
+#endif
+
 	const void *const myData;
 	const size_t mySize;
 	ssize_t myRes;
@@ -228,6 +623,20 @@ private:
 	bool
 	onIOEvent() final;
 
+	void
+	onCancel(
+		int err) final;
+
+#if IOCORE_USE_URING
+	void
+	prepareSqe(
+		io_uring_sqe *sqe) final;
+
+	bool
+	onCompletion(
+		int res) final;
+#endif
+
 	sockaddr *const myAddr;
 	socklen_t *const mySize;
 	int myRes;
@@ -256,12 +665,445 @@ private:
 	bool
 	onIOEvent() final;
 
+	void
+	onCancel(
+		int err) final;
+
+#if IOCORE_USE_URING
+	void
+	prepareSqe(
+		io_uring_sqe *sqe) final;
+
+	bool
+	onCompletion(
+		int res) final;
+
+	const sockaddr *const myAddr;
+	const socklen_t mySize;
+#endif
 	bool myIsDone;
 	int myRes;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// Base for the operations done by a non-blocking syscall, retried on each event of the
+// given kind until it succeeds. Unlike the simple operations above, this one reports
+// the errors other than EWOULDBLOCK: the result is -1 and errno is set when the
+// coroutine gets resumed.
+//
+struct AsyncSyscall : public AsyncOperation
+{
+	AsyncSyscall(
+		const AsyncSyscall&) = delete;
+	AsyncSyscall& operator=(
+		const AsyncSyscall&) = delete;
+
+	bool
+	await_ready() const noexcept { return myIsDone; }
+
+	ssize_t
+	await_resume();
+
+protected:
+	AsyncSyscall(
+		IOTask *sub,
+		IOEventBit event);
+
+	// Must be called by the final class' constructor, because the syscall is virtual.
+	void
+	execute();
+
+	int
+	taskFd() const;
+
+	// One attempt of the syscall. Returns what the syscall does.
+	virtual ssize_t
+	doSyscall() = 0;
+
+	// Handle a successful syscall. Returns true if the operation is complete and the
+	// result is stored.
+	virtual bool
+	onSyscallDone(
+		ssize_t rc);
+
+	ssize_t myRes;
+
+private:
+	bool
+	onIOEvent() final;
+
+	void
+	onCancel(
+		int err) final;
+
+#if IOCORE_USE_URING
+	void
+	prepareSqe(
+		io_uring_sqe *sqe) final;
+
+	bool
+	onCompletion(
+		int res) final;
+#endif
+
+	void
+	finishWithError(
+		int err);
+
+	const IOEventBit myEvent;
+	bool myIsDone;
+	int myErr;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Scatter read into the given buffers. The result is the number of bytes read in total.
+//
+struct AsyncRecvv final : public AsyncSyscall
+{
+	AsyncRecvv(
+		IOTask *sub,
+		const iovec *vecs,
+		int count);
+
+private:
+	ssize_t
+	doSyscall() final;
+
+	const iovec *const myVecs;
+	const int myCount;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Gather write of the given buffers in one syscall. Can send only a part of them.
+//
+struct AsyncSendv final : public AsyncSyscall
+{
+	AsyncSendv(
+		IOTask *sub,
+		const iovec *vecs,
+		int count);
+
+private:
+	ssize_t
+	doSyscall() final;
+
+	const iovec *const myVecs;
+	const int myCount;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Send all the given buffers, retrying the partial writes inside of the operation. The
+// coroutine is resumed only when everything is sent, or on an error. The vecs are
+// consumed in place. The result is the total size.
+//
+struct AsyncSendAll final : public AsyncSyscall
+{
+	AsyncSendAll(
+		IOTask *sub,
+		iovec *vecs,
+		int count);
+
+	AsyncSendAll(
+		IOTask *sub,
+		const void *data,
+		size_t size);
+
+private:
+	ssize_t
+	doSyscall() final;
+
+	bool
+	onSyscallDone(
+		ssize_t rc) final;
+
+	// For the single buffer case.
+	iovec myVec;
+	iovec *myVecs;
+	int myCount;
+	size_t myTotal;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Send a part of a file without copying it to the userspace. The offset is advanced by
+// the sent size. Can send less than requested.
+//
+struct AsyncSendfile final : public AsyncSyscall
+{
+	AsyncSendfile(
+		IOTask *sub,
+		int fileFd,
+		off_t *offset,
+		size_t size);
+
+private:
+	ssize_t
+	doSyscall() final;
+
+	const int myFileFd;
+	off_t *const myOffset;
+	const size_t mySize;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Move data from a pipe into the socket without copying it to the userspace. For
+// example, when the pipe is filled from a file or from another socket by another splice.
+// The pipe must have data. An empty pipe would look the same as a full socket, and the
+// operation would wait for the socket's next write-event.
+//
+struct AsyncSplice final : public AsyncSyscall
+{
+	AsyncSplice(
+		IOTask *sub,
+		int pipeFd,
+		size_t size);
+
+private:
+	ssize_t
+	doSyscall() final;
+
+	const int myPipeFd;
+	const size_t mySize;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+struct AsyncSleep final : public AsyncOperation
+{
+	AsyncSleep(
+		IOTask *sub,
+		uint64_t durationMs);
+	AsyncSleep(
+		const AsyncSleep&) = delete;
+	AsyncSleep& operator=(
+		const AsyncSleep&) = delete;
+
+	bool
+	await_ready() const noexcept { return false; }
+
+	bool
+	await_suspend(
+		std::coroutine_handle<> coro);
+
+	// 0 when slept fully, -1 when the task got closed.
+	int
+	await_resume() { return myRes; }
+
+private:
+	bool
+	onIOEvent() final;
+
+	void
+	onCancel(
+		int err) final;
+
+	void
+	onTimer() final;
+
+	const uint64_t myDurationMs;
+	int myRes;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Wrapper for co_await on an operation with a time limit:
+//
+//     ssize_t rc = co_await withTimeout(task->asyncRecv(data, size), 100);
+//
+// The operation is referenced, so it must be a temporary in the same expression as the
+// co_await, or stay alive till the end of the await otherwise.
+//
+template<typename Op>
+struct AsyncTimeout
+{
+	AsyncTimeout(
+		Op &op,
+		uint64_t timeoutMs) : myOp(op), myTimeoutMs(timeoutMs) {}
+
+	bool
+	await_ready() const noexcept { return myOp.await_ready(); }
+
+	bool
+	await_suspend(
+		std::coroutine_handle<> coro)
+	{
+		if (!myOp.await_suspend(coro))
+			return false;
+		myOp.setTimeout(myTimeoutMs);
+		return true;
+	}
+
+	auto
+	await_resume() { return myOp.await_resume(); }
+
+	Op&
+	operation() { return myOp; }
+
+private:
+	Op &myOp;
+	const uint64_t myTimeoutMs;
+};
+
+template<typename Op>
+inline AsyncTimeout<Op>
+withTimeout(
+	Op &&op,
+	uint64_t timeoutMs)
+{
+	return AsyncTimeout<Op>(op, timeoutMs);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Cancellation of the pending operations without closing their tasks. For example, of
+// all the operations of one request, when the request isn't needed anymore. The token
+// is bound to an operation or to a whole nested task:
+//
+//     ssize_t rc = co_await withCancel(task->asyncRecv(data, size), token);
+//     int rc = co_await withCancel(handleRequest(task), token);
+//
+// The nested tasks awaited inside such a task inherit its token, and all their
+// operations are bound to it automatically. The token, the operations and the cancel()
+// call must all belong to one core's thread.
+//
+class IOCancelToken
+{
+public:
+	IOCancelToken() : myIsCancelled(false), myOps(nullptr) {}
+	// The bound operations must be done by now.
+	~IOCancelToken();
+
+	IOCancelToken(
+		const IOCancelToken&) = delete;
+	IOCancelToken& operator=(
+		const IOCancelToken&) = delete;
+
+	// Complete all the bound operations with -1 and errno ECANCELED. The operations bound
+	// after that are cancelled right away, before they start waiting.
+	void
+	cancel();
+
+	bool
+	isCancelled() const { return myIsCancelled; }
+
+private:
+	bool myIsCancelled;
+	// Intrusive list of the pending operations bound to the token.
+	AsyncOperation *myOps;
+
+	friend AsyncOperation;
+};
+
+// The operation an awaitable consists of, if the awaitable can be cancelled.
+inline AsyncOperation&
+asyncOperationOf(
+	AsyncOperation &op) { return op; }
+
+template<typename Op>
+inline AsyncOperation&
+asyncOperationOf(
+	AsyncTimeout<Op> &timeout) { return timeout.operation(); }
+
+// Wrapper for co_await on an operation bound to a cancellation token. Like with
+// withTimeout() the awaitable must stay alive till the end of the await.
+//
+template<typename A>
+struct AsyncCancel
+{
+	AsyncCancel(
+		A &awaitable,
+		IOCancelToken *token)
+		: myAwaitable(awaitable), myToken(token), myIsCancelled(false) {}
+
+	bool
+	await_ready() const noexcept { return myAwaitable.await_ready(); }
+
+	bool
+	await_suspend(
+		std::coroutine_handle<> coro)
+	{
+		if (myToken != nullptr && myToken->isCancelled())
+		{
+			// Don't even start waiting.
+			myIsCancelled = true;
+			return false;
+		}
+		if (!myAwaitable.await_suspend(coro))
+			return false;
+		if (myToken != nullptr)
+			asyncOperationOf(myAwaitable).setCancelToken(myToken);
+		return true;
+	}
+
+	auto
+	await_resume()
+	{
+		auto res = myAwaitable.await_resume();
+		if (myIsCancelled)
+			errno = ECANCELED;
+		return res;
+	}
+
+private:
+	A &myAwaitable;
+	IOCancelToken *const myToken;
+	bool myIsCancelled;
+};
+
+template<typename Op>
+inline AsyncCancel<Op>
+withCancel(
+	Op &&op,
+	IOCancelToken &token)
+{
+	return AsyncCancel<Op>(op, &token);
+}
+
+template<typename T>
+inline Task<T>&&
+withCancel(
+	Task<T> &&task,
+	IOCancelToken &token)
+{
+	task.setCancelToken(&token);
+	return std::move(task);
+}
+
+template<typename A>
+struct IsTask : std::false_type {};
+
+template<typename T>
+struct IsTask<Task<T>> : std::true_type {};
+
+template<typename A>
+inline decltype(auto)
+TaskPromiseBase::await_transform(
+	A&& awaitable)
+{
+	using Awaitable = std::remove_cvref_t<A>;
+	if constexpr (IsTask<Awaitable>::value)
+	{
+		if (awaitable.cancelToken() == nullptr)
+			awaitable.setCancelToken(myCancelToken);
+		return std::forward<A>(awaitable);
+	}
+	else if constexpr (requires(Awaitable &a) { asyncOperationOf(a); })
+	{
+		return AsyncCancel<Awaitable>(awaitable, myCancelToken);
+	}
+	else
+	{
+		return std::forward<A>(awaitable);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 class IOTask
 {
 public:
@@ -291,13 +1133,40 @@ public:
 
 	AsyncConnect
 	asyncConnect(const sockaddr *addr, socklen_t size) { return AsyncConnect(this, addr, size); }
+
+	AsyncSleep
+	asyncSleep(uint64_t durationMs) { return AsyncSleep(this, durationMs); }
+
+	AsyncRecvv
+	asyncRecvv(const iovec *vecs, int count) { return AsyncRecvv(this, vecs, count); }
+
+	AsyncSendv
+	asyncSendv(const iovec *vecs, int count) { return AsyncSendv(this, vecs, count); }
+
+	AsyncSendAll
+	asyncSendAll(iovec *vecs, int count) { return AsyncSendAll(this, vecs, count); }
+
+	AsyncSendAll
+	asyncSendAll(const void *data, size_t size) { return AsyncSendAll(this, data, size); }
+
+	AsyncSendfile
+	asyncSendfile(int fileFd, off_t *offset, size_t size) { return AsyncSendfile(this, fileFd, offset, size); }
+
+	AsyncSplice
+	asyncSplice(int pipeFd, size_t size) { return AsyncSplice(this, pipeFd, size); }
 	//
 	//////////////////////////////////////////////
 
 	static std::atomic_int theCount;
 
 private:
+	// Owned by the core thread.
 	IOTaskState myState;
+	// The same states as seen by the other threads. The core makes it WORKING when the
+	// task is added, and close() makes it DELETING. So a close before the addition or a
+	// second close is caught before the task is pushed into the queue where it already
+	// is.
+	std::atomic<IOTaskState> myQueueState;
 	const int myFd;
 	int myIdx;
 	// Mask of events which are ready for consumption.
@@ -305,6 +1174,8 @@ private:
 	// Currently waiting async operation blocked by a co_await. Coroutine can't be blocked
 	// more than once at a time, which means the current operation can only be one.
 	AsyncOperation* myAsyncOp;
+	// Link in the core's queue of the tasks to add or delete.
+	IOTask *myQueueNext;
 	IOCore &myCore;
 
 	friend AsyncAccept;
@@ -312,9 +1183,124 @@ private:
 	friend AsyncOperation;
 	friend AsyncRecv;
 	friend AsyncSend;
+	friend AsyncSleep;
+	friend AsyncSyscall;
+	friend IOCore;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Moves the coroutine to the given core. The coroutine is resumed in the thread rolling
+// that core. Does nothing if the coroutine is already there.
+//
+struct AsyncSchedule
+{
+	AsyncSchedule(
+		IOCore &core) : myCore(core), myNext(nullptr) {}
+	AsyncSchedule(
+		const AsyncSchedule&) = delete;
+	AsyncSchedule& operator=(
+		const AsyncSchedule&) = delete;
+
+	bool
+	await_ready() const noexcept;
+
+	void
+	await_suspend(
+		std::coroutine_handle<> coro);
+
+	void
+	await_resume() {}
+
+private:
+	IOCore &myCore;
+	std::coroutine_handle<> myCoro;
+	// Link in the core's queue of the coroutines to resume.
+	AsyncSchedule *myNext;
+
 	friend IOCore;
 };
 
+#if IOCORE_USE_URING
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Minimal io_uring on the raw syscalls. The submission and completion queues are shared
+// with the kernel via mapped memory, so adding the submissions and taking the results
+// costs no syscalls. Only io_uring_enter() does, to submit all the new ones at once and
+// to wait for the results.
+//
+class IOUring
+{
+public:
+	IOUring(
+		uint32_t entryCount);
+	~IOUring();
+
+	IOUring(
+		const IOUring&) = delete;
+	IOUring& operator=(
+		const IOUring&) = delete;
+
+	// A zeroed free submission entry. It is visible to the kernel at the next enter. If
+	// the queue is full, the pending entries are submitted first.
+	io_uring_sqe *
+	getSqe();
+
+	// Submit the pending entries and wait for at least the given number of completions
+	// or for the timeout. Negative timeout means infinite.
+	void
+	enter(
+		uint32_t waitCount,
+		int timeoutMs);
+
+	// Check for completions without taking them and without a syscall.
+	bool
+	hasCqe() const;
+
+	// Take the oldest completion. Returns false if there are none.
+	bool
+	popCqe(
+		uint64_t *userData,
+		int *res);
+
+private:
+	int myFd;
+	void *mySqMem;
+	size_t mySqMemSize;
+	void *myCqMem;
+	size_t myCqMemSize;
+	io_uring_sqe *mySqes;
+	size_t mySqesSize;
+	unsigned *mySqHead;
+	unsigned *mySqTail;
+	unsigned *mySqArray;
+	unsigned mySqMask;
+	unsigned mySqEntryCount;
+	unsigned *myCqHead;
+	unsigned *myCqTail;
+	io_uring_cqe *myCqes;
+	unsigned myCqMask;
+	uint32_t myToSubmit;
+};
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Counters of the core's event loop. Updated by the core's thread, so are only precise
+// when read in that thread or after the core is stopped.
+struct IOCoreStats
+{
+	uint64_t myRollCount;
+	// Kernel events (or completions with io_uring) handled by all the rolls.
+	uint64_t myEventCount;
+	// Non-blocking checks for the events made during the busy-poll windows.
+	uint64_t mySpinCount;
+	// Waits for the events which could put the thread to sleep.
+	uint64_t mySleepCount;
+};
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 // Event loop + IO operations with C++ coroutine support.
@@ -333,13 +1319,16 @@ struct IOCore
 	bool
 	isStopped() const { return myIsStopped.load(std::memory_order_relaxed); }
 
-	// Create a new task for async operations on the given fd.
+	// Create a new task for async operations on the given fd. Can be called from any
+	// thread. The task is owned by this core, and its async operations must be done in
+	// the core's thread. For example, after 'co_await core.schedule()'.
 	IOTask *
 	subscribe(
 		int fd);
 
 	// Destroy the task asynchronously. The memory will be freed, the task can't be used
-	// anymore after unsubscription.
+	// anymore after unsubscription. Can be called once per task, and only after the
+	// task's subscription is processed by the core.
 	void
 	unsubscribe(
 		IOTask *s);
@@ -349,19 +1338,197 @@ struct IOCore
 	void
 	roll();
 
+	// For co_await. Can be used from any thread.
+	AsyncSchedule
+	schedule() { return AsyncSchedule(*this); }
+
+	// Number of the tasks subscribed and not yet deleted.
+	uint64_t
+	taskCount() const { return myTaskCount.load(std::memory_order_relaxed); }
+
+	// The core running roll() in the current thread, if any.
+	static IOCore *
+	current();
+
+	IOCoroFramePool&
+	framePool() { return myFramePool; }
+
+	// Before going to sleep in the kernel, check for the new events without blocking for
+	// up to this long. It costs the CPU, but the events coming soon are handled without
+	// a wakeup of the thread. Zero disables the spinning. Can be changed from any thread.
+	void
+	setBusyPollUsec(
+		uint32_t usec) { myBusyPollUsec.store(usec, std::memory_order_relaxed); }
+
+	const IOCoreStats&
+	stats() const { return myStats; }
+
 private:
+	void
+	pushQueue(
+		IOTask *s);
+
+	void
+	pushSchedule(
+		AsyncSchedule *op);
+
+	// Timers of the async operations. Only for the core's thread.
+	void
+	addTimer(
+		AsyncOperation *op);
+
+	void
+	removeTimer(
+		AsyncOperation *op);
+
+	void
+	processTimers();
+
+	// Timeout for the epoll_wait(), until the nearest deadline.
+	int
+	timerWaitMs() const;
+
+	// End of the busy-poll spinning. Not later than the nearest timer.
+	uint64_t
+	spinDeadlineUsec(
+		uint32_t busyPollUsec) const;
+
+	void
+	timerSiftUp(
+		int idx);
+
+	void
+	timerSiftDown(
+		int idx);
+
+	void
+	timerSet(
+		int idx,
+		AsyncOperation *op);
+
+	// Wait for the events from the kernel, spinning first if the busy-poll is enabled.
+	// Returns the epoll_wait() result. With io_uring the completions stay in the ring.
+	int
+	waitEvents();
+
 	void
 	processQueues();
 
+	void
+	processTaskQueue();
+
+	void
+	processScheduleQueue();
+
+#if IOCORE_USE_URING
+	void
+	submitOperation(
+		AsyncOperation *op);
+
+	void
+	cancelOperation(
+		AsyncOperation *op);
+
+	// Wakeups are a read of the eventfd, always pending in the ring.
+	void
+	submitEventRead();
+
+	void
+	handleCompletion(
+		uint64_t userData,
+		int res);
+#endif
+
+	// Coroutines created inside of roll() take their frames from here. Goes first so as
+	// to be destroyed last.
+	IOCoroFramePool myFramePool;
+
 	int myEventFd;
 	IOTask *myEventSub;
 	int myFd;
 	std::atomic_bool myIsStopped;
 
-	std::mutex myMutex;
 	// Tasks currently in work.
 	std::vector<IOTask *> myTasks;
-	// Incoming tasks. New and deleting ones.
-	std::vector<IOTask *> myQueue;
-	std::atomic_uint64_t mySize;
+	// Incoming tasks. New and deleting ones. It is an intrusive lock-free stack. Any
+	// thread can push to it, and the core takes all of it at once. So neither the
+	// producers nor the core ever wait for each other.
+	std::atomic<IOTask *> myQueueHead;
+	// Coroutines to resume in this core. The same kind of lock-free stack.
+	std::atomic<AsyncSchedule *> myScheduleHead;
+	std::atomic_uint64_t myTaskCount;
+	// Min-heap of the operations with a deadline.
+	std::vector<AsyncOperation *> myTimers;
+	std::atomic_uint32_t myBusyPollUsec;
+	IOCoreStats myStats;
+#if IOCORE_USE_URING
+	IOUring myRing;
+	// Submitted and not completed entries.
+	uint32_t myInFlightCount;
+	uint64_t myEventBuf;
+#else
+	// Buffer for epoll_wait(). Grows when the kernel fills it fully, so under load all
+	// the ready events are taken in one syscall. Shrinks back when the load goes down.
+	std::vector<epoll_event> myEvents;
+#endif
+
+	friend AsyncOperation;
+	friend AsyncSchedule;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+enum IOCoreBalance
+{
+	IO_CORE_BALANCE_ROUND_ROBIN,
+	IO_CORE_BALANCE_LEAST_LOADED,
+};
+
+// A set of cores, each rolled by its own thread pinned to its own CPU. The CPUs are
+// the ones the process is allowed to run on, so it works in a container or under
+// taskset. If there are more cores than CPUs, they share the CPUs. New connections
+// can be spread between the cores, and the coroutines can hop between them via
+// 'co_await core.schedule()'.
+//
+class IOCoreGroup
+{
+public:
+	// Zero core count means one core per CPU available to the process.
+	IOCoreGroup(
+		uint32_t coreCount = 0,
+		IOCoreBalance balance = IO_CORE_BALANCE_ROUND_ROBIN);
+	// All the tasks in all the cores must be closed by now.
+	~IOCoreGroup();
+
+	IOCoreGroup(
+		const IOCoreGroup&) = delete;
+	IOCoreGroup& operator=(
+		const IOCoreGroup&) = delete;
+
+	uint32_t
+	size() const { return myCores.size(); }
+
+	IOCore&
+	core(
+		uint32_t idx) { return *myCores[idx]; }
+
+	// The core for a new task according to the balancing policy.
+	IOCore&
+	pickCore();
+
+	// Stop all the cores and wait for their threads.
+	void
+	stop();
+
+private:
+	// Negative CPU means no pinning.
+	static void
+	workerF(
+		IOCore *core,
+		int cpu);
+
+	const IOCoreBalance myBalance;
+	std::atomic_uint32_t myNextIdx;
+	std::vector<std::unique_ptr<IOCore>> myCores;
+	std::vector<std::thread> myThreads;
 };
@@ -0,0 +1,308 @@
+#include "iocoro.h"
+
+#if IOCORE_USE_URING
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+IOUring::IOUring(
+	uint32_t entryCount)
+	: myToSubmit(0)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	myFd = syscall(__NR_io_uring_setup, entryCount, &params);
+	assert(myFd >= 0);
+
+	mySqMemSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	myCqMemSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool isSingleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (isSingleMmap)
+	{
+		mySqMemSize = std::max(mySqMemSize, myCqMemSize);
+		myCqMemSize = mySqMemSize;
+	}
+	mySqMem = mmap(nullptr, mySqMemSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, myFd, IORING_OFF_SQ_RING);
+	assert(mySqMem != MAP_FAILED);
+	if (isSingleMmap)
+	{
+		myCqMem = mySqMem;
+	}
+	else
+	{
+		myCqMem = mmap(nullptr, myCqMemSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, myFd, IORING_OFF_CQ_RING);
+		assert(myCqMem != MAP_FAILED);
+	}
+	mySqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	mySqes = (io_uring_sqe *)mmap(nullptr, mySqesSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, myFd, IORING_OFF_SQES);
+	assert(mySqes != MAP_FAILED);
+
+	char *sq = (char *)mySqMem;
+	mySqHead = (unsigned *)(sq + params.sq_off.head);
+	mySqTail = (unsigned *)(sq + params.sq_off.tail);
+	mySqArray = (unsigned *)(sq + params.sq_off.array);
+	mySqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	mySqEntryCount = params.sq_entries;
+
+	char *cq = (char *)myCqMem;
+	myCqHead = (unsigned *)(cq + params.cq_off.head);
+	myCqTail = (unsigned *)(cq + params.cq_off.tail);
+	myCqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+	myCqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+}
+
+IOUring::~IOUring()
+{
+	munmap(mySqes, mySqesSize);
+	if (myCqMem != mySqMem)
+		munmap(myCqMem, myCqMemSize);
+	munmap(mySqMem, mySqMemSize);
+	int rc = close(myFd);
+	assert(rc == 0);
+}
+
+io_uring_sqe *
+IOUring::getSqe()
+{
+	// Only this thread moves the tail. The kernel moves the head.
+	unsigned tail = *mySqTail;
+	while (tail - __atomic_load_n(mySqHead, __ATOMIC_ACQUIRE) == mySqEntryCount)
+		enter(0, 0);
+	unsigned idx = tail & mySqMask;
+	io_uring_sqe *sqe = &mySqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	mySqArray[idx] = idx;
+	// Without a kernel polling thread the entries are read only in enter(). So it is
+	// fine to publish the entry before the caller fills it.
+	__atomic_store_n(mySqTail, tail + 1, __ATOMIC_RELEASE);
+	++myToSubmit;
+	return sqe;
+}
+
+void
+IOUring::enter(
+	uint32_t waitCount,
+	int timeoutMs)
+{
+	if (myToSubmit == 0 && waitCount == 0)
+		return;
+	unsigned flags = 0;
+	if (waitCount > 0)
+		flags |= IORING_ENTER_GETEVENTS;
+	__kernel_timespec ts;
+	io_uring_getevents_arg arg;
+	void *argPtr = nullptr;
+	size_t argSize = 0;
+	if (waitCount > 0 && timeoutMs >= 0)
+	{
+		ts.tv_sec = timeoutMs / 1000;
+		ts.tv_nsec = (timeoutMs % 1000) * 1'000'000;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uint64_t)&ts;
+		flags |= IORING_ENTER_EXT_ARG;
+		argPtr = &arg;
+		argSize = sizeof(arg);
+	}
+	int rc = syscall(__NR_io_uring_enter, myFd, myToSubmit, waitCount, flags, argPtr,
+		argSize);
+	if (rc < 0)
+	{
+		// Timeout, a signal, or the completion queue is full and has to be consumed.
+		assert(errno == ETIME || errno == EINTR || errno == EBUSY);
+		return;
+	}
+	assert((uint32_t)rc <= myToSubmit);
+	myToSubmit -= rc;
+}
+
+bool
+IOUring::hasCqe() const
+{
+	return *myCqHead != __atomic_load_n(myCqTail, __ATOMIC_ACQUIRE);
+}
+
+bool
+IOUring::popCqe(
+	uint64_t *userData,
+	int *res)
+{
+	unsigned head = *myCqHead;
+	if (head == __atomic_load_n(myCqTail, __ATOMIC_ACQUIRE))
+		return false;
+	io_uring_cqe *cqe = &myCqes[head & myCqMask];
+	*userData = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(myCqHead, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void
+AsyncOperation::prepareSqe(
+	io_uring_sqe *)
+{
+	// The operation doesn't need the kernel.
+	abort();
+}
+
+bool
+AsyncOperation::onCompletion(
+	int)
+{
+	abort();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void
+AsyncRecv::prepareSqe(
+	io_uring_sqe *sqe)
+{
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = myTask->myFd;
+	sqe->addr = (uint64_t)myData;
+	sqe->len = mySize;
+}
+
+bool
+AsyncRecv::onCompletion(
+	int res)
+{
+	if (res == -EAGAIN)
+		return false;
+	myRes = res;
+	if (res < 0)
+	{
+		errno = -res;
+		myRes = -1;
+	}
+	resume();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void
+AsyncSend::prepareSqe(
+	io_uring_sqe *sqe)
+{
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = myTask->myFd;
+	sqe->addr = (uint64_t)myData;
+	sqe->len = mySize;
+}
+
+bool
+AsyncSend::onCompletion(
+	int res)
+{
+	if (res == -EAGAIN)
+		return false;
+	myRes = res;
+	if (res < 0)
+	{
+		errno = -res;
+		myRes = -1;
+	}
+	resume();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void
+AsyncAccept::prepareSqe(
+	io_uring_sqe *sqe)
+{
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = myTask->myFd;
+	sqe->addr = (uint64_t)myAddr;
+	sqe->addr2 = (uint64_t)mySize;
+}
+
+bool
+AsyncAccept::onCompletion(
+	int res)
+{
+	if (res == -EAGAIN)
+		return false;
+	myRes = res;
+	if (res < 0)
+	{
+		errno = -res;
+		myRes = -1;
+	}
+	resume();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void
+AsyncConnect::prepareSqe(
+	io_uring_sqe *sqe)
+{
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = myTask->myFd;
+	sqe->addr = (uint64_t)myAddr;
+	sqe->off = mySize;
+}
+
+bool
+AsyncConnect::onCompletion(
+	int res)
+{
+	myIsDone = true;
+	myRes = 0;
+	if (res < 0)
+	{
+		errno = -res;
+		myRes = -1;
+	}
+	resume();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// There is no single io_uring operation for each of the syscalls here, like sendfile().
+// So the kernel only polls the socket, and then the syscall is done like with epoll.
+void
+AsyncSyscall::prepareSqe(
+	io_uring_sqe *sqe)
+{
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = myTask->myFd;
+	sqe->poll32_events = myEvent == IO_EVENT_READ ? POLLIN : POLLOUT;
+}
+
+bool
+AsyncSyscall::onCompletion(
+	int res)
+{
+	if (res < 0)
+	{
+		finishWithError(-res);
+		return true;
+	}
+	myTask->myEventsReady |= myEvent;
+	execute();
+	if (!myIsDone)
+		return false;
+	resume();
+	return true;
+}
+
+#endif
@@ -7,11 +7,15 @@
 #include <fcntl.h>
 #include <iostream>
 #include <netinet/in.h>
+#include <sys/mman.h>
 #include <thread>
 #include <unistd.h>
 
 static constexpr uint64_t theRequestTargetCount = 50;
 static constexpr int theClientCount = 100;
+static constexpr uint64_t theTaskStackCheckCount = 1'000'000;
+// Peers not getting a message for this long are considered dead.
+static constexpr uint64_t theRecvTimeoutMs = 5000;
 
 static uint64_t
 getUsec();
@@ -74,6 +78,15 @@ private:
 	IOCoroutine
 	coroRun();
 
+	Task<void>
+	coroServe();
+
+	Task<bool>
+	coroRequest();
+
+	void
+	finish();
+
 	IOTask *myTask;
 	uint64_t myRecvCount;
 	uint64_t mySendCount;
@@ -90,9 +103,11 @@ struct Server
 		const std::shared_ptr<Context>& ctx);
 	~Server();
 
+	// The server runs in one core of the group and spreads its peers between all of
+	// them.
 	uint16_t
 	bindAndListenAndRun(
-		IOCore &core);
+		IOCoreGroup &group);
 
 	void
 	stop();
@@ -102,6 +117,7 @@ private:
 	coroRun();
 
 	IOTask *myTask;
+	IOCoreGroup *myGroup;
 	const std::shared_ptr<Context> myContext;
 };
 
@@ -112,39 +128,333 @@ run()
 {
 	std::shared_ptr<Context> context = std::make_shared<Context>();
 
-	IOCore serverCore;
+	IOCoreGroup group(0, IO_CORE_BALANCE_LEAST_LOADED);
+	std::cout << "start " << group.size() << " cores" << std::endl;
 	std::cout << "start server" << std::endl;
 	Server server(context);
-	uint16_t port = server.bindAndListenAndRun(serverCore);
-	std::thread serverThread(ioCoreRunF, std::ref(serverCore));
+	uint16_t port = server.bindAndListenAndRun(group);
 
 	std::cout << "start clients" << std::endl;
-	IOCore clientCore;
+	uint64_t t1 = getUsec();
 	for (int i = 0; i < theClientCount; ++i)
-		(new Client(context))->connectAndRun(clientCore, port);
+		(new Client(context))->connectAndRun(group.core(i % group.size()), port);
 
 	std::cout << "wait for the load to pass" << std::endl;
-	uint64_t t1 = getUsec();
-	std::thread clientThread(ioCoreRunF, std::ref(clientCore));
 	context->waitClientsFinish();
-	clientCore.stop();
-	clientThread.join();
 	uint64_t t2 = getUsec();
 	std::cout << "Took " << (t2 - t1) / 1000.0 << " ms" << std::endl;
 
 	std::cout << "wait for the server to stop" << std::endl;
 	server.stop();
 	context->waitServerFinish();
-	serverCore.stop();
-	serverThread.join();
+	group.stop();
 	return 0;
 }
 
+// Many tasks completing without suspension, one after another. Without symmetric
+// transfer each of them would add a few stack frames and the stack would overflow.
+static void
+checkTaskStack()
+{
+	struct Helper
+	{
+		static Task<uint64_t>
+		inc(uint64_t value) { co_return value + 1; }
+
+		static IOCoroutine
+		run(uint64_t count, uint64_t *res)
+		{
+			uint64_t value = 0;
+			for (uint64_t i = 0; i < count; ++i)
+				value = co_await inc(value);
+			*res = value;
+			co_return;
+		}
+	};
+	uint64_t res = 0;
+	Helper::run(theTaskStackCheckCount, &res);
+	assert(res == theTaskStackCheckCount);
+	MAYBE_UNUSED(res);
+}
+
+// Sleep, an operation cancelled by its timeout, and an operation done before its timeout.
+static void
+checkTimers()
+{
+	struct Helper
+	{
+		static IOCoroutine
+		run(IOTask *task, int peerFd)
+		{
+			uint64_t t1 = getUsec();
+			int rc = co_await task->asyncSleep(20);
+			assert(rc == 0);
+			// The clock is in milliseconds, the first one could be incomplete.
+			assert(getUsec() - t1 >= 19'000);
+
+			uint8_t data = 0;
+			t1 = getUsec();
+			ssize_t size = co_await withTimeout(task->asyncRecv(&data, 1), 20);
+			assert(size == -1 && errno == ETIMEDOUT);
+			assert(getUsec() - t1 >= 19'000);
+
+			size = write(peerFd, &data, 1);
+			assert(size == 1);
+			size = co_await withTimeout(task->asyncRecv(&data, 1), 10'000);
+			assert(size == 1);
+			MAYBE_UNUSED(rc);
+			task->core().stop();
+			co_return;
+		}
+	};
+	int fds[2];
+	int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(rc == 0);
+	makeFdNonblock(fds[0]);
+
+	IOCore core;
+	IOTask *task = core.subscribe(fds[0]);
+	Helper::run(task, fds[1]);
+	ioCoreRunF(core);
+	task->close();
+	close(fds[1]);
+}
+
+// Cancellation of single operations and of nested tasks. The socket stays usable after
+// that.
+static void
+checkCancel()
+{
+	struct Helper
+	{
+		static Task<ssize_t>
+		recvInner(IOTask *task, uint8_t *data) { co_return co_await task->asyncRecv(data, 1); }
+
+		static Task<ssize_t>
+		recvOuter(IOTask *task, uint8_t *data) { co_return co_await recvInner(task, data); }
+
+		static IOCoroutine
+		waiter(IOTask *task, IOCancelToken *token1, IOCancelToken *token2, int *doneCount)
+		{
+			uint8_t data = 0;
+			ssize_t rc = co_await withCancel(task->asyncRecv(&data, 1), *token1);
+			assert(rc == -1 && errno == ECANCELED);
+			// Already cancelled token doesn't let the operation even start.
+			rc = co_await withCancel(task->asyncRecv(&data, 1), *token1);
+			assert(rc == -1 && errno == ECANCELED);
+			// The token of the outer task reaches the operation in the inner one.
+			rc = co_await withCancel(recvOuter(task, &data), *token2);
+			assert(rc == -1 && errno == ECANCELED);
+			// The task is still alive and the data sent afterwards is received.
+			rc = co_await task->asyncRecv(&data, 1);
+			assert(rc == 1 && data == 7);
+			MAYBE_UNUSED(rc);
+			if (++*doneCount == 2)
+				task->core().stop();
+			co_return;
+		}
+
+		static IOCoroutine
+		canceller(IOTask *task, IOCancelToken *token1, IOCancelToken *token2,
+			int *doneCount)
+		{
+			int rc = co_await task->asyncSleep(5);
+			assert(rc == 0);
+			token1->cancel();
+			rc = co_await task->asyncSleep(5);
+			assert(rc == 0);
+			token2->cancel();
+			uint8_t data = 7;
+			ssize_t size = co_await task->asyncSend(&data, 1);
+			assert(size == 1);
+			MAYBE_UNUSED(rc, size);
+			if (++*doneCount == 2)
+				task->core().stop();
+			co_return;
+		}
+	};
+	int fds[2];
+	int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(rc == 0);
+	makeFdNonblock(fds[0]);
+	makeFdNonblock(fds[1]);
+
+	IOCore core;
+	IOTask *task1 = core.subscribe(fds[0]);
+	IOTask *task2 = core.subscribe(fds[1]);
+	IOCancelToken token1;
+	IOCancelToken token2;
+	int doneCount = 0;
+	Helper::waiter(task1, &token1, &token2, &doneCount);
+	Helper::canceller(task2, &token1, &token2, &doneCount);
+	ioCoreRunF(core);
+	task1->close();
+	task2->close();
+}
+
+// A sleep with the busy-poll enabled. The core spins for a while, and then goes to sleep
+// in the kernel until the timer. A timer due before the end of the spinning interrupts
+// it.
+static void
+checkBusyPoll()
+{
+	struct Helper
+	{
+		static IOCoroutine
+		run(IOTask *task)
+		{
+			for (int i = 0; i < 3; ++i)
+			{
+				int rc = co_await task->asyncSleep(5);
+				assert(rc == 0);
+				MAYBE_UNUSED(rc);
+			}
+			// The spinning is longer than the sleep. The timer still fires on time.
+			task->core().setBusyPollUsec(500'000);
+			uint64_t t1 = getUsec();
+			int rc = co_await task->asyncSleep(5);
+			assert(rc == 0);
+			assert(getUsec() - t1 < 250'000);
+			MAYBE_UNUSED(rc, t1);
+			task->core().stop();
+			co_return;
+		}
+	};
+	int fds[2];
+	int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(rc == 0);
+	makeFdNonblock(fds[0]);
+
+	IOCore core;
+	core.setBusyPollUsec(1000);
+	IOTask *task = core.subscribe(fds[0]);
+	Helper::run(task);
+	ioCoreRunF(core);
+	const IOCoreStats &stats = core.stats();
+	assert(stats.myRollCount > 0);
+	assert(stats.mySpinCount > 0);
+	assert(stats.mySleepCount > 0);
+	MAYBE_UNUSED(stats);
+	task->close();
+	close(fds[1]);
+}
+
+// Vectored and zero-copy operations on a socket pair.
+static void
+checkIOOperations()
+{
+	constexpr size_t bulkSize = 1024 * 1024;
+	constexpr size_t fileSize = 64 * 1024;
+	constexpr size_t pipeSize = 4 * 1024;
+	constexpr size_t totalSize = bulkSize + fileSize + pipeSize;
+	struct Helper
+	{
+		static IOCoroutine
+		receive(IOTask *task, const std::vector<char> *expected)
+		{
+			std::vector<char> buf(totalSize);
+			size_t size = 0;
+			while (size < totalSize)
+			{
+				ssize_t rc = co_await task->asyncRecv(buf.data() + size, totalSize - size);
+				assert(rc > 0);
+				size += rc;
+			}
+			assert(buf == *expected);
+			task->core().stop();
+			co_return;
+		}
+
+		static IOCoroutine
+		send(IOTask *sender, IOTask *receiver, int fileFd, int pipeFd,
+			const std::vector<char> *expected)
+		{
+			// Header and body in one syscall, read into differently split buffers.
+			char header[] = "head";
+			char body[] = "body";
+			iovec vecs[2] = {{header, 4}, {body, 4}};
+			ssize_t rc = co_await sender->asyncSendv(vecs, 2);
+			assert(rc == 8);
+			char buf1[3];
+			char buf2[5];
+			iovec recvVecs[2] = {{buf1, sizeof(buf1)}, {buf2, sizeof(buf2)}};
+			rc = co_await receiver->asyncRecvv(recvVecs, 2);
+			assert(rc == 8);
+			assert(memcmp(buf1, "hea", 3) == 0 && memcmp(buf2, "dbody", 5) == 0);
+
+			receive(receiver, expected);
+			// Much bigger than the socket buffer. Gets sent in parts, while the receiver
+			// makes space.
+			rc = co_await sender->asyncSendAll(expected->data(), bulkSize);
+			assert(rc == bulkSize);
+			off_t offset = 0;
+			while (offset < (off_t)fileSize)
+			{
+				rc = co_await sender->asyncSendfile(fileFd, &offset, fileSize - offset);
+				assert(rc > 0);
+			}
+			size_t size = 0;
+			while (size < pipeSize)
+			{
+				rc = co_await sender->asyncSplice(pipeFd, pipeSize - size);
+				assert(rc > 0);
+				size += rc;
+			}
+			MAYBE_UNUSED(rc);
+			co_return;
+		}
+	};
+	std::vector<char> expected(totalSize);
+	for (size_t i = 0; i < totalSize; ++i)
+		expected[i] = i % 251;
+	int fileFd = memfd_create("iocoro", 0);
+	assert(fileFd >= 0);
+	ssize_t rc = write(fileFd, expected.data() + bulkSize, fileSize);
+	assert(rc == fileSize);
+	int pipeFds[2];
+	rc = pipe(pipeFds);
+	assert(rc == 0);
+	rc = write(pipeFds[1], expected.data() + bulkSize + fileSize, pipeSize);
+	assert(rc == pipeSize);
+	int fds[2];
+	rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(rc == 0);
+	makeFdNonblock(fds[0]);
+	makeFdNonblock(fds[1]);
+
+	IOCore core;
+	IOTask *sender = core.subscribe(fds[0]);
+	IOTask *receiver = core.subscribe(fds[1]);
+	Helper::send(sender, receiver, fileFd, pipeFds[0], &expected);
+	ioCoreRunF(core);
+	sender->close();
+	receiver->close();
+	close(pipeFds[0]);
+	close(pipeFds[1]);
+	close(fileFd);
+}
+
+// Groups destroyed right after creation. Their cores can be stopped before rolling even
+// once, with the own eventfd task still waiting to be added.
+static void
+checkGroupCreateDestroy()
+{
+	for (int i = 0; i < 2000; ++i)
+		IOCoreGroup group(4);
+}
+
 int main()
 {
+	checkTaskStack();
+	checkTimers();
+	checkCancel();
+	checkBusyPoll();
+	checkIOOperations();
+	checkGroupCreateDestroy();
 	int rc = run();
 	assert(Client::theCount.load(std::memory_order_relaxed) == 0);
 	assert(IOCoroutinePromise::theCount.load(std::memory_order_relaxed) == 0);
+	assert(TaskPromiseBase::theCount.load(std::memory_order_relaxed) == 0);
 	assert(IOTask::theCount.load(std::memory_order_relaxed) == 0);
 	return rc;
 }
@@ -251,6 +561,8 @@ Client::connectAndRun(
 	// the coroutine body would reference lambda's captures which would be deleted when
 	// the lambda object is destroyed, and that would lead to use-after-free.
 	[](Client* self, uint16_t port) -> IOCoroutine {
+		// The task's operations must be done in its core's thread.
+		co_await self->myTask->core().schedule();
 		LOG_OBJ_DEBUG(Client, self, coroConnectAndRun, "");
 		sockaddr_in addr;
 		memset(&addr, 0, sizeof(addr));
@@ -259,9 +571,9 @@ Client::connectAndRun(
 		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 		int rc = co_await self->myTask->asyncConnect((sockaddr *)&addr, sizeof(addr));
 		assert(rc == 0);
-		// Unfortunately, can't reuse the current coroutine for running the main loop.
-		// Have to create a new one.
-		self->coroRun();
+		// The main loop is a nested task, so the same coroutine goes on serving it.
+		co_await self->coroServe();
+		self->finish();
 		co_return;
 	}(this, port);
 }
@@ -281,23 +593,50 @@ Client::wrapAndRun(
 IOCoroutine
 Client::coroRun()
 {
+	co_await myTask->core().schedule();
 	LOG_THIS_DEBUG(Client, coroRun, "");
+	co_await coroServe();
+	finish();
+	co_return;
+}
+
+Task<void>
+Client::coroServe()
+{
 	for (uint32_t i = 0; i < theRequestTargetCount; ++i)
 	{
-		uint8_t data;
-		LOG_THIS_DEBUG(Client, coroRun, "send");
-		ssize_t rc = co_await myTask->asyncSend(&data, 1);
-		LOG_THIS_DEBUG(Client, coroRun, "sent " << rc);
-		assert(rc == 1);
-		LOG_THIS_DEBUG(Client, coroRun, "receive");
-		rc = co_await myTask->asyncRecv(&data, 1);
-		LOG_THIS_DEBUG(Client, coroRun, "received " << rc);
-		assert(rc == 1);
+		bool ok = co_await coroRequest();
+		assert(ok);
+		MAYBE_UNUSED(ok);
 	}
-	LOG_THIS_DEBUG(Client, coroRun, "finish");
+	co_return;
+}
+
+Task<bool>
+Client::coroRequest()
+{
+	uint8_t data;
+	LOG_THIS_DEBUG(Client, coroRequest, "send");
+	ssize_t rc = co_await myTask->asyncSendAll(&data, 1);
+	LOG_THIS_DEBUG(Client, coroRequest, "sent " << rc);
+	if (rc != 1)
+		co_return false;
+	LOG_THIS_DEBUG(Client, coroRequest, "receive");
+	rc = co_await withTimeout(myTask->asyncRecv(&data, 1), theRecvTimeoutMs);
+	LOG_THIS_DEBUG(Client, coroRequest, "received " << rc);
+	if (rc != 1)
+		co_return false;
+	++mySendCount;
+	++myRecvCount;
+	co_return true;
+}
+
+void
+Client::finish()
+{
+	LOG_THIS_DEBUG(Client, finish, "");
 	myContext->onClientFinish();
 	delete this;
-	co_return;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -305,6 +644,7 @@ Client::coroRun()
 Server::Server(
 	const std::shared_ptr<Context>& ctx)
 	: myTask(nullptr)
+	, myGroup(nullptr)
 	, myContext(ctx)
 {
 }
@@ -316,7 +656,7 @@ Server::~Server()
 
 uint16_t
 Server::bindAndListenAndRun(
-	IOCore &core)
+	IOCoreGroup &group)
 {
 	sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
@@ -334,7 +674,8 @@ Server::bindAndListenAndRun(
 	rc = listen(sock, SOMAXCONN);
 	assert(rc == 0);
 	makeFdNonblock(sock);
-	myTask = core.subscribe(sock);
+	myGroup = &group;
+	myTask = group.core(0).subscribe(sock);
 	LOG_THIS_DEBUG(Server, bindAndListen, myTask);
 
 	rc = getsockname(sock, (sockaddr *)&addr, &len);
@@ -356,6 +697,7 @@ IOCoroutine
 Server::coroRun()
 {
 	IOTask *task = myTask;
+	co_await task->core().schedule();
 	while (true)
 	{
 		LOG_THIS_DEBUG(Server, coroRun, "accept start");
@@ -366,7 +708,7 @@ Server::coroRun()
 		if (sock < 0)
 			break;
 		LOG_THIS_DEBUG(Server, coroRun, "new client, " << sock);
-		(new Client(myContext))->wrapAndRun(task->core(), sock);
+		(new Client(myContext))->wrapAndRun(myGroup->pickCore(), sock);
 	}
 	myContext->onServerFinish();
 	co_return;
@@ -0,0 +1,677 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * External merge sort of the integer files, which don't need to fit into the memory.
+ * The same task as in 1_simple_sort.c, 2_parallel_sort.c, 3_mem_sort.c, but done in a
+ * way which is bound by the disk speed instead of by fscanf():
+ *
+ * - The input files are mmap'ed, and the text is parsed by hand. No FILE buffering
+ *   and no format string interpretation per number.
+ *
+ * - The worker threads take the input in chunks, parse them into own buffers, and when
+ *   a buffer is full sort it with a radix sort and append it to a temporary file as a
+ *   sorted run. All the runs are in one file at known offsets, so their number isn't
+ *   limited by the open file limit. The chunks are taken dynamically, so the threads
+ *   finish together even when the files have different sizes.
+ *
+ * - The runs are merged with a loser tree. Each step of it is one comparison per tree
+ *   level, and the runs are read and the result is written in big sequential blocks.
+ *   The number of runs merged at once is limited by the memory for the blocks. If there
+ *   are more runs, they are first merged in groups into a second temporary file, and
+ *   the two files swap their roles until one merge is enough.
+ *
+ * Usage: 16_external_sort [-b] [-t threads] [-m memory_mb] [-T tmp_dir] [-o output]
+ *                         input1 [input2 ...]
+ *
+ * With -b the input and the output are native 4 byte integers, otherwise they are
+ * text numbers separated by anything except digits and '-'. The output is printed one
+ * number per line. Without -o it goes to stdout.
+ */
+
+enum {
+	/** Input size taken by a worker thread at once. */
+	CHUNK_SIZE = 16 * 1024 * 1024,
+	/** Runs merged at once. More would make the blocks too small for the disk. */
+	MAX_FAN_IN = 256,
+	/** Numbers in a worker's buffer at least. */
+	MIN_RUN_CAPACITY = 1024 * 1024,
+	MIN_IO_SIZE = 256 * 1024,
+	MAX_IO_SIZE = 16 * 1024 * 1024,
+	/** Enough for "-2147483648\n". */
+	MAX_NUMBER_TEXT_SIZE = 12,
+};
+
+struct input {
+	const char *data;
+	size_t size;
+};
+
+/** A sorted run in a temporary file. */
+struct run {
+	off_t offset;
+	size_t count;
+};
+
+struct sorter {
+	bool is_binary;
+	const char *tmp_dir;
+	struct input *inputs;
+	int input_count;
+	/** Next chunk to give to a worker. */
+	int input_idx;
+	size_t input_pos;
+	/** Numbers in a worker's buffer. */
+	size_t run_capacity;
+	size_t chunk_size;
+	pthread_mutex_t mutex;
+	/** The file with all the runs. */
+	int run_fd;
+	off_t run_file_size;
+	struct run *runs;
+	int run_count;
+	int run_capacity_count;
+};
+
+static void
+check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+	fprintf(stderr, "%s: %s\n", what, strerror(errno));
+	exit(-1);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline bool
+is_number_char(char c)
+{
+	return (c >= '0' && c <= '9') || c == '-';
+}
+
+static void
+pwrite_all(int fd, const void *data, size_t size, off_t offset)
+{
+	const char *pos = data;
+	while (size > 0) {
+		ssize_t rc = pwrite(fd, pos, size, offset);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		check(rc > 0, "pwrite");
+		pos += rc;
+		size -= rc;
+		offset += rc;
+	}
+}
+
+static void
+write_all(int fd, const void *data, size_t size)
+{
+	const char *pos = data;
+	while (size > 0) {
+		ssize_t rc = write(fd, pos, size);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		check(rc > 0, "write");
+		pos += rc;
+		size -= rc;
+	}
+}
+
+/** Read exactly the size from the offset. */
+static void
+pread_all(int fd, void *data, size_t size, off_t offset)
+{
+	char *pos = data;
+	while (size > 0) {
+		ssize_t rc = pread(fd, pos, size, offset);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		check(rc >= 0, "pread");
+		if (rc == 0) {
+			errno = EIO;
+			check(false, "unexpected end of a temporary file");
+		}
+		pos += rc;
+		size -= rc;
+		offset += rc;
+	}
+}
+
+static int
+tmp_file_open(const char *dir)
+{
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/external_sort_XXXXXX", dir);
+	int fd = mkstemp(path);
+	check(fd >= 0, "mkstemp");
+	/* The file lives while it is open, and disappears even if the sort crashes. */
+	unlink(path);
+	return fd;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Run generation.
+
+/**
+ * Take the next chunk of the input. The text chunks are extended to the end of the
+ * last number, so a number is never split between two workers.
+ */
+static bool
+sorter_next_chunk(struct sorter *s, const char **data, size_t *size)
+{
+	bool ok = false;
+	pthread_mutex_lock(&s->mutex);
+	while (s->input_idx < s->input_count) {
+		struct input *in = &s->inputs[s->input_idx];
+		if (s->input_pos == in->size) {
+			++s->input_idx;
+			s->input_pos = 0;
+			continue;
+		}
+		size_t end = s->input_pos + s->chunk_size;
+		if (end > in->size)
+			end = in->size;
+		if (s->is_binary) {
+			end -= (end - s->input_pos) % sizeof(int);
+		} else {
+			while (end < in->size && is_number_char(in->data[end]))
+				++end;
+		}
+		*data = in->data + s->input_pos;
+		*size = end - s->input_pos;
+		s->input_pos = end;
+		if (s->is_binary && *size == 0) {
+			fprintf(stderr, "ignoring %zu trailing bytes of the input %d\n",
+				in->size - end, s->input_idx);
+			s->input_pos = in->size;
+			continue;
+		}
+		ok = true;
+		break;
+	}
+	pthread_mutex_unlock(&s->mutex);
+	return ok;
+}
+
+static size_t
+parse_text(const char *pos, const char *end, int *out)
+{
+	size_t count = 0;
+	while (true) {
+		while (pos < end && !is_number_char(*pos))
+			++pos;
+		if (pos == end)
+			break;
+		bool is_negative = *pos == '-';
+		if (is_negative)
+			++pos;
+		const char *digits = pos;
+		uint32_t value = 0;
+		while (pos < end && (unsigned char)(*pos - '0') < 10)
+			value = value * 10 + (*pos++ - '0');
+		if (pos == digits)
+			continue;
+		out[count++] = is_negative ? (int)(0 - value) : (int)value;
+	}
+	return count;
+}
+
+/**
+ * LSD radix sort by bytes. The sign bit is flipped, so the negative numbers go first.
+ * The passes where all the numbers have the same byte are skipped, which is common
+ * for the numbers from a small range.
+ */
+static void
+radix_sort(int *array, int *tmp, size_t count)
+{
+	if (count == 0)
+		return;
+	size_t hist[4][256];
+	memset(hist, 0, sizeof(hist));
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t v = (uint32_t)array[i] ^ 0x80000000;
+		for (int b = 0; b < 4; ++b)
+			++hist[b][(v >> (b * 8)) & 0xff];
+	}
+	int *src = array;
+	int *dst = tmp;
+	for (int b = 0; b < 4; ++b) {
+		size_t *h = hist[b];
+		uint32_t shift = b * 8;
+		if (h[((uint32_t)src[0] ^ 0x80000000) >> shift & 0xff] == count)
+			continue;
+		size_t offset = 0;
+		for (int i = 0; i < 256; ++i) {
+			size_t c = h[i];
+			h[i] = offset;
+			offset += c;
+		}
+		for (size_t i = 0; i < count; ++i) {
+			uint32_t v = (uint32_t)src[i] ^ 0x80000000;
+			dst[h[(v >> shift) & 0xff]++] = src[i];
+		}
+		int *t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != array)
+		memcpy(array, src, count * sizeof(int));
+}
+
+static void
+sorter_add_run(struct sorter *s, int *array, int *tmp, size_t count)
+{
+	radix_sort(array, tmp, count);
+	size_t size = count * sizeof(int);
+	pthread_mutex_lock(&s->mutex);
+	if (s->run_count == s->run_capacity_count) {
+		s->run_capacity_count = s->run_capacity_count * 2 + 16;
+		s->runs = realloc(s->runs, s->run_capacity_count * sizeof(s->runs[0]));
+		check(s->runs != NULL, "realloc");
+	}
+	/* Only the place in the file is taken under the lock, the writes go in parallel. */
+	off_t offset = s->run_file_size;
+	s->run_file_size += size;
+	s->runs[s->run_count].offset = offset;
+	s->runs[s->run_count].count = count;
+	++s->run_count;
+	pthread_mutex_unlock(&s->mutex);
+	pwrite_all(s->run_fd, array, size, offset);
+}
+
+static void *
+worker_f(void *arg)
+{
+	struct sorter *s = arg;
+	int *array = malloc(s->run_capacity * sizeof(int));
+	int *tmp = malloc(s->run_capacity * sizeof(int));
+	check(array != NULL && tmp != NULL, "malloc");
+	size_t count = 0;
+	const char *data;
+	size_t size;
+	while (sorter_next_chunk(s, &data, &size)) {
+		/* A text number takes at least 2 bytes, except the last one. */
+		size_t max_count = s->is_binary ? size / sizeof(int) : (size + 1) / 2;
+		if (count > 0 && count + max_count > s->run_capacity) {
+			sorter_add_run(s, array, tmp, count);
+			count = 0;
+		}
+		if (s->is_binary) {
+			memcpy(array + count, data, size);
+			count += size / sizeof(int);
+		} else {
+			count += parse_text(data, data + size, array + count);
+		}
+	}
+	if (count > 0)
+		sorter_add_run(s, array, tmp, count);
+	free(tmp);
+	free(array);
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Merge.
+
+struct merge_source {
+	int fd;
+	/** Where the not yet read part of the run starts, and how many numbers it has. */
+	off_t offset;
+	size_t left;
+	int *buf;
+	size_t count;
+	size_t pos;
+};
+
+struct merge_output {
+	int fd;
+	bool is_text;
+	char *buf;
+	size_t size;
+	size_t capacity;
+};
+
+/**
+ * Loser tree. The leaves are the sources, each internal node keeps the source which
+ * lost the match there, and node 0 keeps the overall winner. When the winner's source
+ * moves to its next number, only the matches on the way from its leaf to the root are
+ * replayed. The exhausted sources have a key bigger than any number.
+ */
+struct loser_tree {
+	int64_t *keys;
+	int *nodes;
+	/** Leaf count, a power of 2. */
+	int size;
+};
+
+static inline void
+merge_output_flush(struct merge_output *out)
+{
+	write_all(out->fd, out->buf, out->size);
+	out->size = 0;
+}
+
+static inline void
+merge_output_put(struct merge_output *out, int value)
+{
+	if (out->capacity - out->size < MAX_NUMBER_TEXT_SIZE)
+		merge_output_flush(out);
+	char *pos = out->buf + out->size;
+	if (!out->is_text) {
+		memcpy(pos, &value, sizeof(value));
+		out->size += sizeof(value);
+		return;
+	}
+	uint32_t v = (uint32_t)value;
+	if (value < 0) {
+		*pos++ = '-';
+		v = 0 - v;
+	}
+	char digits[10];
+	int len = 0;
+	do {
+		digits[len++] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	while (len > 0)
+		*pos++ = digits[--len];
+	*pos++ = '\n';
+	out->size = pos - out->buf;
+}
+
+static inline int64_t
+merge_source_next(struct merge_source *src, size_t buf_count)
+{
+	if (src->pos == src->count) {
+		if (src->left == 0)
+			return INT64_MAX;
+		src->count = src->left < buf_count ? src->left : buf_count;
+		src->pos = 0;
+		pread_all(src->fd, src->buf, src->count * sizeof(int), src->offset);
+		src->offset += src->count * sizeof(int);
+		src->left -= src->count;
+	}
+	return src->buf[src->pos++];
+}
+
+static void
+loser_tree_build(struct loser_tree *t)
+{
+	int *winners = malloc(2 * t->size * sizeof(int));
+	check(winners != NULL, "malloc");
+	for (int i = 0; i < t->size; ++i)
+		winners[t->size + i] = i;
+	for (int n = t->size - 1; n >= 1; --n) {
+		int l = winners[2 * n];
+		int r = winners[2 * n + 1];
+		if (t->keys[l] <= t->keys[r]) {
+			winners[n] = l;
+			t->nodes[n] = r;
+		} else {
+			winners[n] = r;
+			t->nodes[n] = l;
+		}
+	}
+	t->nodes[0] = t->size > 1 ? winners[1] : 0;
+	free(winners);
+}
+
+static inline void
+loser_tree_replay(struct loser_tree *t, int leaf)
+{
+	int winner = leaf;
+	int64_t key = t->keys[winner];
+	for (int n = (t->size + leaf) / 2; n >= 1; n /= 2) {
+		int other = t->nodes[n];
+		if (t->keys[other] < key) {
+			t->nodes[n] = winner;
+			winner = other;
+			key = t->keys[other];
+		}
+	}
+	t->nodes[0] = winner;
+}
+
+/**
+ * How many runs can be merged at once. Each of them and the output need a block of at
+ * least MIN_IO_SIZE.
+ */
+static int
+merge_fan_in(size_t memory)
+{
+	size_t fan_in = memory / MIN_IO_SIZE;
+	if (fan_in > MAX_FAN_IN + 1)
+		return MAX_FAN_IN;
+	if (fan_in < 3)
+		return 2;
+	return fan_in - 1;
+}
+
+/**
+ * Merge the runs stored in the file into the output, which is a file descriptor with
+ * own format.
+ */
+static void
+merge(int fd, struct run *runs, int run_count, struct merge_output *out,
+      size_t memory)
+{
+	size_t io_size = memory / (run_count + 1);
+	if (io_size < MIN_IO_SIZE)
+		io_size = MIN_IO_SIZE;
+	if (io_size > MAX_IO_SIZE)
+		io_size = MAX_IO_SIZE;
+	size_t buf_count = io_size / sizeof(int);
+	out->buf = malloc(io_size);
+	out->capacity = io_size;
+	out->size = 0;
+	check(out->buf != NULL, "malloc");
+
+	struct loser_tree t;
+	t.size = 1;
+	while (t.size < run_count)
+		t.size *= 2;
+	t.keys = malloc(t.size * sizeof(t.keys[0]));
+	t.nodes = malloc(t.size * sizeof(t.nodes[0]));
+	struct merge_source *srcs = calloc(t.size, sizeof(srcs[0]));
+	check(t.keys != NULL && t.nodes != NULL && srcs != NULL, "malloc");
+	for (int i = 0; i < t.size; ++i) {
+		t.keys[i] = INT64_MAX;
+		if (i >= run_count)
+			continue;
+		struct merge_source *src = &srcs[i];
+		src->fd = fd;
+		src->offset = runs[i].offset;
+		src->left = runs[i].count;
+#ifdef POSIX_FADV_SEQUENTIAL
+		posix_fadvise(fd, src->offset, src->left * sizeof(int),
+			POSIX_FADV_SEQUENTIAL);
+#endif
+		src->buf = malloc(io_size);
+		check(src->buf != NULL, "malloc");
+		t.keys[i] = merge_source_next(src, buf_count);
+	}
+	loser_tree_build(&t);
+	while (true) {
+		int winner = t.nodes[0];
+		int64_t key = t.keys[winner];
+		if (key == INT64_MAX)
+			break;
+		merge_output_put(out, (int)key);
+		t.keys[winner] = merge_source_next(&srcs[winner], buf_count);
+		loser_tree_replay(&t, winner);
+	}
+	merge_output_flush(out);
+
+	for (int i = 0; i < run_count; ++i)
+		free(srcs[i].buf);
+	free(srcs);
+	free(t.nodes);
+	free(t.keys);
+	free(out->buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int
+main(int argc, char **argv)
+{
+	uint64_t start_ns = now_ns();
+	struct sorter s;
+	memset(&s, 0, sizeof(s));
+	s.tmp_dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+	long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t memory = 1024 * 1024 * 1024;
+	const char *output_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "bt:m:T:o:")) != -1) {
+		switch (opt) {
+		case 'b':
+			s.is_binary = true;
+			break;
+		case 't':
+			thread_count = atol(optarg);
+			break;
+		case 'm':
+			memory = (size_t)atol(optarg) * 1024 * 1024;
+			break;
+		case 'T':
+			s.tmp_dir = optarg;
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-b] [-t threads] [-m memory_mb] "
+				"[-T tmp_dir] [-o output] input1 [input2 ...]\n", argv[0]);
+			return -1;
+		}
+	}
+	if (thread_count < 1)
+		thread_count = 1;
+	s.input_count = argc - optind;
+	s.inputs = calloc(s.input_count + 1, sizeof(s.inputs[0]));
+	check(s.inputs != NULL, "calloc");
+	for (int i = 0; i < s.input_count; ++i) {
+		int fd = open(argv[optind + i], O_RDONLY);
+		check(fd >= 0, argv[optind + i]);
+		struct stat st;
+		check(fstat(fd, &st) == 0, "fstat");
+		s.inputs[i].size = st.st_size;
+		if (st.st_size > 0) {
+			void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			check(data != MAP_FAILED, "mmap");
+			/* The pages are read once in order. Let the kernel read ahead more. */
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			s.inputs[i].data = data;
+		}
+		close(fd);
+	}
+	/* Each worker has a buffer for the numbers and the same one for the sorting. */
+	s.run_capacity = memory / thread_count / 2 / sizeof(int);
+	if (s.run_capacity < MIN_RUN_CAPACITY)
+		s.run_capacity = MIN_RUN_CAPACITY;
+	s.chunk_size = CHUNK_SIZE;
+	if (s.chunk_size > s.run_capacity)
+		s.chunk_size = s.run_capacity;
+	pthread_mutex_init(&s.mutex, NULL);
+	s.run_fd = tmp_file_open(s.tmp_dir);
+
+	pthread_t *threads = malloc(thread_count * sizeof(threads[0]));
+	check(threads != NULL, "malloc");
+	for (long i = 0; i < thread_count; ++i) {
+		errno = pthread_create(&threads[i], NULL, worker_f, &s);
+		check(errno == 0, "pthread_create");
+	}
+	for (long i = 0; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	for (int i = 0; i < s.input_count; ++i) {
+		if (s.inputs[i].size > 0)
+			munmap((void *)s.inputs[i].data, s.inputs[i].size);
+	}
+	size_t total_count = 0;
+	for (int i = 0; i < s.run_count; ++i)
+		total_count += s.runs[i].count;
+	uint64_t runs_ns = now_ns();
+	fprintf(stderr, "%zu numbers, %d runs generated by %ld threads in %lfs\n",
+		total_count, s.run_count, thread_count,
+		(runs_ns - start_ns) / 1000000000.0);
+
+	/*
+	 * Merge the runs in groups until all of them can be merged at once. A pass writes
+	 * the merged runs one after another into the other file, and then the files swap.
+	 */
+	int fan_in = merge_fan_in(memory);
+	int pass_count = 0;
+	int next_fd = -1;
+	while (s.run_count > fan_in) {
+		if (next_fd < 0)
+			next_fd = tmp_file_open(s.tmp_dir);
+		check(ftruncate(next_fd, 0) == 0, "ftruncate");
+		check(lseek(next_fd, 0, SEEK_SET) == 0, "lseek");
+		off_t next_size = 0;
+		int new_count = 0;
+		for (int i = 0; i < s.run_count; i += fan_in) {
+			int group = s.run_count - i;
+			if (group > fan_in)
+				group = fan_in;
+			struct run merged;
+			merged.offset = next_size;
+			merged.count = 0;
+			for (int j = 0; j < group; ++j)
+				merged.count += s.runs[i + j].count;
+			next_size += merged.count * sizeof(int);
+			struct merge_output out;
+			out.fd = next_fd;
+			out.is_text = false;
+			merge(s.run_fd, &s.runs[i], group, &out, memory);
+			s.runs[new_count++] = merged;
+		}
+		s.run_count = new_count;
+		int tmp = s.run_fd;
+		s.run_fd = next_fd;
+		next_fd = tmp;
+		++pass_count;
+	}
+	if (next_fd >= 0)
+		close(next_fd);
+	struct merge_output out;
+	out.fd = STDOUT_FILENO;
+	if (output_path != NULL) {
+		out.fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		check(out.fd >= 0, output_path);
+	}
+	out.is_text = !s.is_binary;
+	merge(s.run_fd, s.runs, s.run_count, &out, memory);
+	++pass_count;
+	if (output_path != NULL)
+		check(close(out.fd) == 0, "close");
+
+	uint64_t end_ns = now_ns();
+	fprintf(stderr, "merged in %d passes in %lfs\n", pass_count,
+		(end_ns - runs_ns) / 1000000000.0);
+	fprintf(stderr, "sort time = %lfs\n", (end_ns - start_ns) / 1000000000.0);
+	close(s.run_fd);
+	pthread_mutex_destroy(&s.mutex);
+	free(s.runs);
+	free(s.inputs);
+	return 0;
+}
@@ -0,0 +1,505 @@
+#include "bench.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+enum {
+	BENCH_DEFAULT_RUN_COUNT = 5,
+	BENCH_DEFAULT_WARMUP_COUNT = 1,
+	BENCH_DEFAULT_MIN_RUN_MS = 100,
+	// The calibration grows the iteration count at most this many times per step. Very
+	// short runs are too noisy to extrapolate from.
+	BENCH_CALIBRATION_MAX_STEP = 10,
+};
+
+static const char *const bench_counter_names[BENCH_COUNTER_COUNT] = {
+	"cycles",
+	"instructions",
+	"cache_misses",
+	"branch_misses",
+};
+
+static const char *const bench_percentile_names[BENCH_PERCENTILE_COUNT] = {
+	"p50",
+	"p90",
+	"p99",
+	"p999",
+};
+
+static const double bench_percentile_shares[BENCH_PERCENTILE_COUNT] = {
+	0.5,
+	0.9,
+	0.99,
+	0.999,
+};
+
+static const uint64_t bench_counter_configs[BENCH_COUNTER_COUNT] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+// CPUs allowed for the process before any pinning.
+static cpu_set_t bench_allowed_cpus;
+
+uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t
+bench_arg_uint(int argc, char **argv, const char *name, uint64_t def)
+{
+	for (int i = 1; i < argc - 1; ++i) {
+		if (strcmp(argv[i], name) == 0)
+			return strtoull(argv[i + 1], NULL, 10);
+	}
+	return def;
+}
+
+const char *
+bench_arg_str(int argc, char **argv, const char *name, const char *def)
+{
+	for (int i = 1; i < argc - 1; ++i) {
+		if (strcmp(argv[i], name) == 0)
+			return argv[i + 1];
+	}
+	return def;
+}
+
+static bool
+bench_arg_flag(int argc, char **argv, const char *name)
+{
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], name) == 0)
+			return true;
+	}
+	return false;
+}
+
+static void
+bench_pin(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+		printf("# couldn't pin to CPU %d: %s\n", cpu, strerror(errno));
+		exit(-1);
+	}
+}
+
+void
+bench_pin_thread(const struct bench *b, uint32_t thread_idx)
+{
+	if (b->cpu < 0)
+		return;
+	// Take the allowed CPUs in a circle starting from the main thread's one.
+	int cpu = b->cpu;
+	for (uint32_t i = 0; i < thread_idx; ++i) {
+		do {
+			cpu = (cpu + 1) % CPU_SETSIZE;
+		} while (!CPU_ISSET(cpu, &bench_allowed_cpus));
+	}
+	bench_pin(cpu);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void
+bench_hist_reset(struct bench_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+static uint32_t
+bench_hist_bucket(uint64_t ns)
+{
+	if (ns < BENCH_HIST_SUB_BUCKET_COUNT)
+		return ns;
+	// The highest bit selects the power of 2, the next 4 bits - the bucket inside it.
+	uint32_t high_bit = 63 - __builtin_clzll(ns);
+	uint32_t sub = (ns >> (high_bit - 4)) & (BENCH_HIST_SUB_BUCKET_COUNT - 1);
+	return (high_bit - 3) * BENCH_HIST_SUB_BUCKET_COUNT + sub;
+}
+
+static uint64_t
+bench_hist_bucket_min(uint32_t bucket)
+{
+	if (bucket < BENCH_HIST_SUB_BUCKET_COUNT)
+		return bucket;
+	uint32_t high_bit = bucket / BENCH_HIST_SUB_BUCKET_COUNT + 3;
+	uint64_t sub = bucket % BENCH_HIST_SUB_BUCKET_COUNT;
+	return (1ull << high_bit) | (sub << (high_bit - 4));
+}
+
+void
+bench_hist_add(struct bench_hist *h, uint64_t ns)
+{
+	++h->counts[bench_hist_bucket(ns)];
+	++h->total;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+uint64_t
+bench_hist_percentile(const struct bench_hist *h, double share)
+{
+	uint64_t rank = (uint64_t)ceil(share * h->total);
+	uint64_t seen = 0;
+	for (uint32_t i = 0; i < BENCH_HIST_BUCKET_COUNT; ++i) {
+		seen += h->counts[i];
+		if (seen >= rank && seen > 0)
+			return std::min(bench_hist_bucket_min(i), h->max);
+	}
+	return h->max;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static void
+bench_counters_open(struct bench *b)
+{
+	bool is_any_open = false;
+	for (int i = 0; i < BENCH_COUNTER_COUNT; ++i) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = bench_counter_configs[i];
+		attr.disabled = 1;
+		// Count the threads started by the benchmark too.
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+			PERF_FORMAT_TOTAL_TIME_RUNNING;
+		b->counter_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		is_any_open = is_any_open || b->counter_fds[i] >= 0;
+	}
+	if (!is_any_open)
+		printf("# hardware counters are not available\n");
+}
+
+static void
+bench_counters_start(struct bench *b)
+{
+	for (int fd : b->counter_fds) {
+		if (fd < 0)
+			continue;
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+static void
+bench_counters_stop(struct bench *b, double *sums)
+{
+	for (int i = 0; i < BENCH_COUNTER_COUNT; ++i) {
+		int fd = b->counter_fds[i];
+		if (fd < 0)
+			continue;
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		uint64_t data[3];
+		if (read(fd, data, sizeof(data)) != sizeof(data) || data[2] == 0)
+			continue;
+		// When there are more counters than the CPU has, they take turns. Then the
+		// value is extrapolated to the whole time.
+		sums[i] += (double)data[0] * data[1] / data[2];
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void
+bench_init(struct bench *b, int argc, char **argv)
+{
+	memset(b, 0, sizeof(*b));
+	b->run_count = bench_arg_uint(argc, argv, "--runs", BENCH_DEFAULT_RUN_COUNT);
+	if (b->run_count == 0)
+		b->run_count = 1;
+	b->warmup_count = bench_arg_uint(argc, argv, "--warmup",
+		BENCH_DEFAULT_WARMUP_COUNT);
+	b->iteration_count = bench_arg_uint(argc, argv, "--iterations", 0);
+	b->min_run_ns = bench_arg_uint(argc, argv, "--min-time-ms",
+		BENCH_DEFAULT_MIN_RUN_MS) * 1000000;
+	b->cpu = (int)bench_arg_uint(argc, argv, "--cpu", (uint64_t)-1);
+	const char *format = bench_arg_str(argc, argv, "--format", "text");
+	if (strcmp(format, "csv") == 0) {
+		b->format = BENCH_FORMAT_CSV;
+	} else if (strcmp(format, "json") == 0) {
+		b->format = BENCH_FORMAT_JSON;
+	} else if (strcmp(format, "text") == 0) {
+		b->format = BENCH_FORMAT_TEXT;
+	} else {
+		printf("# unknown format %s\n", format);
+		exit(-1);
+	}
+	b->use_counters = bench_arg_flag(argc, argv, "--counters");
+	for (int &fd : b->counter_fds)
+		fd = -1;
+	if (b->use_counters)
+		bench_counters_open(b);
+	if (sched_getaffinity(0, sizeof(bench_allowed_cpus), &bench_allowed_cpus) != 0) {
+		printf("# couldn't get the CPUs: %s\n", strerror(errno));
+		exit(-1);
+	}
+	if (b->cpu >= 0)
+		bench_pin(b->cpu);
+}
+
+void
+bench_destroy(struct bench *b)
+{
+	for (int &fd : b->counter_fds) {
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+	fflush(stdout);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t
+bench_run_once(const struct bench_case *c, uint64_t iteration_count)
+{
+	uint64_t start = bench_now_ns();
+	c->func(iteration_count, c->arg);
+	return bench_now_ns() - start;
+}
+
+static uint64_t
+bench_calibrate(const struct bench *b, const struct bench_case *c)
+{
+	uint64_t count = 1;
+	while (true) {
+		uint64_t ns = bench_run_once(c, count);
+		if (ns >= b->min_run_ns)
+			return count;
+		// Aim a bit higher, so the next run is likely to be the last one.
+		uint64_t next = count * BENCH_CALIBRATION_MAX_STEP;
+		if (ns > 0) {
+			next = std::min(next,
+				(uint64_t)((double)count * b->min_run_ns * 1.2 / ns));
+		}
+		count = std::max(next, count + 1);
+	}
+}
+
+static double
+bench_median(std::vector<double> values)
+{
+	std::sort(values.begin(), values.end());
+	size_t n = values.size();
+	if (n % 2 == 1)
+		return values[n / 2];
+	return (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+static void
+bench_stats(const std::vector<double> &times, struct bench_result *res)
+{
+	res->min_ns = *std::min_element(times.begin(), times.end());
+	res->max_ns = *std::max_element(times.begin(), times.end());
+	res->median_ns = bench_median(times);
+	std::vector<double> devs;
+	for (double t : times)
+		devs.push_back(fabs(t - res->median_ns));
+	// Scaled to be comparable with the standard deviation of a normal distribution.
+	res->mad_ns = bench_median(devs) * 1.4826;
+	double sum = 0;
+	uint32_t count = 0;
+	res->outlier_count = 0;
+	for (double t : times) {
+		// With zero deviation nothing is an outlier, even if a run is different.
+		if (res->mad_ns > 0 && fabs(t - res->median_ns) > 3 * res->mad_ns) {
+			++res->outlier_count;
+			continue;
+		}
+		sum += t;
+		++count;
+	}
+	res->mean_ns = count > 0 ? sum / count : res->median_ns;
+}
+
+static void
+bench_print_csv_str(const char *str)
+{
+	putchar('"');
+	for (; *str != 0; ++str) {
+		if (*str == '"')
+			putchar('"');
+		putchar(*str);
+	}
+	putchar('"');
+}
+
+static void
+bench_print_json_str(const char *str)
+{
+	putchar('"');
+	for (; *str != 0; ++str) {
+		if (*str == '"' || *str == '\\')
+			putchar('\\');
+		putchar(*str);
+	}
+	putchar('"');
+}
+
+static void
+bench_print(struct bench *b, const struct bench_case *c, const struct bench_result *res)
+{
+	double mbps = c->bytes_per_op != 0 ? c->bytes_per_op * 1000.0 / res->median_ns : -1;
+	bool has_latency = res->latency_ns[0] >= 0;
+	switch (b->format) {
+	case BENCH_FORMAT_TEXT:
+		printf("%s\n", c->name);
+		printf("    min: %.3f ns\n", res->min_ns);
+		printf("    max: %.3f ns\n", res->max_ns);
+		printf("    med: %.3f ns\n", res->median_ns);
+		printf("    mean: %.3f ns, mad: %.3f ns, outliers: %u\n", res->mean_ns,
+			res->mad_ns, res->outlier_count);
+		printf("    iterations: %llu, runs: %u\n",
+			(unsigned long long)res->iteration_count, res->run_count);
+		if (mbps >= 0)
+			printf("    speed: %.1f MB/s, %.3f GB/s\n", mbps, mbps / 1000);
+		if (has_latency) {
+			printf("    latency:");
+			for (int i = 0; i < BENCH_PERCENTILE_COUNT; ++i) {
+				printf(" %s %.0f ns,", bench_percentile_names[i],
+					res->latency_ns[i]);
+			}
+			printf(" max %.0f ns\n", res->latency_max_ns);
+		}
+		for (int i = 0; i < BENCH_COUNTER_COUNT; ++i) {
+			if (res->counters[i] >= 0) {
+				printf("    %s: %.3f per op\n", bench_counter_names[i],
+					res->counters[i]);
+			}
+		}
+		break;
+	case BENCH_FORMAT_CSV:
+		if (!b->is_header_printed) {
+			printf("name,iterations,runs,min_ns,med_ns,max_ns,mean_ns,mad_ns,"
+				"outliers,mb_per_sec,gb_per_sec");
+			for (const char *name : bench_counter_names)
+				printf(",%s", name);
+			for (const char *name : bench_percentile_names)
+				printf(",%s_ns", name);
+			printf(",max_latency_ns\n");
+			b->is_header_printed = true;
+		}
+		bench_print_csv_str(c->name);
+		printf(",%llu,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%u,",
+			(unsigned long long)res->iteration_count, res->run_count, res->min_ns,
+			res->median_ns, res->max_ns, res->mean_ns, res->mad_ns,
+			res->outlier_count);
+		if (mbps >= 0)
+			printf("%.1f,%.3f", mbps, mbps / 1000);
+		else
+			printf(",");
+		for (double v : res->counters) {
+			if (v >= 0)
+				printf(",%.3f", v);
+			else
+				printf(",");
+		}
+		for (double v : res->latency_ns) {
+			if (v >= 0)
+				printf(",%.0f", v);
+			else
+				printf(",");
+		}
+		if (has_latency)
+			printf(",%.0f", res->latency_max_ns);
+		else
+			printf(",");
+		printf("\n");
+		break;
+	case BENCH_FORMAT_JSON:
+		printf("{\"name\": ");
+		bench_print_json_str(c->name);
+		printf(", \"iterations\": %llu, \"runs\": %u, \"min_ns\": %.3f, "
+			"\"med_ns\": %.3f, \"max_ns\": %.3f, \"mean_ns\": %.3f, "
+			"\"mad_ns\": %.3f, \"outliers\": %u",
+			(unsigned long long)res->iteration_count, res->run_count, res->min_ns,
+			res->median_ns, res->max_ns, res->mean_ns, res->mad_ns,
+			res->outlier_count);
+		if (mbps >= 0)
+			printf(", \"mb_per_sec\": %.1f, \"gb_per_sec\": %.3f", mbps, mbps / 1000);
+		for (int i = 0; i < BENCH_COUNTER_COUNT; ++i) {
+			if (res->counters[i] >= 0)
+				printf(", \"%s\": %.3f", bench_counter_names[i], res->counters[i]);
+		}
+		if (has_latency) {
+			for (int i = 0; i < BENCH_PERCENTILE_COUNT; ++i) {
+				printf(", \"%s_ns\": %.0f", bench_percentile_names[i],
+					res->latency_ns[i]);
+			}
+			printf(", \"max_latency_ns\": %.0f", res->latency_max_ns);
+		}
+		printf("}\n");
+		break;
+	}
+	fflush(stdout);
+}
+
+void
+bench_run(struct bench *b, const struct bench_case *c, struct bench_result *res)
+{
+	struct bench_result local_res;
+	if (res == NULL)
+		res = &local_res;
+	memset(res, 0, sizeof(*res));
+	uint64_t count = c->iteration_count;
+	if (count == 0)
+		count = b->iteration_count;
+	if (count == 0)
+		count = bench_calibrate(b, c);
+	for (uint32_t i = 0; i < b->warmup_count; ++i)
+		bench_run_once(c, count);
+
+	if (c->hist != NULL)
+		bench_hist_reset(c->hist);
+	std::vector<double> times;
+	double counter_sums[BENCH_COUNTER_COUNT] = {};
+	for (uint32_t i = 0; i < b->run_count; ++i) {
+		bench_counters_start(b);
+		uint64_t ns = bench_run_once(c, count);
+		bench_counters_stop(b, counter_sums);
+		times.push_back((double)ns / count);
+	}
+	res->iteration_count = count;
+	res->run_count = b->run_count;
+	bench_stats(times, res);
+	for (int i = 0; i < BENCH_COUNTER_COUNT; ++i) {
+		res->counters[i] = b->counter_fds[i] >= 0 ?
+			counter_sums[i] / ((double)count * b->run_count) : -1;
+	}
+	for (int i = 0; i < BENCH_PERCENTILE_COUNT; ++i) {
+		res->latency_ns[i] = -1;
+		if (c->hist != NULL && c->hist->total > 0) {
+			res->latency_ns[i] =
+				bench_hist_percentile(c->hist, bench_percentile_shares[i]);
+		}
+	}
+	res->latency_max_ns = c->hist != NULL ? (double)c->hist->max : -1;
+	bench_print(b, c, res);
+}
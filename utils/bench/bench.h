@@ -0,0 +1,182 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Microbenchmark harness. A benchmark case is a function doing the tested operation
+ * the given number of times. The harness finds how many iterations make one run long
+ * enough, warms the case up, runs it several times, and prints the time per operation.
+ * The protocol is the one from bonus/task_eng.txt - min, median and max of the runs,
+ * measured with CLOCK_MONOTONIC.
+ *
+ * The common options are taken from the command line, see bench_init().
+ */
+
+enum bench_format {
+	/** Human readable, like in the bonus tasks description. */
+	BENCH_FORMAT_TEXT,
+	/** One line per case, with a header line first. */
+	BENCH_FORMAT_CSV,
+	/** One JSON object per line and per case. */
+	BENCH_FORMAT_JSON,
+};
+
+enum bench_counter {
+	BENCH_COUNTER_CYCLES,
+	BENCH_COUNTER_INSTRUCTIONS,
+	BENCH_COUNTER_CACHE_MISSES,
+	BENCH_COUNTER_BRANCH_MISSES,
+	BENCH_COUNTER_COUNT,
+};
+
+enum {
+	/**
+	 * Latency histogram buckets. The values below 16 have own buckets, and each next
+	 * power of 2 is split into 16 buckets. So the error is at most 1/16.
+	 */
+	BENCH_HIST_SUB_BUCKET_COUNT = 16,
+	BENCH_HIST_BUCKET_COUNT = 61 * BENCH_HIST_SUB_BUCKET_COUNT,
+};
+
+/** The latency percentiles reported for the cases with a histogram. */
+enum bench_percentile {
+	BENCH_PERCENTILE_50,
+	BENCH_PERCENTILE_90,
+	BENCH_PERCENTILE_99,
+	BENCH_PERCENTILE_999,
+	BENCH_PERCENTILE_COUNT,
+};
+
+/**
+ * Histogram of latencies in nanoseconds, for example of single calls inside the
+ * benchmark loop. Has fixed size, so it can be put into shared memory when the case
+ * uses more processes.
+ */
+struct bench_hist {
+	uint64_t counts[BENCH_HIST_BUCKET_COUNT];
+	uint64_t total;
+	uint64_t max;
+};
+
+struct bench {
+	/** Runs of each case whose times are used in the result. */
+	uint32_t run_count;
+	/** Runs of each case done before the measurements. */
+	uint32_t warmup_count;
+	/**
+	 * Iterations in each run. When 0, the count is calibrated so one run takes about
+	 * min_run_ns.
+	 */
+	uint64_t iteration_count;
+	uint64_t min_run_ns;
+	/** CPU to pin the main thread to. -1 means no pinning. */
+	int cpu;
+	enum bench_format format;
+	/** Collect the hardware counters, if the system allows. */
+	bool use_counters;
+	/** File descriptors of the hardware counters, -1 for the unavailable ones. */
+	int counter_fds[BENCH_COUNTER_COUNT];
+	bool is_header_printed;
+};
+
+/**
+ * A function doing the tested operation iteration_count times. If it starts threads,
+ * then it is up to the case whether the iterations are per thread or in total.
+ */
+typedef void (*bench_f)(uint64_t iteration_count, void *arg);
+
+struct bench_case {
+	const char *name;
+	bench_f func;
+	void *arg;
+	/** Bytes processed by one operation. If not 0, the throughput is reported too. */
+	uint64_t bytes_per_op;
+	/** Overrides bench.iteration_count if not 0. */
+	uint64_t iteration_count;
+	/**
+	 * If not NULL, the case adds latencies here. The harness clears it before the
+	 * measured runs and reports the percentiles.
+	 */
+	struct bench_hist *hist;
+};
+
+struct bench_result {
+	uint64_t iteration_count;
+	uint32_t run_count;
+	/** Time per operation in nanoseconds. */
+	double min_ns;
+	double median_ns;
+	double max_ns;
+	/**
+	 * Mean of the runs which are not outliers. An outlier is a run further from the
+	 * median than 3 median absolute deviations. Those are usually the runs hit by
+	 * something else on the machine.
+	 */
+	double mean_ns;
+	/**
+	 * Median absolute deviation, scaled like a standard deviation. A spread measure not
+	 * affected by the outliers.
+	 */
+	double mad_ns;
+	uint32_t outlier_count;
+	/** Hardware counters per operation. Negative when not available. */
+	double counters[BENCH_COUNTER_COUNT];
+	/** Latency percentiles from the case's histogram. Negative when it has none. */
+	double latency_ns[BENCH_PERCENTILE_COUNT];
+	double latency_max_ns;
+};
+
+/**
+ * Create the harness with the options from the command line. The unknown ones are
+ * ignored, they might be used by the benchmark itself:
+ *
+ * --runs <count> - measured runs of each case, 5 by default;
+ * --warmup <count> - runs before the measurements, 1 by default;
+ * --iterations <count> - iterations per run, calibrated by default;
+ * --min-time-ms <ms> - duration of one run for the calibration, 100 by default;
+ * --cpu <index> - pin the main thread to this CPU;
+ * --format text|csv|json - output format, text by default;
+ * --counters - collect the hardware counters via perf_event_open().
+ */
+void
+bench_init(struct bench *b, int argc, char **argv);
+
+void
+bench_destroy(struct bench *b);
+
+/** Run the case, print the result, and return it if res is not NULL. */
+void
+bench_run(struct bench *b, const struct bench_case *c, struct bench_result *res);
+
+/**
+ * Pin the calling thread to a CPU. With the pinning enabled, the thread with index 0 is
+ * placed on the main thread's CPU, and the next ones on the next CPUs. Without the
+ * pinning does nothing. Threads created after bench_init() inherit the main thread's
+ * CPU. So the benchmarks using more threads should call it in each of them.
+ */
+void
+bench_pin_thread(const struct bench *b, uint32_t thread_idx);
+
+/** Value of the given command line option, or the default one if there is none. */
+uint64_t
+bench_arg_uint(int argc, char **argv, const char *name, uint64_t def);
+
+const char *
+bench_arg_str(int argc, char **argv, const char *name, const char *def);
+
+void
+bench_hist_reset(struct bench_hist *h);
+
+void
+bench_hist_add(struct bench_hist *h, uint64_t ns);
+
+/** The value below which the given share of the values are, from 0 to 1. */
+uint64_t
+bench_hist_percentile(const struct bench_hist *h, double share);
+
+uint64_t
+bench_now_ns(void);
+
+/** Make the compiler think the value is used, so the computation is not dropped. */
+#define bench_do_not_optimize(value) __asm__ volatile("" : : "g"(value) : "memory")
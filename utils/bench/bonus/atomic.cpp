@@ -0,0 +1,94 @@
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Bonus task (5). Atomic stores with different memory orders, while N threads are
+// incrementing a shared counter until it reaches the iteration count. The increment is
+// always relaxed, only the store order changes.
+
+enum {
+	BENCH_ATOMIC_MAX_THREADS = 64,
+};
+
+struct bench_atomic {
+	const struct bench *b;
+	uint32_t thread_count;
+	bool is_seq_cst;
+	uint64_t target;
+	uint64_t counter;
+	uint64_t value;
+};
+
+struct bench_atomic_worker {
+	struct bench_atomic *ctx;
+	uint32_t idx;
+};
+
+template<int mem_order>
+static void
+bench_atomic_loop(struct bench_atomic *ctx)
+{
+	volatile uint64_t random_on_stack = (uintptr_t)&ctx;
+	while (__atomic_add_fetch(&ctx->counter, 1, __ATOMIC_RELAXED) < ctx->target)
+		__atomic_store_n(&ctx->value, random_on_stack, mem_order);
+}
+
+static void *
+bench_atomic_worker_f(void *arg)
+{
+	struct bench_atomic_worker *w = (struct bench_atomic_worker *)arg;
+	bench_pin_thread(w->ctx->b, w->idx);
+	if (w->ctx->is_seq_cst)
+		bench_atomic_loop<__ATOMIC_SEQ_CST>(w->ctx);
+	else
+		bench_atomic_loop<__ATOMIC_RELAXED>(w->ctx);
+	return NULL;
+}
+
+static void
+bench_atomic_f(uint64_t count, void *arg)
+{
+	struct bench_atomic *ctx = (struct bench_atomic *)arg;
+	pthread_t tids[BENCH_ATOMIC_MAX_THREADS];
+	struct bench_atomic_worker workers[BENCH_ATOMIC_MAX_THREADS];
+	ctx->counter = 0;
+	ctx->target = count;
+	for (uint32_t i = 0; i < ctx->thread_count; ++i) {
+		workers[i].ctx = ctx;
+		workers[i].idx = i;
+		if (pthread_create(&tids[i], NULL, bench_atomic_worker_f, &workers[i]) != 0)
+			abort();
+	}
+	for (uint32_t i = 0; i < ctx->thread_count; ++i)
+		pthread_join(tids[i], NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench b;
+	bench_init(&b, argc, argv);
+	uint64_t max_threads = bench_arg_uint(argc, argv, "--max-threads", 3);
+	if (max_threads > BENCH_ATOMIC_MAX_THREADS)
+		max_threads = BENCH_ATOMIC_MAX_THREADS;
+	for (uint32_t thread_count = 1; thread_count <= max_threads; ++thread_count) {
+		for (int is_seq_cst = 0; is_seq_cst <= 1; ++is_seq_cst) {
+			struct bench_atomic ctx = {};
+			ctx.b = &b;
+			ctx.thread_count = thread_count;
+			ctx.is_seq_cst = is_seq_cst;
+			char name[128];
+			snprintf(name, sizeof(name), "atomic store %s, %u threads",
+				is_seq_cst ? "seq_cst" : "relaxed", thread_count);
+			struct bench_case c = {};
+			c.name = name;
+			c.func = bench_atomic_f;
+			c.arg = &ctx;
+			bench_run(&b, &c, NULL);
+		}
+	}
+	bench_destroy(&b);
+	return 0;
+}
@@ -0,0 +1,42 @@
+#include "bench.h"
+
+#include <time.h>
+
+// Bonus task (1). Cost of one clock_gettime() call with different clocks.
+
+static void
+bench_clock_f(uint64_t count, void *arg)
+{
+	clockid_t id = *(const clockid_t *)arg;
+	struct timespec ts;
+	for (uint64_t i = 0; i < count; ++i) {
+		clock_gettime(id, &ts);
+		bench_do_not_optimize(ts.tv_nsec);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench b;
+	bench_init(&b, argc, argv);
+	static const struct {
+		const char *name;
+		clockid_t id;
+	} clocks[] = {
+		{"clock_gettime(CLOCK_REALTIME)", CLOCK_REALTIME},
+		{"clock_gettime(CLOCK_MONOTONIC)", CLOCK_MONOTONIC},
+		{"clock_gettime(CLOCK_MONOTONIC_RAW)", CLOCK_MONOTONIC_RAW},
+		{"clock_gettime(CLOCK_REALTIME_COARSE)", CLOCK_REALTIME_COARSE},
+		{"clock_gettime(CLOCK_MONOTONIC_COARSE)", CLOCK_MONOTONIC_COARSE},
+	};
+	for (const auto &clk : clocks) {
+		struct bench_case c = {};
+		c.name = clk.name;
+		c.func = bench_clock_f;
+		c.arg = (void *)&clk.id;
+		bench_run(&b, &c, NULL);
+	}
+	bench_destroy(&b);
+	return 0;
+}
@@ -0,0 +1,108 @@
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Bonus task (6). Cost of one pthread_cond_signal() or pthread_cond_broadcast() call,
+// made under the mutex, while N threads are waiting on the condition variable.
+
+enum {
+	BENCH_COND_MAX_THREADS = 64,
+};
+
+struct bench_cond {
+	const struct bench *b;
+	uint32_t thread_count;
+	bool is_broadcast;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	uint64_t seq;
+	bool is_stopped;
+};
+
+struct bench_cond_worker {
+	struct bench_cond *ctx;
+	uint32_t idx;
+};
+
+static void *
+bench_cond_worker_f(void *arg)
+{
+	struct bench_cond_worker *w = (struct bench_cond_worker *)arg;
+	struct bench_cond *ctx = w->ctx;
+	// The index 0 is the signaling thread.
+	bench_pin_thread(ctx->b, w->idx + 1);
+	pthread_mutex_lock(&ctx->mutex);
+	uint64_t seen = ctx->seq;
+	while (!ctx->is_stopped) {
+		while (!ctx->is_stopped && ctx->seq == seen)
+			pthread_cond_wait(&ctx->cond, &ctx->mutex);
+		seen = ctx->seq;
+	}
+	pthread_mutex_unlock(&ctx->mutex);
+	return NULL;
+}
+
+static void
+bench_cond_f(uint64_t count, void *arg)
+{
+	struct bench_cond *ctx = (struct bench_cond *)arg;
+	pthread_t tids[BENCH_COND_MAX_THREADS];
+	struct bench_cond_worker workers[BENCH_COND_MAX_THREADS];
+	ctx->seq = 0;
+	ctx->is_stopped = false;
+	for (uint32_t i = 0; i < ctx->thread_count; ++i) {
+		workers[i].ctx = ctx;
+		workers[i].idx = i;
+		if (pthread_create(&tids[i], NULL, bench_cond_worker_f, &workers[i]) != 0)
+			abort();
+	}
+	for (uint64_t i = 0; i < count; ++i) {
+		pthread_mutex_lock(&ctx->mutex);
+		++ctx->seq;
+		if (ctx->is_broadcast)
+			pthread_cond_broadcast(&ctx->cond);
+		else
+			pthread_cond_signal(&ctx->cond);
+		pthread_mutex_unlock(&ctx->mutex);
+	}
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->is_stopped = true;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->mutex);
+	for (uint32_t i = 0; i < ctx->thread_count; ++i)
+		pthread_join(tids[i], NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench b;
+	bench_init(&b, argc, argv);
+	uint64_t max_threads = bench_arg_uint(argc, argv, "--max-threads", 3);
+	if (max_threads > BENCH_COND_MAX_THREADS)
+		max_threads = BENCH_COND_MAX_THREADS;
+	for (uint32_t thread_count = 1; thread_count <= max_threads; thread_count += 2) {
+		for (int is_broadcast = 0; is_broadcast <= 1; ++is_broadcast) {
+			struct bench_cond ctx;
+			ctx.b = &b;
+			ctx.thread_count = thread_count;
+			ctx.is_broadcast = is_broadcast;
+			pthread_mutex_init(&ctx.mutex, NULL);
+			pthread_cond_init(&ctx.cond, NULL);
+			char name[128];
+			snprintf(name, sizeof(name), "pthread_cond_%s, %u waiting threads",
+				is_broadcast ? "broadcast" : "signal", thread_count);
+			struct bench_case c = {};
+			c.name = name;
+			c.func = bench_cond_f;
+			c.arg = &ctx;
+			bench_run(&b, &c, NULL);
+			pthread_cond_destroy(&ctx.cond);
+			pthread_mutex_destroy(&ctx.mutex);
+		}
+	}
+	bench_destroy(&b);
+	return 0;
+}
@@ -0,0 +1,91 @@
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Bonus task (7). N threads increment each its own number. When the numbers are close,
+// they share a cache line, and the threads slow each other down even though they never
+// touch the same data. The iterations are per thread, each increments its number that
+// many times.
+
+enum {
+	BENCH_FS_MAX_THREADS = 64,
+	// Distance between the numbers in the distant mode. 8 * 8 bytes is a cache line.
+	BENCH_FS_DISTANT_STRIDE = 8,
+};
+
+struct bench_fs {
+	const struct bench *b;
+	uint32_t thread_count;
+	uint32_t stride;
+	uint64_t target;
+	alignas(64) uint64_t numbers[BENCH_FS_MAX_THREADS * BENCH_FS_DISTANT_STRIDE];
+};
+
+struct bench_fs_worker {
+	struct bench_fs *ctx;
+	uint32_t idx;
+};
+
+static void *
+bench_fs_worker_f(void *arg)
+{
+	struct bench_fs_worker *w = (struct bench_fs_worker *)arg;
+	struct bench_fs *ctx = w->ctx;
+	bench_pin_thread(ctx->b, w->idx);
+	volatile uint64_t *number = &ctx->numbers[w->idx * ctx->stride];
+	*number = 0;
+	// Volatile doesn't let the compiler turn the loop into a single addition.
+	for (volatile uint64_t i = 0; i < ctx->target; i = i + 1)
+		*number = *number + 1;
+	return NULL;
+}
+
+static void
+bench_fs_f(uint64_t count, void *arg)
+{
+	struct bench_fs *ctx = (struct bench_fs *)arg;
+	pthread_t tids[BENCH_FS_MAX_THREADS];
+	struct bench_fs_worker workers[BENCH_FS_MAX_THREADS];
+	ctx->target = count;
+	for (uint32_t i = 0; i < ctx->thread_count; ++i) {
+		workers[i].ctx = ctx;
+		workers[i].idx = i;
+		if (pthread_create(&tids[i], NULL, bench_fs_worker_f, &workers[i]) != 0)
+			abort();
+	}
+	for (uint32_t i = 0; i < ctx->thread_count; ++i)
+		pthread_join(tids[i], NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench b;
+	bench_init(&b, argc, argv);
+	uint64_t max_threads = bench_arg_uint(argc, argv, "--max-threads", 3);
+	if (max_threads > BENCH_FS_MAX_THREADS)
+		max_threads = BENCH_FS_MAX_THREADS;
+	static struct bench_fs ctx;
+	for (uint32_t thread_count = 1; thread_count <= max_threads; ++thread_count) {
+		for (int is_distant = 0; is_distant <= 1; ++is_distant) {
+			// With one thread there is nothing to share.
+			if (thread_count == 1 && is_distant)
+				continue;
+			ctx.b = &b;
+			ctx.thread_count = thread_count;
+			ctx.stride = is_distant ? BENCH_FS_DISTANT_STRIDE : 1;
+			char name[128];
+			snprintf(name, sizeof(name), "increment, %u threads, %s numbers",
+				thread_count, is_distant ? "distant" : "close");
+			struct bench_case c = {};
+			c.name = name;
+			c.func = bench_fs_f;
+			c.arg = &ctx;
+			bench_run(&b, &c, NULL);
+		}
+	}
+	bench_destroy(&b);
+	return 0;
+}
@@ -0,0 +1,89 @@
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Bonus task (3). Cost of one pthread_mutex_lock() + unlock() pair when N threads are
+// doing them all the time. The iterations are the total lock count of all the threads.
+
+enum {
+	BENCH_MUTEX_MAX_THREADS = 64,
+};
+
+struct bench_mutex {
+	const struct bench *b;
+	uint32_t thread_count;
+	pthread_mutex_t mutex;
+	uint64_t counter;
+};
+
+struct bench_mutex_worker {
+	struct bench_mutex *ctx;
+	uint32_t idx;
+	uint64_t lock_count;
+};
+
+static void *
+bench_mutex_worker_f(void *arg)
+{
+	struct bench_mutex_worker *w = (struct bench_mutex_worker *)arg;
+	struct bench_mutex *ctx = w->ctx;
+	bench_pin_thread(ctx->b, w->idx);
+	for (uint64_t i = 0; i < w->lock_count; ++i) {
+		pthread_mutex_lock(&ctx->mutex);
+		++ctx->counter;
+		pthread_mutex_unlock(&ctx->mutex);
+	}
+	return NULL;
+}
+
+static void
+bench_mutex_f(uint64_t count, void *arg)
+{
+	struct bench_mutex *ctx = (struct bench_mutex *)arg;
+	pthread_t tids[BENCH_MUTEX_MAX_THREADS];
+	struct bench_mutex_worker workers[BENCH_MUTEX_MAX_THREADS];
+	ctx->counter = 0;
+	for (uint32_t i = 0; i < ctx->thread_count; ++i) {
+		struct bench_mutex_worker *w = &workers[i];
+		w->ctx = ctx;
+		w->idx = i;
+		// The remainder goes to the first thread.
+		w->lock_count = count / ctx->thread_count;
+		if (i == 0)
+			w->lock_count += count % ctx->thread_count;
+		if (pthread_create(&tids[i], NULL, bench_mutex_worker_f, w) != 0)
+			abort();
+	}
+	for (uint32_t i = 0; i < ctx->thread_count; ++i)
+		pthread_join(tids[i], NULL);
+	if (ctx->counter != count)
+		abort();
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench b;
+	bench_init(&b, argc, argv);
+	uint64_t max_threads = bench_arg_uint(argc, argv, "--max-threads", 3);
+	if (max_threads > BENCH_MUTEX_MAX_THREADS)
+		max_threads = BENCH_MUTEX_MAX_THREADS;
+	for (uint32_t thread_count = 1; thread_count <= max_threads; ++thread_count) {
+		struct bench_mutex ctx;
+		ctx.b = &b;
+		ctx.thread_count = thread_count;
+		pthread_mutex_init(&ctx.mutex, NULL);
+		char name[128];
+		snprintf(name, sizeof(name), "mutex lock + unlock, %u threads", thread_count);
+		struct bench_case c = {};
+		c.name = name;
+		c.func = bench_mutex_f;
+		c.arg = &ctx;
+		bench_run(&b, &c, NULL);
+		pthread_mutex_destroy(&ctx.mutex);
+	}
+	bench_destroy(&b);
+	return 0;
+}
@@ -0,0 +1,197 @@
+#include "bench.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Bonus task (2). Throughput of a UNIX and a TCP socket pair. One thread sends the data
+// in packs of the given size, another receives it with a buffer of the same size. One
+// iteration is one pack.
+
+struct bench_socket {
+	const struct bench *b;
+	int fd_send;
+	int fd_recv;
+	uint64_t pack_size;
+	uint64_t total_size;
+	char *send_buf;
+	char *recv_buf;
+};
+
+static void
+bench_socket_check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+	printf("# %s failed: %s\n", what, strerror(errno));
+	exit(-1);
+}
+
+static void
+bench_socket_set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	bench_socket_check(flags >= 0, "fcntl");
+	bench_socket_check(fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0, "fcntl");
+}
+
+static void
+bench_socket_wait(int fd, short events)
+{
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	int rc = poll(&pfd, 1, -1);
+	bench_socket_check(rc >= 0 || errno == EINTR, "poll");
+}
+
+// Server via socket() + bind() + listen(), the client via connect(), and the accepted
+// socket is the other end.
+static void
+bench_socket_pair(int family, int *fd_client, int *fd_server)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	memset(&addr, 0, sizeof(addr));
+	if (family == AF_UNIX) {
+		struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+		un->sun_family = AF_UNIX;
+		snprintf(un->sun_path, sizeof(un->sun_path), "/tmp/bench_socket_%d.sock",
+			(int)getpid());
+		unlink(un->sun_path);
+		addr_len = sizeof(*un);
+	} else {
+		struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+		in->sin_family = AF_INET;
+		in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		in->sin_port = 0;
+		addr_len = sizeof(*in);
+	}
+	int fd_listen = socket(family, SOCK_STREAM, 0);
+	bench_socket_check(fd_listen >= 0, "socket");
+	bench_socket_check(bind(fd_listen, (struct sockaddr *)&addr, addr_len) == 0,
+		"bind");
+	bench_socket_check(listen(fd_listen, 1) == 0, "listen");
+	// The TCP port is chosen by the kernel.
+	bench_socket_check(getsockname(fd_listen, (struct sockaddr *)&addr,
+		&addr_len) == 0, "getsockname");
+	*fd_client = socket(family, SOCK_STREAM, 0);
+	bench_socket_check(*fd_client >= 0, "socket");
+	bench_socket_check(connect(*fd_client, (struct sockaddr *)&addr, addr_len) == 0,
+		"connect");
+	*fd_server = accept(fd_listen, NULL, NULL);
+	bench_socket_check(*fd_server >= 0, "accept");
+	close(fd_listen);
+	if (family == AF_UNIX)
+		unlink(((struct sockaddr_un *)&addr)->sun_path);
+	bench_socket_set_nonblock(*fd_client);
+	bench_socket_set_nonblock(*fd_server);
+	if (family == AF_INET) {
+		// Otherwise the last small pack of a run can wait for the delayed ACK for tens
+		// of milliseconds. With the short calibration runs it would be all the time.
+		int flag = 1;
+		bench_socket_check(setsockopt(*fd_client, IPPROTO_TCP, TCP_NODELAY, &flag,
+			sizeof(flag)) == 0, "setsockopt");
+	}
+}
+
+static void *
+bench_socket_sender_f(void *arg)
+{
+	struct bench_socket *ctx = (struct bench_socket *)arg;
+	bench_pin_thread(ctx->b, 1);
+	uint64_t sent = 0;
+	while (sent < ctx->total_size) {
+		uint64_t size = ctx->total_size - sent;
+		if (size > ctx->pack_size)
+			size = ctx->pack_size;
+		ssize_t rc = send(ctx->fd_send, ctx->send_buf, size, MSG_NOSIGNAL);
+		if (rc > 0) {
+			// Might send less than asked. The rest goes in the next call.
+			sent += rc;
+			continue;
+		}
+		bench_socket_check(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+			errno == EINTR), "send");
+		bench_socket_wait(ctx->fd_send, POLLOUT);
+	}
+	return NULL;
+}
+
+static void
+bench_socket_f(uint64_t count, void *arg)
+{
+	struct bench_socket *ctx = (struct bench_socket *)arg;
+	ctx->total_size = count * ctx->pack_size;
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, bench_socket_sender_f, ctx) != 0)
+		abort();
+	uint64_t received = 0;
+	while (received < ctx->total_size) {
+		ssize_t rc = recv(ctx->fd_recv, ctx->recv_buf, ctx->pack_size, 0);
+		if (rc > 0) {
+			received += rc;
+			continue;
+		}
+		bench_socket_check(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+			errno == EINTR), "recv");
+		bench_socket_wait(ctx->fd_recv, POLLIN);
+	}
+	pthread_join(tid, NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench b;
+	bench_init(&b, argc, argv);
+	static const uint64_t pack_sizes[] = {16 * 1024, 1024, 48 * 1024, 512};
+	uint64_t pack_size_arg = bench_arg_uint(argc, argv, "--pack-size", 0);
+	static const struct {
+		const char *name;
+		int family;
+	} families[] = {
+		{"unix", AF_UNIX},
+		{"tcp", AF_INET},
+	};
+	for (const auto &family : families) {
+		struct bench_socket ctx;
+		ctx.b = &b;
+		bench_socket_pair(family.family, &ctx.fd_send, &ctx.fd_recv);
+		for (uint64_t pack_size : pack_sizes) {
+			if (pack_size_arg != 0)
+				pack_size = pack_size_arg;
+			ctx.pack_size = pack_size;
+			ctx.send_buf = (char *)calloc(1, pack_size);
+			ctx.recv_buf = (char *)calloc(1, pack_size);
+			char name[128];
+			snprintf(name, sizeof(name), "%s socket, %llu byte packs", family.name,
+				(unsigned long long)pack_size);
+			struct bench_case c = {};
+			c.name = name;
+			c.func = bench_socket_f;
+			c.arg = &ctx;
+			c.bytes_per_op = pack_size;
+			bench_run(&b, &c, NULL);
+			free(ctx.send_buf);
+			free(ctx.recv_buf);
+			if (pack_size_arg != 0)
+				break;
+		}
+		close(ctx.fd_send);
+		close(ctx.fd_recv);
+	}
+	bench_destroy(&b);
+	return 0;
+}
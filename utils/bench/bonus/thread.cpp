@@ -0,0 +1,36 @@
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+// Bonus task (4). Cost of one pthread_create() + pthread_join() of an empty thread.
+
+static void *
+bench_thread_worker_f(void *arg)
+{
+	return arg;
+}
+
+static void
+bench_thread_f(uint64_t count, void *)
+{
+	for (uint64_t i = 0; i < count; ++i) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, bench_thread_worker_f, NULL) != 0)
+			abort();
+		pthread_join(tid, NULL);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench b;
+	bench_init(&b, argc, argv);
+	struct bench_case c = {};
+	c.name = "pthread_create + pthread_join";
+	c.func = bench_thread_f;
+	bench_run(&b, &c, NULL);
+	bench_destroy(&b);
+	return 0;
+}
@@ -0,0 +1,313 @@
+#include "bench.h"
+#include "ihash.h"
+#include "iheap.h"
+
+#include <functional>
+#include <queue>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unordered_map>
+#include <vector>
+
+// The intrusive containers from utils/ihash.h and utils/iheap.h against the standard
+// ones. The objects are stored by pointer in all of them, so the standard containers
+// are used the same way as the intrusive ones would be.
+
+struct bench_obj {
+	uint64_t key;
+	struct ihash_link in_hash;
+	struct iheap_link in_heap;
+};
+
+static inline uint64_t
+bench_rand(uint64_t *state)
+{
+	// xorshift64*.
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+struct bench_containers {
+	uint32_t count;
+	std::vector<bench_obj> objs;
+	/** Keys which are not stored, for the missing lookups. */
+	std::vector<uint64_t> missing_keys;
+	/** Random order of the objects to access. */
+	std::vector<uint32_t> order;
+	uint32_t cursor;
+	uint64_t rand_state;
+	struct ihash hash;
+	std::unordered_map<uint64_t, bench_obj *> map;
+	struct iheap heap;
+	std::priority_queue<std::pair<uint64_t, bench_obj *>,
+		std::vector<std::pair<uint64_t, bench_obj *>>,
+		std::greater<std::pair<uint64_t, bench_obj *>>> queue;
+};
+
+static inline uint32_t
+bench_containers_next(struct bench_containers *ctx)
+{
+	uint32_t idx = ctx->order[ctx->cursor];
+	if (++ctx->cursor == ctx->count)
+		ctx->cursor = 0;
+	return idx;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Hash table.
+
+static bool
+bench_ihash_is_equal(const struct ihash_link *link, const void *key)
+{
+	return ihash_entry(link, struct bench_obj, in_hash)->key == *(const uint64_t *)key;
+}
+
+static void
+bench_ihash_fill(struct bench_containers *ctx)
+{
+	ihash_create(&ctx->hash);
+	for (bench_obj &o : ctx->objs) {
+		if (ihash_insert(&ctx->hash, &o.in_hash, ihash_u64(o.key)) != 0)
+			abort();
+	}
+}
+
+static void
+bench_ihash_find_f(uint64_t count, void *arg)
+{
+	struct bench_containers *ctx = (struct bench_containers *)arg;
+	for (uint64_t i = 0; i < count; ++i) {
+		uint64_t key = ctx->objs[bench_containers_next(ctx)].key;
+		struct ihash_link *link = ihash_find(&ctx->hash, ihash_u64(key), &key,
+			bench_ihash_is_equal);
+		bench_do_not_optimize(link);
+	}
+}
+
+static void
+bench_ihash_find_missing_f(uint64_t count, void *arg)
+{
+	struct bench_containers *ctx = (struct bench_containers *)arg;
+	for (uint64_t i = 0; i < count; ++i) {
+		uint64_t key = ctx->missing_keys[bench_containers_next(ctx)];
+		struct ihash_link *link = ihash_find(&ctx->hash, ihash_u64(key), &key,
+			bench_ihash_is_equal);
+		bench_do_not_optimize(link);
+	}
+}
+
+static void
+bench_ihash_replace_f(uint64_t count, void *arg)
+{
+	struct bench_containers *ctx = (struct bench_containers *)arg;
+	for (uint64_t i = 0; i < count; ++i) {
+		struct bench_obj *o = &ctx->objs[bench_containers_next(ctx)];
+		ihash_delete(&ctx->hash, &o->in_hash);
+		o->key = bench_rand(&ctx->rand_state);
+		if (ihash_insert(&ctx->hash, &o->in_hash, ihash_u64(o->key)) != 0)
+			abort();
+	}
+}
+
+static void
+bench_map_fill(struct bench_containers *ctx)
+{
+	ctx->map.clear();
+	for (bench_obj &o : ctx->objs)
+		ctx->map.emplace(o.key, &o);
+}
+
+static void
+bench_map_find_f(uint64_t count, void *arg)
+{
+	struct bench_containers *ctx = (struct bench_containers *)arg;
+	for (uint64_t i = 0; i < count; ++i) {
+		uint64_t key = ctx->objs[bench_containers_next(ctx)].key;
+		bench_do_not_optimize(ctx->map.find(key));
+	}
+}
+
+static void
+bench_map_find_missing_f(uint64_t count, void *arg)
+{
+	struct bench_containers *ctx = (struct bench_containers *)arg;
+	for (uint64_t i = 0; i < count; ++i) {
+		uint64_t key = ctx->missing_keys[bench_containers_next(ctx)];
+		bench_do_not_optimize(ctx->map.find(key));
+	}
+}
+
+static void
+bench_map_replace_f(uint64_t count, void *arg)
+{
+	struct bench_containers *ctx = (struct bench_containers *)arg;
+	for (uint64_t i = 0; i < count; ++i) {
+		struct bench_obj *o = &ctx->objs[bench_containers_next(ctx)];
+		ctx->map.erase(o->key);
+		o->key = bench_rand(&ctx->rand_state);
+		ctx->map.emplace(o->key, o);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Heap. The keys are like timer deadlines - a popped object is pushed back with a
+// later key.
+
+enum {
+	BENCH_HEAP_MAX_DELAY = 1 << 20,
+};
+
+static void
+bench_iheap_fill(struct bench_containers *ctx)
+{
+	iheap_create(&ctx->heap);
+	for (bench_obj &o : ctx->objs) {
+		o.key = bench_rand(&ctx->rand_state) % BENCH_HEAP_MAX_DELAY;
+		iheap_link_create(&o.in_heap);
+		if (iheap_insert(&ctx->heap, &o.in_heap, o.key) != 0)
+			abort();
+	}
+}
+
+static void
+bench_iheap_pop_push_f(uint64_t count, void *arg)
+{
+	struct bench_containers *ctx = (struct bench_containers *)arg;
+	for (uint64_t i = 0; i < count; ++i) {
+		struct iheap_link *link = iheap_pop(&ctx->heap);
+		struct bench_obj *o = iheap_entry(link, struct bench_obj, in_heap);
+		o->key += 1 + bench_rand(&ctx->rand_state) % BENCH_HEAP_MAX_DELAY;
+		if (iheap_insert(&ctx->heap, link, o->key) != 0)
+			abort();
+	}
+}
+
+static void
+bench_iheap_delete_push_f(uint64_t count, void *arg)
+{
+	struct bench_containers *ctx = (struct bench_containers *)arg;
+	for (uint64_t i = 0; i < count; ++i) {
+		struct bench_obj *o = &ctx->objs[bench_containers_next(ctx)];
+		iheap_delete(&ctx->heap, &o->in_heap);
+		o->key += 1 + bench_rand(&ctx->rand_state) % BENCH_HEAP_MAX_DELAY;
+		if (iheap_insert(&ctx->heap, &o->in_heap, o->key) != 0)
+			abort();
+	}
+}
+
+static void
+bench_iheap_update_f(uint64_t count, void *arg)
+{
+	struct bench_containers *ctx = (struct bench_containers *)arg;
+	for (uint64_t i = 0; i < count; ++i) {
+		struct bench_obj *o = &ctx->objs[bench_containers_next(ctx)];
+		o->key += 1 + bench_rand(&ctx->rand_state) % BENCH_HEAP_MAX_DELAY;
+		iheap_update(&ctx->heap, &o->in_heap, o->key);
+	}
+}
+
+static void
+bench_queue_fill(struct bench_containers *ctx)
+{
+	ctx->queue = {};
+	for (bench_obj &o : ctx->objs) {
+		o.key = bench_rand(&ctx->rand_state) % BENCH_HEAP_MAX_DELAY;
+		ctx->queue.emplace(o.key, &o);
+	}
+}
+
+static void
+bench_queue_pop_push_f(uint64_t count, void *arg)
+{
+	struct bench_containers *ctx = (struct bench_containers *)arg;
+	for (uint64_t i = 0; i < count; ++i) {
+		struct bench_obj *o = ctx->queue.top().second;
+		ctx->queue.pop();
+		o->key += 1 + bench_rand(&ctx->rand_state) % BENCH_HEAP_MAX_DELAY;
+		ctx->queue.emplace(o->key, o);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+bench_containers_run(struct bench *b, struct bench_containers *ctx, const char *name,
+		     bench_f func)
+{
+	char full_name[128];
+	snprintf(full_name, sizeof(full_name), "%s, %u objects", name, ctx->count);
+	struct bench_case c = {};
+	c.name = full_name;
+	c.func = func;
+	c.arg = ctx;
+	bench_run(b, &c, NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench b;
+	bench_init(&b, argc, argv);
+	uint64_t count_arg = bench_arg_uint(argc, argv, "--count", 0);
+	static const uint64_t default_counts[] = {1000, 100 * 1000, 1000 * 1000};
+	const uint64_t *counts = default_counts;
+	uint32_t count_count = sizeof(default_counts) / sizeof(default_counts[0]);
+	if (count_arg != 0) {
+		counts = &count_arg;
+		count_count = 1;
+	}
+	for (uint32_t count_i = 0; count_i < count_count; ++count_i) {
+		struct bench_containers ctx;
+		ctx.count = counts[count_i];
+		ctx.cursor = 0;
+		ctx.rand_state = 0x9e3779b97f4a7c15ULL;
+		ctx.objs.resize(ctx.count);
+		ctx.missing_keys.resize(ctx.count);
+		ctx.order.resize(ctx.count);
+		for (uint32_t i = 0; i < ctx.count; ++i) {
+			// The odd keys are stored, the even ones are missing.
+			ctx.objs[i].key = bench_rand(&ctx.rand_state) | 1;
+			ctx.missing_keys[i] = bench_rand(&ctx.rand_state) & ~1ULL;
+			ctx.order[i] = i;
+		}
+		for (uint32_t i = ctx.count - 1; i > 0; --i) {
+			uint32_t j = bench_rand(&ctx.rand_state) % (i + 1);
+			uint32_t tmp = ctx.order[i];
+			ctx.order[i] = ctx.order[j];
+			ctx.order[j] = tmp;
+		}
+
+		bench_ihash_fill(&ctx);
+		bench_containers_run(&b, &ctx, "ihash find", bench_ihash_find_f);
+		bench_containers_run(&b, &ctx, "ihash find missing",
+			bench_ihash_find_missing_f);
+		bench_containers_run(&b, &ctx, "ihash delete + insert", bench_ihash_replace_f);
+		ihash_destroy(&ctx.hash);
+
+		bench_map_fill(&ctx);
+		bench_containers_run(&b, &ctx, "std::unordered_map find", bench_map_find_f);
+		bench_containers_run(&b, &ctx, "std::unordered_map find missing",
+			bench_map_find_missing_f);
+		bench_containers_run(&b, &ctx, "std::unordered_map erase + emplace",
+			bench_map_replace_f);
+		ctx.map.clear();
+
+		bench_iheap_fill(&ctx);
+		bench_containers_run(&b, &ctx, "iheap pop + insert", bench_iheap_pop_push_f);
+		bench_containers_run(&b, &ctx, "iheap delete any + insert",
+			bench_iheap_delete_push_f);
+		bench_containers_run(&b, &ctx, "iheap update any", bench_iheap_update_f);
+		iheap_destroy(&ctx.heap);
+
+		bench_queue_fill(&ctx);
+		bench_containers_run(&b, &ctx, "std::priority_queue pop + push",
+			bench_queue_pop_push_f);
+		ctx.queue = {};
+	}
+	bench_destroy(&b);
+	return 0;
+}
@@ -0,0 +1,481 @@
+#include "bench.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Throughput of the local transports. One side sends the data in packs of the given
+// size, the other receives it. The sender times each its call, and those are reported
+// as the latency percentiles. One iteration is one pack, and one run transfers the
+// whole --size.
+
+enum {
+	BENCH_TRANSPORT_DEFAULT_SIZE = 256 * 1024 * 1024,
+	// Packs given to one sendmmsg() call, and messages taken by one recvmmsg().
+	BENCH_TRANSPORT_MMSG_BATCH = 16,
+	// The message transports can't send messages bigger than the socket buffer.
+	BENCH_TRANSPORT_MAX_MSG_SIZE = 64 * 1024,
+	BENCH_TRANSPORT_PIPE_SIZE = 1024 * 1024,
+};
+
+enum bench_transport_kind {
+	BENCH_TRANSPORT_UNIX_STREAM,
+	BENCH_TRANSPORT_UNIX_SEQPACKET,
+	BENCH_TRANSPORT_TCP,
+	BENCH_TRANSPORT_SOCKETPAIR,
+	BENCH_TRANSPORT_PIPE,
+	// vmsplice() of the user memory into a pipe, then splice() from the pipe into a
+	// TCP socket. The data is not copied on the sending side.
+	BENCH_TRANSPORT_SPLICE,
+	// TCP with MSG_ZEROCOPY. On loopback the kernel still copies the data to the
+	// receiver, but the sender does not.
+	BENCH_TRANSPORT_ZEROCOPY,
+	// UNIX seqpacket, many messages per one sendmmsg() and recvmmsg() call.
+	BENCH_TRANSPORT_SENDMMSG,
+};
+
+static const struct {
+	const char *name;
+	enum bench_transport_kind kind;
+	bool is_msg;
+} bench_transports[] = {
+	{"unix_stream", BENCH_TRANSPORT_UNIX_STREAM, false},
+	{"unix_seqpacket", BENCH_TRANSPORT_UNIX_SEQPACKET, true},
+	{"tcp", BENCH_TRANSPORT_TCP, false},
+	{"socketpair", BENCH_TRANSPORT_SOCKETPAIR, false},
+	{"pipe", BENCH_TRANSPORT_PIPE, false},
+	{"splice", BENCH_TRANSPORT_SPLICE, false},
+	{"zerocopy", BENCH_TRANSPORT_ZEROCOPY, false},
+	{"sendmmsg", BENCH_TRANSPORT_SENDMMSG, true},
+};
+
+struct bench_transport {
+	const struct bench *b;
+	enum bench_transport_kind kind;
+	bool is_process;
+	int fd_send;
+	int fd_recv;
+	// The pipe between vmsplice() and splice() in the splice mode.
+	int pipe_fds[2];
+	uint64_t pack_size;
+	uint64_t pack_count;
+	char *send_buf;
+	char *recv_buf;
+	// In shared memory, so the sender process can fill it.
+	struct bench_hist *hist;
+};
+
+static void
+bench_transport_check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+	printf("# %s failed: %s\n", what, strerror(errno));
+	exit(-1);
+}
+
+static void
+bench_transport_listen_pair(int family, int type, int *fd_client, int *fd_server)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	memset(&addr, 0, sizeof(addr));
+	if (family == AF_UNIX) {
+		struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+		un->sun_family = AF_UNIX;
+		snprintf(un->sun_path, sizeof(un->sun_path), "/tmp/bench_transport_%d.sock",
+			(int)getpid());
+		unlink(un->sun_path);
+		addr_len = sizeof(*un);
+	} else {
+		struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+		in->sin_family = AF_INET;
+		in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr_len = sizeof(*in);
+	}
+	int fd_listen = socket(family, type, 0);
+	bench_transport_check(fd_listen >= 0, "socket");
+	bench_transport_check(bind(fd_listen, (struct sockaddr *)&addr, addr_len) == 0,
+		"bind");
+	bench_transport_check(listen(fd_listen, 1) == 0, "listen");
+	bench_transport_check(getsockname(fd_listen, (struct sockaddr *)&addr,
+		&addr_len) == 0, "getsockname");
+	*fd_client = socket(family, type, 0);
+	bench_transport_check(*fd_client >= 0, "socket");
+	bench_transport_check(connect(*fd_client, (struct sockaddr *)&addr,
+		addr_len) == 0, "connect");
+	*fd_server = accept(fd_listen, NULL, NULL);
+	bench_transport_check(*fd_server >= 0, "accept");
+	close(fd_listen);
+	if (family == AF_UNIX)
+		unlink(((struct sockaddr_un *)&addr)->sun_path);
+	if (family == AF_INET) {
+		// The last small pack of a run must not wait for the delayed ACK.
+		int flag = 1;
+		bench_transport_check(setsockopt(*fd_client, IPPROTO_TCP, TCP_NODELAY,
+			&flag, sizeof(flag)) == 0, "setsockopt");
+	}
+}
+
+// Returns false if the transport is not supported by the system.
+static bool
+bench_transport_open(struct bench_transport *ctx)
+{
+	ctx->pipe_fds[0] = -1;
+	ctx->pipe_fds[1] = -1;
+	int fds[2];
+	switch (ctx->kind) {
+	case BENCH_TRANSPORT_UNIX_STREAM:
+		bench_transport_listen_pair(AF_UNIX, SOCK_STREAM, &ctx->fd_send,
+			&ctx->fd_recv);
+		return true;
+	case BENCH_TRANSPORT_UNIX_SEQPACKET:
+	case BENCH_TRANSPORT_SENDMMSG:
+		bench_transport_listen_pair(AF_UNIX, SOCK_SEQPACKET, &ctx->fd_send,
+			&ctx->fd_recv);
+		return true;
+	case BENCH_TRANSPORT_TCP:
+		bench_transport_listen_pair(AF_INET, SOCK_STREAM, &ctx->fd_send,
+			&ctx->fd_recv);
+		return true;
+	case BENCH_TRANSPORT_SOCKETPAIR:
+		bench_transport_check(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0,
+			"socketpair");
+		ctx->fd_send = fds[0];
+		ctx->fd_recv = fds[1];
+		return true;
+	case BENCH_TRANSPORT_PIPE:
+		bench_transport_check(pipe(fds) == 0, "pipe");
+		// Bigger pipe means fewer context switches. Fine if not allowed.
+		fcntl(fds[1], F_SETPIPE_SZ, BENCH_TRANSPORT_PIPE_SIZE);
+		ctx->fd_send = fds[1];
+		ctx->fd_recv = fds[0];
+		return true;
+	case BENCH_TRANSPORT_SPLICE:
+		bench_transport_listen_pair(AF_INET, SOCK_STREAM, &ctx->fd_send,
+			&ctx->fd_recv);
+		bench_transport_check(pipe(ctx->pipe_fds) == 0, "pipe");
+		fcntl(ctx->pipe_fds[1], F_SETPIPE_SZ, BENCH_TRANSPORT_PIPE_SIZE);
+		return true;
+	case BENCH_TRANSPORT_ZEROCOPY: {
+		bench_transport_listen_pair(AF_INET, SOCK_STREAM, &ctx->fd_send,
+			&ctx->fd_recv);
+		int flag = 1;
+		if (setsockopt(ctx->fd_send, SOL_SOCKET, SO_ZEROCOPY, &flag,
+			sizeof(flag)) != 0) {
+			close(ctx->fd_send);
+			close(ctx->fd_recv);
+			return false;
+		}
+		return true;
+	}
+	}
+	abort();
+}
+
+static void
+bench_transport_close(struct bench_transport *ctx)
+{
+	close(ctx->fd_send);
+	close(ctx->fd_recv);
+	if (ctx->pipe_fds[0] >= 0) {
+		close(ctx->pipe_fds[0]);
+		close(ctx->pipe_fds[1]);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static void
+bench_transport_write_all(int fd, const char *data, uint64_t size)
+{
+	while (size > 0) {
+		ssize_t rc = write(fd, data, size);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		bench_transport_check(rc > 0, "write");
+		data += rc;
+		size -= rc;
+	}
+}
+
+static void
+bench_transport_send_splice(struct bench_transport *ctx)
+{
+	uint64_t left = ctx->pack_size;
+	while (left > 0) {
+		struct iovec iov;
+		iov.iov_base = ctx->send_buf + ctx->pack_size - left;
+		iov.iov_len = left;
+		// Gives the pages to the pipe without copying. The buffer must not change
+		// until the data is consumed. Here its content doesn't matter.
+		ssize_t in = vmsplice(ctx->pipe_fds[1], &iov, 1, 0);
+		if (in < 0 && errno == EINTR)
+			continue;
+		bench_transport_check(in > 0, "vmsplice");
+		left -= in;
+		while (in > 0) {
+			ssize_t out = splice(ctx->pipe_fds[0], NULL, ctx->fd_send, NULL, in,
+				SPLICE_F_MOVE);
+			if (out < 0 && errno == EINTR)
+				continue;
+			bench_transport_check(out > 0, "splice");
+			in -= out;
+		}
+	}
+}
+
+// The zero-copy sends report their completion via the error queue. It has to be read,
+// otherwise the kernel stops accepting the new sends.
+static void
+bench_transport_reap_zerocopy(int fd, bool is_blocking)
+{
+	while (true) {
+		char control[128];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		ssize_t rc = recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+		if (rc >= 0) {
+			is_blocking = false;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		bench_transport_check(errno == EAGAIN || errno == EWOULDBLOCK,
+			"recvmsg(MSG_ERRQUEUE)");
+		if (!is_blocking)
+			return;
+		struct pollfd pfd;
+		pfd.fd = fd;
+		// The error queue readiness is always reported, no need to ask for it.
+		pfd.events = 0;
+		pfd.revents = 0;
+		poll(&pfd, 1, -1);
+	}
+}
+
+static void
+bench_transport_send_zerocopy(struct bench_transport *ctx)
+{
+	uint64_t sent = 0;
+	while (sent < ctx->pack_size) {
+		ssize_t rc = send(ctx->fd_send, ctx->send_buf + sent, ctx->pack_size - sent,
+			MSG_ZEROCOPY | MSG_NOSIGNAL);
+		if (rc > 0) {
+			sent += rc;
+			continue;
+		}
+		if (rc < 0 && errno == EINTR)
+			continue;
+		// Too many not completed sends.
+		bench_transport_check(rc < 0 && errno == ENOBUFS, "send(MSG_ZEROCOPY)");
+		bench_transport_reap_zerocopy(ctx->fd_send, true);
+	}
+	bench_transport_reap_zerocopy(ctx->fd_send, false);
+}
+
+static uint64_t
+bench_transport_send_mmsg(struct bench_transport *ctx, uint64_t pack_count)
+{
+	struct mmsghdr msgs[BENCH_TRANSPORT_MMSG_BATCH];
+	struct iovec iovs[BENCH_TRANSPORT_MMSG_BATCH];
+	if (pack_count > BENCH_TRANSPORT_MMSG_BATCH)
+		pack_count = BENCH_TRANSPORT_MMSG_BATCH;
+	memset(msgs, 0, sizeof(msgs));
+	for (uint64_t i = 0; i < pack_count; ++i) {
+		iovs[i].iov_base = ctx->send_buf;
+		iovs[i].iov_len = ctx->pack_size;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	int rc;
+	do {
+		rc = sendmmsg(ctx->fd_send, msgs, pack_count, MSG_NOSIGNAL);
+	} while (rc < 0 && errno == EINTR);
+	bench_transport_check(rc > 0, "sendmmsg");
+	return rc;
+}
+
+static void
+bench_transport_send(struct bench_transport *ctx)
+{
+	uint64_t pack_i = 0;
+	while (pack_i < ctx->pack_count) {
+		uint64_t start = bench_now_ns();
+		switch (ctx->kind) {
+		case BENCH_TRANSPORT_SPLICE:
+			bench_transport_send_splice(ctx);
+			++pack_i;
+			break;
+		case BENCH_TRANSPORT_ZEROCOPY:
+			bench_transport_send_zerocopy(ctx);
+			++pack_i;
+			break;
+		case BENCH_TRANSPORT_SENDMMSG:
+			pack_i += bench_transport_send_mmsg(ctx, ctx->pack_count - pack_i);
+			break;
+		default:
+			// The message transports send the whole message or nothing, and the
+			// stream ones are blocking, so write() sends everything too unless
+			// interrupted.
+			bench_transport_write_all(ctx->fd_send, ctx->send_buf, ctx->pack_size);
+			++pack_i;
+			break;
+		}
+		bench_hist_add(ctx->hist, bench_now_ns() - start);
+	}
+}
+
+static void
+bench_transport_recv(struct bench_transport *ctx)
+{
+	uint64_t total = ctx->pack_count * ctx->pack_size;
+	uint64_t received = 0;
+	while (received < total) {
+		ssize_t rc;
+		if (ctx->kind == BENCH_TRANSPORT_SENDMMSG) {
+			struct mmsghdr msgs[BENCH_TRANSPORT_MMSG_BATCH];
+			struct iovec iovs[BENCH_TRANSPORT_MMSG_BATCH];
+			memset(msgs, 0, sizeof(msgs));
+			for (int i = 0; i < BENCH_TRANSPORT_MMSG_BATCH; ++i) {
+				iovs[i].iov_base = ctx->recv_buf + i * ctx->pack_size;
+				iovs[i].iov_len = ctx->pack_size;
+				msgs[i].msg_hdr.msg_iov = &iovs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			int count = recvmmsg(ctx->fd_recv, msgs, BENCH_TRANSPORT_MMSG_BATCH,
+				MSG_WAITFORONE, NULL);
+			rc = count;
+			for (int i = 0; i < count; ++i)
+				received += msgs[i].msg_len;
+		} else {
+			rc = read(ctx->fd_recv, ctx->recv_buf, ctx->pack_size);
+			if (rc > 0)
+				received += rc;
+		}
+		if (rc < 0 && errno == EINTR)
+			continue;
+		bench_transport_check(rc > 0, "recv");
+	}
+}
+
+static void *
+bench_transport_sender_f(void *arg)
+{
+	struct bench_transport *ctx = (struct bench_transport *)arg;
+	bench_pin_thread(ctx->b, 1);
+	bench_transport_send(ctx);
+	return NULL;
+}
+
+static void
+bench_transport_f(uint64_t count, void *arg)
+{
+	struct bench_transport *ctx = (struct bench_transport *)arg;
+	ctx->pack_count = count;
+	if (ctx->is_process) {
+		pid_t pid = fork();
+		bench_transport_check(pid >= 0, "fork");
+		if (pid == 0) {
+			bench_transport_sender_f(ctx);
+			_exit(0);
+		}
+		bench_transport_recv(ctx);
+		int status;
+		bench_transport_check(waitpid(pid, &status, 0) == pid, "waitpid");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			exit(-1);
+		return;
+	}
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, bench_transport_sender_f, ctx) != 0)
+		abort();
+	bench_transport_recv(ctx);
+	pthread_join(tid, NULL);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+int
+main(int argc, char **argv)
+{
+	struct bench b;
+	bench_init(&b, argc, argv);
+	uint64_t size = bench_arg_uint(argc, argv, "--size", BENCH_TRANSPORT_DEFAULT_SIZE);
+	uint64_t pack_size_arg = bench_arg_uint(argc, argv, "--pack-size", 0);
+	const char *only = bench_arg_str(argc, argv, "--transport", NULL);
+	const char *layout = bench_arg_str(argc, argv, "--layout", "thread");
+	bool is_process = strcmp(layout, "process") == 0;
+	if (!is_process && strcmp(layout, "thread") != 0) {
+		printf("# unknown layout %s\n", layout);
+		return -1;
+	}
+	static const uint64_t default_pack_sizes[] = {512, 4096, 16 * 1024, 64 * 1024};
+	const uint64_t *pack_sizes = default_pack_sizes;
+	uint32_t pack_size_count = sizeof(default_pack_sizes) / sizeof(default_pack_sizes[0]);
+	if (pack_size_arg != 0) {
+		pack_sizes = &pack_size_arg;
+		pack_size_count = 1;
+	}
+	struct bench_hist *hist = (struct bench_hist *)mmap(NULL, sizeof(*hist),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	bench_transport_check(hist != MAP_FAILED, "mmap");
+
+	for (const auto &t : bench_transports) {
+		if (only != NULL && strcmp(only, t.name) != 0)
+			continue;
+		for (uint32_t pack_i = 0; pack_i < pack_size_count; ++pack_i) {
+			uint64_t pack_size = pack_sizes[pack_i];
+			if (t.is_msg && pack_size > BENCH_TRANSPORT_MAX_MSG_SIZE) {
+				printf("# %s: packs bigger than %d are not supported\n", t.name,
+					(int)BENCH_TRANSPORT_MAX_MSG_SIZE);
+				continue;
+			}
+			struct bench_transport ctx;
+			ctx.b = &b;
+			ctx.kind = t.kind;
+			ctx.is_process = is_process;
+			ctx.pack_size = pack_size;
+			ctx.hist = hist;
+			if (!bench_transport_open(&ctx)) {
+				printf("# %s is not supported: %s\n", t.name, strerror(errno));
+				break;
+			}
+			ctx.send_buf = (char *)calloc(1, pack_size);
+			ctx.recv_buf = (char *)calloc(BENCH_TRANSPORT_MMSG_BATCH, pack_size);
+			char name[128];
+			snprintf(name, sizeof(name), "%s, %s, %llu byte packs", t.name, layout,
+				(unsigned long long)pack_size);
+			struct bench_case c = {};
+			c.name = name;
+			c.func = bench_transport_f;
+			c.arg = &ctx;
+			c.bytes_per_op = pack_size;
+			c.iteration_count = size / pack_size > 0 ? size / pack_size : 1;
+			c.hist = hist;
+			bench_run(&b, &c, NULL);
+			free(ctx.send_buf);
+			free(ctx.recv_buf);
+			bench_transport_close(&ctx);
+		}
+	}
+	munmap(hist, sizeof(*hist));
+	bench_destroy(&b);
+	return 0;
+}
@@ -1,14 +1,25 @@
+#include "heap_help.h"
+
 #include <cstdlib>
 #include <cxxabi.h>
 #include <dlfcn.h>
 #include <execinfo.h>
-#include <map>
+#include <fcntl.h>
 #include <new>
 #include <unistd.h>
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unwind.h>
 
+#include <atomic>
 #include <mutex>
 
 namespace
@@ -16,8 +27,50 @@ namespace
 enum {
 	MAX_BACKTRACE_LEN = 64,
 	ALLOCATION_BATCH_SIZE = 1024,
+	// The allocations are spread between the shards by their address, each shard with
+	// its own lock. So the threads allocating in parallel rarely wait for each other.
+	SHARD_COUNT = 64,
+	SHARD_MIN_CAPACITY = 1024,
+	// Free allocation objects a thread keeps for itself. Twice more and the extra ones go
+	// back to the common pool.
+	THREAD_CACHE_SIZE = 256,
+	// In the profile mode an allocation is sampled once per this many bytes on average,
+	// unless HHSAMPLE says otherwise.
+	PROFILE_SAMPLE_PERIOD = 512 * 1024,
+	PROFILE_MIN_CAPACITY = 1024,
+	// How many top call sites are shown in the profile report.
+	PROFILE_REPORT_LIMIT = 20,
+	// A thread looks at the clock once per this many allocations, to see if it is time
+	// to add a point to the statistics timeline.
+	STATS_CHECK_PERIOD = 1024,
+	STATS_TIMELINE_SIZE = 64,
+	// Initial time between the timeline points. When the timeline is full, every other
+	// point is dropped, and the interval is doubled.
+	STATS_TIMELINE_INTERVAL_MS = 10,
+	// How many threads are shown in the statistics report.
+	STATS_REPORT_THREAD_LIMIT = 20,
+	// The unique stacks are spread between the shards by their hash, each shard with its
+	// own lock.
+	STACK_SHARD_COUNT = 16,
+	STACK_MIN_CAPACITY = 256,
+	// The frames of the unique stacks are stored in chunks of this many frames.
+	STACK_ARENA_SIZE = 16 * 1024,
+	// Recent stacks a thread remembers to skip the unwinding, see stack_collect().
+	STACK_CACHE_SIZE = 32,
+	// In the guard mode the freed memory stays inaccessible until the quarantined
+	// memory gets bigger than this, unless HHQUARANTINE says otherwise.
+	GUARD_QUARANTINE_SIZE = 64 * 1024 * 1024,
+	GUARD_QUARANTINE_MIN_CAPACITY = 1024,
+	// Pointers returned by operator new must be aligned at least this much. So the
+	// overflows smaller than that might be not detected.
+	GUARD_MIN_ALIGN = 16,
+	// Byte pattern of the new memory in the trash content mode.
+	CONTENT_TRASH_BYTE = 0xeb,
 };
 
+// Stack ID of the allocations done without the backtrace collection.
+static constexpr uint32_t STACK_ID_NONE = UINT32_MAX;
+
 enum report_mode {
 	// Report always. Even when have no leaks.
 	REPORT_MODE_VERBOSE,
@@ -25,6 +78,10 @@ enum report_mode {
 	REPORT_MODE_LEAKS,
 	// Do not report anything.
 	REPORT_MODE_QUIET,
+	// Sample the allocations and report which code does them. Leaks are not reported.
+	REPORT_MODE_PROFILE,
+	// Report the allocation statistics, and the leaks like in the verbose mode.
+	REPORT_MODE_STATS,
 };
 
 enum backtrace_mode {
@@ -40,15 +97,30 @@ enum content_mode {
 	CONTENT_MODE_TRASH,
 };
 
+enum guard_mode {
+	// Memory comes from the standard library.
+	GUARD_MODE_OFF,
+	// Each allocation gets its own pages, ending right before a page without access. The
+	// freed memory is kept without any access for some time. So the overflows and the
+	// use-after-free crash right away.
+	GUARD_MODE_ON,
+};
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 // Single allocation done on the heap by a user.
 struct allocation {
-	void *trace[MAX_BACKTRACE_LEN];
-	int trace_size;
-	int depth;
+	// Many allocations are done from the same places, so their stacks are stored only
+	// once, in the stack table.
+	uint32_t stack_id;
 	void *mem;
 	size_t size;
+	// The code which called operator new.
+	void *site;
+	// Is accounted in the profile.
+	bool is_sampled;
+	// Is allocated in own pages in the guard mode.
+	bool is_guarded;
 	allocation *next;
 };
 
@@ -64,6 +136,174 @@ struct symbol {
 	const char *name;
 };
 
+struct allocation_slot {
+	void *mem;
+	allocation *alloc;
+};
+
+struct stack_entry {
+	uint64_t hash;
+	void **frames;
+	int depth;
+};
+
+// Stack of a recent allocation in one thread, with the CFA of each frame as the unwinder
+// reports it.
+struct stack_cache_entry {
+	void *sp;
+	void *site;
+	uint32_t stack_id;
+	int depth;
+	void *frames[MAX_BACKTRACE_LEN];
+	uintptr_t cfas[MAX_BACKTRACE_LEN];
+};
+
+// Unique stacks whose hashes fall into this shard. The stacks are never deleted, so a
+// stack ID stays valid until the process exit. The ID is the entry index combined with
+// the shard index.
+struct alignas(64) stack_shard {
+	std::mutex mutex;
+	stack_entry *entries = nullptr;
+	uint32_t entry_count = 0;
+	uint32_t entry_capacity = 0;
+	// Open-addressing hash table with linear probing. Stores the entry indexes plus 1, 0
+	// is an empty slot. The capacity is a power of 2.
+	uint32_t *slots = nullptr;
+	size_t capacity = 0;
+	// The frames are appended here. They never move, so the entries can point at them.
+	void **arena = nullptr;
+	size_t arena_used = 0;
+};
+
+// Part of the allocations whose addresses hash into it. It is an open-addressing hash
+// table with linear probing, and without tombstones - the deletion shifts the following
+// entries back. The capacity is a power of 2.
+struct alignas(64) allocation_shard {
+	std::mutex mutex;
+	allocation_slot *slots = nullptr;
+	size_t capacity = 0;
+	size_t count = 0;
+	// Allocations done in this shard since the process start.
+	uint64_t total_count = 0;
+};
+
+// Allocation objects not used by any thread cache.
+struct allocation_pool {
+	std::mutex mutex;
+	// Unused allocation objects. For re-use.
+	allocation *free_list = nullptr;
+	// Freshly created allocation objects. Taken from here when the list is empty.
+	allocation_batch *batch = nullptr;
+};
+
+// Free allocation objects of one thread. Taking and returning them doesn't need any
+// locks. An object freed in another thread just stays in that thread's cache.
+struct allocation_cache {
+	allocation *free_list;
+	int size;
+	// The thread exit hook is set, see cache_register().
+	bool is_registered;
+};
+
+// Allocation statistics of one call site, estimated from the samples. Flat are the
+// allocations done right in this place, cumulative - all the allocations done with this
+// place anywhere in the stack.
+struct profile_site {
+	void *pc;
+	double flat_count;
+	double flat_bytes;
+	double flat_live_bytes;
+	double cum_count;
+	double cum_bytes;
+	double cum_live_bytes;
+};
+
+// Call sites hash table. Open addressing with linear probing, keyed by the code address.
+// The sites are never deleted.
+struct allocation_profile {
+	std::mutex mutex;
+	profile_site *sites = nullptr;
+	size_t capacity = 0;
+	size_t count = 0;
+	uint64_t sample_count = 0;
+};
+
+// Sampling state of one thread. The distance between the samples is random with the
+// exponential distribution, so the sampled bytes form a Poisson process. It makes the
+// chance of any allocation to be sampled depend only on its size, not on the sizes of
+// the allocations before it.
+struct allocation_sampler {
+	int64_t bytes_until_sample;
+	uint64_t rand_state;
+};
+
+// Allocation counters of one thread. Only the owner thread changes them, others only
+// read. So they are updated without atomic read-modify-write operations, and are atomic
+// just to make the reads by the other threads well defined.
+struct thread_stats {
+	uint64_t tid;
+	std::atomic<uint64_t> alloc_count;
+	std::atomic<uint64_t> free_count;
+	std::atomic<uint64_t> alloc_bytes;
+	std::atomic<uint64_t> free_bytes;
+	std::atomic<uint64_t> size_class_alloc_count[HEAPH_SIZE_CLASS_COUNT];
+	std::atomic<uint64_t> size_class_free_count[HEAPH_SIZE_CLASS_COUNT];
+	thread_stats *prev;
+	thread_stats *next;
+};
+
+// Counters of the running threads. When a thread exits, its counters are added to the
+// common record of all the finished threads, and its object is reused for a next
+// thread. So a program starting many short threads doesn't pile them up.
+struct thread_stats_list {
+	std::mutex mutex;
+	// The oldest threads are first.
+	thread_stats *head = nullptr;
+	thread_stats *tail = nullptr;
+	uint32_t live_count = 0;
+	// Objects of the finished threads.
+	thread_stats *free_list = nullptr;
+	uint64_t exited_count = 0;
+	thread_stats exited;
+};
+
+struct guard_region {
+	void *base;
+	size_t size;
+};
+
+// Freed memory in the guard mode. It has no access, so any use of it crashes. A ring
+// buffer, the oldest regions are unmapped first.
+struct guard_quarantine {
+	std::mutex mutex;
+	guard_region *regions = nullptr;
+	size_t capacity = 0;
+	size_t head = 0;
+	size_t count = 0;
+	size_t size = 0;
+};
+
+struct stats_point {
+	uint64_t time_ms;
+	uint64_t live_bytes;
+	uint64_t rss_bytes;
+};
+
+// Live bytes and RSS over time. The points are added by the allocating threads from
+// time to time.
+struct stats_timeline {
+	std::mutex mutex;
+	stats_point points[STATS_TIMELINE_SIZE] = {};
+	int count = 0;
+	uint64_t start_ms = 0;
+	uint64_t interval_ms = STATS_TIMELINE_INTERVAL_MS;
+	// When the next point is due. Checked without the lock.
+	std::atomic<uint64_t> next_ms{0};
+	uint64_t peak_live_bytes = 0;
+	uint64_t peak_rss_bytes = 0;
+	uint64_t live_bytes_at_peak_rss = 0;
+};
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 static void
@@ -106,33 +346,947 @@ trace_resolve(void *const *addrs, int count, struct symbol *syms)
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-template<class T>
-struct hh_allocator
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static inline uint64_t
+ptr_hash(const void *ptr)
 {
-	using value_type = T;
+	// Murmur3 finalizer. The low bits of the addresses are mostly the same due to the
+	// alignment, so they have to be mixed with the high ones.
+	uint64_t h = (uintptr_t)ptr;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
 
-	T *
-	allocate(size_t n)
-	{
-		T *res = (T *)std::malloc(n * sizeof(T));
-		heaph_assert(res != nullptr);
-		return res;
+static inline size_t
+shard_slot_idx(const allocation_shard *shard, uint64_t hash)
+{
+	// The low bits are taken by the shard index.
+	return (hash >> 6) & (shard->capacity - 1);
+}
+
+static void
+shard_put(allocation_shard *shard, void *ptr, allocation *a)
+{
+	size_t mask = shard->capacity - 1;
+	size_t i = shard_slot_idx(shard, ptr_hash(ptr));
+	while (shard->slots[i].mem != nullptr) {
+		heaph_assert(shard->slots[i].mem != ptr);
+		i = (i + 1) & mask;
 	}
+	shard->slots[i].mem = ptr;
+	shard->slots[i].alloc = a;
+}
 
-	void
-	deallocate(T *p, std::size_t)
-	{
-		std::free(p);
+static void
+shard_grow(allocation_shard *shard)
+{
+	allocation_slot *old_slots = shard->slots;
+	size_t old_capacity = shard->capacity;
+	size_t capacity = old_capacity == 0 ? (size_t)SHARD_MIN_CAPACITY : old_capacity * 2;
+	shard->slots = (allocation_slot *)std::calloc(capacity, sizeof(allocation_slot));
+	heaph_assert(shard->slots != nullptr);
+	shard->capacity = capacity;
+	for (size_t i = 0; i < old_capacity; ++i) {
+		if (old_slots[i].mem != nullptr)
+			shard_put(shard, old_slots[i].mem, old_slots[i].alloc);
 	}
-};
+	std::free(old_slots);
+}
+
+static void
+shard_insert(allocation_shard *shard, void *ptr, allocation *a)
+{
+	// Keep the load factor at most 1/2 so the probe sequences stay short.
+	if ((shard->count + 1) * 2 > shard->capacity)
+		shard_grow(shard);
+	shard_put(shard, ptr, a);
+	++shard->count;
+	++shard->total_count;
+}
+
+static allocation *
+shard_remove(allocation_shard *shard, void *ptr)
+{
+	if (shard->capacity == 0)
+		return nullptr;
+	size_t mask = shard->capacity - 1;
+	size_t i = shard_slot_idx(shard, ptr_hash(ptr));
+	while (shard->slots[i].mem != ptr) {
+		if (shard->slots[i].mem == nullptr)
+			return nullptr;
+		i = (i + 1) & mask;
+	}
+	allocation *res = shard->slots[i].alloc;
+	// Move back the entries which would become unreachable because of the hole. Those
+	// are the ones whose home slot is not between the hole and their current place.
+	size_t j = i;
+	while (true) {
+		j = (j + 1) & mask;
+		void *mem = shard->slots[j].mem;
+		if (mem == nullptr)
+			break;
+		size_t home = shard_slot_idx(shard, ptr_hash(mem));
+		if (((j - home) & mask) < ((j - i) & mask))
+			continue;
+		shard->slots[i] = shard->slots[j];
+		i = j;
+	}
+	shard->slots[i].mem = nullptr;
+	shard->slots[i].alloc = nullptr;
+	--shard->count;
+	return res;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// The tables and the pool have constexpr constructors, so they are initialized before
+// any dynamic initialization.
+// So they work even for the allocations done in the constructors of other globals,
+// which could run before the heap_help's constructor.
+static allocation_shard glob_shards[SHARD_COUNT];
+static stack_shard glob_stack_shards[STACK_SHARD_COUNT];
+static allocation_pool glob_pool;
+static allocation_profile glob_profile;
+static thread_local allocation_cache tls_cache = {nullptr, 0, false};
+static pthread_key_t glob_cache_key;
+static pthread_once_t glob_cache_key_once = PTHREAD_ONCE_INIT;
+static thread_local allocation_sampler tls_sampler = {0, 0};
+static thread_local stack_cache_entry *tls_stack_cache = nullptr;
+// Live sampled allocations. While there are none, the frees don't need to look them up.
+static std::atomic<uint64_t> glob_sampled_live_count(0);
+static int64_t glob_sample_period = PROFILE_SAMPLE_PERIOD;
+// Set by SIGUSR1. The profile is printed by the next allocation, outside of the signal
+// handler.
+static volatile sig_atomic_t glob_is_dump_requested = 0;
+static stats_timeline glob_timeline;
+static thread_stats_list glob_thread_stats;
+static thread_local thread_stats *tls_stats = nullptr;
+static guard_quarantine glob_quarantine;
+static size_t glob_quarantine_budget = GUARD_QUARANTINE_SIZE;
+static std::atomic<bool> glob_is_guard_exhausted(false);
+
+static inline allocation_shard *
+shard_get(const void *ptr)
+{
+	return &glob_shards[ptr_hash(ptr) & (SHARD_COUNT - 1)];
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t
+stack_hash(void *const *frames, int depth)
+{
+	uint64_t h = depth;
+	for (int i = 0; i < depth; ++i)
+		h = ptr_hash((void *)(h ^ (uintptr_t)frames[i]));
+	return h;
+}
+
+static inline size_t
+stack_slot_idx(const stack_shard *shard, uint64_t hash)
+{
+	// The low bits are taken by the shard index.
+	return (hash >> 4) & (shard->capacity - 1);
+}
+
+static void
+stack_shard_grow(stack_shard *shard)
+{
+	size_t capacity = shard->capacity == 0 ?
+		(size_t)STACK_MIN_CAPACITY : shard->capacity * 2;
+	std::free(shard->slots);
+	shard->slots = (uint32_t *)std::calloc(capacity, sizeof(uint32_t));
+	heaph_assert(shard->slots != nullptr);
+	shard->capacity = capacity;
+	size_t mask = capacity - 1;
+	for (uint32_t ei = 0; ei < shard->entry_count; ++ei) {
+		size_t i = stack_slot_idx(shard, shard->entries[ei].hash);
+		while (shard->slots[i] != 0)
+			i = (i + 1) & mask;
+		shard->slots[i] = ei + 1;
+	}
+}
+
+// Find the stack in the table or add it there.
+static uint32_t
+stack_intern(void *const *frames, int depth)
+{
+	uint64_t hash = stack_hash(frames, depth);
+	uint32_t shard_idx = hash & (STACK_SHARD_COUNT - 1);
+	stack_shard *shard = &glob_stack_shards[shard_idx];
+	shard->mutex.lock();
+	// Keep the load factor at most 1/2 so the probe sequences stay short.
+	if ((shard->entry_count + 1) * 2 > shard->capacity)
+		stack_shard_grow(shard);
+	size_t mask = shard->capacity - 1;
+	size_t i = stack_slot_idx(shard, hash);
+	while (shard->slots[i] != 0) {
+		uint32_t ei = shard->slots[i] - 1;
+		const stack_entry *e = &shard->entries[ei];
+		if (e->hash == hash && e->depth == depth &&
+		    memcmp(e->frames, frames, depth * sizeof(frames[0])) == 0) {
+			shard->mutex.unlock();
+			return ei * STACK_SHARD_COUNT + shard_idx;
+		}
+		i = (i + 1) & mask;
+	}
+	if (shard->entry_count == shard->entry_capacity) {
+		shard->entry_capacity = shard->entry_capacity == 0 ?
+			(uint32_t)STACK_MIN_CAPACITY : shard->entry_capacity * 2;
+		shard->entries = (stack_entry *)std::realloc(shard->entries,
+			shard->entry_capacity * sizeof(stack_entry));
+		heaph_assert(shard->entries != nullptr);
+	}
+	if (shard->arena == nullptr || shard->arena_used + depth > STACK_ARENA_SIZE) {
+		shard->arena = (void **)std::malloc(STACK_ARENA_SIZE * sizeof(void *));
+		heaph_assert(shard->arena != nullptr);
+		shard->arena_used = 0;
+	}
+	uint32_t ei = shard->entry_count++;
+	stack_entry *e = &shard->entries[ei];
+	e->hash = hash;
+	e->depth = depth;
+	e->frames = shard->arena + shard->arena_used;
+	memcpy(e->frames, frames, depth * sizeof(frames[0]));
+	shard->arena_used += depth;
+	shard->slots[i] = ei + 1;
+	shard->mutex.unlock();
+	heaph_assert(ei < STACK_ID_NONE / STACK_SHARD_COUNT);
+	return ei * STACK_SHARD_COUNT + shard_idx;
+}
 
-using allocation_node = std::map<void *, allocation *>::value_type;
-using allocation_map = std::map<
-	void *,
-	allocation *,
-	std::less<>,
-	hh_allocator<allocation_node>
->;
+// The frames of the stack. They stay valid until the process exit.
+static void *const *
+stack_get(uint32_t id, int *depth)
+{
+	if (id == STACK_ID_NONE) {
+		*depth = 0;
+		return nullptr;
+	}
+	stack_shard *shard = &glob_stack_shards[id % STACK_SHARD_COUNT];
+	shard->mutex.lock();
+	const stack_entry *e = &shard->entries[id / STACK_SHARD_COUNT];
+	void *const *res = e->frames;
+	*depth = e->depth;
+	shard->mutex.unlock();
+	return res;
+}
+
+#if defined(__x86_64__)
+
+static _Unwind_Reason_Code
+stack_walk_frame(struct _Unwind_Context *ctx, void *arg)
+{
+	stack_cache_entry *e = (stack_cache_entry *)arg;
+	// The depth starts at -1 to skip the frame of stack_collect(), like backtrace()
+	// skips its own.
+	if (e->depth == MAX_BACKTRACE_LEN)
+		return _URC_END_OF_STACK;
+	if (e->depth >= 0) {
+		e->frames[e->depth] = (void *)_Unwind_GetIP(ctx);
+		e->cfas[e->depth] = _Unwind_GetCFA(ctx);
+	}
+	++e->depth;
+	return _URC_NO_REASON;
+}
+
+// The return address into a frame is saved by the call right below the frame's CFA as
+// the unwinder reports it. The frames are checked from the innermost one. When the
+// return address is the same, the frame is the same function at the same place, so the
+// CFA of the next one is the same too, and it is safe to read. Only the frames of
+// alloca() could break that. The first CFA is fixed by the stack pointer of
+// stack_collect().
+static bool
+stack_cache_is_valid(const stack_cache_entry *e)
+{
+	for (int i = 0; i < e->depth; ++i) {
+		if (*(void **)(e->cfas[i] - sizeof(void *)) != e->frames[i])
+			return false;
+	}
+	return true;
+}
+
+// ID of the current stack. The unwinding costs a few microseconds, much more than the
+// rest of the tracing. But the same code allocates from the same stack over and over,
+// so a thread remembers its recent stacks. One is taken again if the stack pointer and
+// the call site are the same, and the return addresses saved in the stack still match.
+static __attribute__((noinline)) uint32_t
+stack_collect(void *site)
+{
+	stack_cache_entry *cache = tls_stack_cache;
+	if (cache == nullptr) {
+		cache = (stack_cache_entry *)std::calloc(STACK_CACHE_SIZE, sizeof(*cache));
+		heaph_assert(cache != nullptr);
+		tls_stack_cache = cache;
+	}
+	void *sp = __builtin_frame_address(0);
+	stack_cache_entry *e = &cache[ptr_hash((void *)((uintptr_t)sp ^ (uintptr_t)site)) &
+		(STACK_CACHE_SIZE - 1)];
+	if (e->sp == sp && e->site == site && stack_cache_is_valid(e))
+		return e->stack_id;
+	e->sp = sp;
+	e->site = site;
+	e->depth = -1;
+	_Unwind_Backtrace(stack_walk_frame, e);
+	if (e->depth < 0)
+		e->depth = 0;
+	// The outermost frame can have no return address.
+	if (e->depth > 0 && e->frames[e->depth - 1] == nullptr)
+		--e->depth;
+	e->stack_id = stack_intern(e->frames, e->depth);
+	return e->stack_id;
+}
+
+#else
+
+static uint32_t
+stack_collect(void *)
+{
+	void *trace[MAX_BACKTRACE_LEN];
+	int trace_size = backtrace(trace, MAX_BACKTRACE_LEN);
+	heaph_assert(trace_size >= 0);
+	return stack_intern(trace, trace_size);
+}
+
+#endif
+
+static void
+stack_cache_free()
+{
+	std::free(tls_stack_cache);
+	tls_stack_cache = nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static int64_t
+sampler_next_interval(allocation_sampler *sampler)
+{
+	// Xorshift. Good enough for picking the sampling points.
+	uint64_t x = sampler->rand_state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	sampler->rand_state = x;
+	// Uniform in (0, 1], then turned into the exponential distribution.
+	double u = ((x >> 11) + 1) * (1.0 / 9007199254740992.0);
+	return (int64_t)(-log(u) * glob_sample_period) + 1;
+}
+
+static bool
+sampler_is_sampled(size_t size)
+{
+	allocation_sampler *sampler = &tls_sampler;
+	if (sampler->rand_state == 0) {
+		sampler->rand_state = ((uintptr_t)sampler * 0x9e3779b97f4a7c15ull) | 1;
+		sampler->bytes_until_sample = sampler_next_interval(sampler);
+	}
+	sampler->bytes_until_sample -= size;
+	if (sampler->bytes_until_sample > 0)
+		return false;
+	sampler->bytes_until_sample = sampler_next_interval(sampler);
+	return true;
+}
+
+// How many allocations of this size one sample stands for on average.
+static double
+sample_weight(size_t size)
+{
+	if (size == 0)
+		size = 1;
+	return 1 / (1 - exp(-(double)size / glob_sample_period));
+}
+
+static profile_site *
+profile_site_get(void *pc);
+
+static void
+profile_grow()
+{
+	allocation_profile *p = &glob_profile;
+	profile_site *old_sites = p->sites;
+	size_t old_capacity = p->capacity;
+	p->capacity = old_capacity == 0 ? (size_t)PROFILE_MIN_CAPACITY : old_capacity * 2;
+	p->sites = (profile_site *)std::calloc(p->capacity, sizeof(profile_site));
+	heaph_assert(p->sites != nullptr);
+	p->count = 0;
+	for (size_t i = 0; i < old_capacity; ++i) {
+		if (old_sites[i].pc != nullptr)
+			*profile_site_get(old_sites[i].pc) = old_sites[i];
+	}
+	std::free(old_sites);
+}
+
+static profile_site *
+profile_site_get(void *pc)
+{
+	allocation_profile *p = &glob_profile;
+	if ((p->count + 1) * 2 > p->capacity)
+		profile_grow();
+	size_t mask = p->capacity - 1;
+	size_t i = ptr_hash(pc) & mask;
+	while (p->sites[i].pc != pc) {
+		if (p->sites[i].pc == nullptr) {
+			memset(&p->sites[i], 0, sizeof(p->sites[i]));
+			p->sites[i].pc = pc;
+			++p->count;
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+	return &p->sites[i];
+}
+
+// Account a sampled allocation, or its free when the sign is negative.
+static void
+profile_account(const allocation *a, int sign)
+{
+	double weight = sample_weight(a->size);
+	double bytes = weight * a->size;
+	int trace_size = 0;
+	void *const *trace = stack_get(a->stack_id, &trace_size);
+	// The frames below the call site are operator new and heap help itself.
+	int first = 0;
+	while (first < trace_size && trace[first] != a->site)
+		++first;
+	if (first == trace_size)
+		first = 0;
+	allocation_profile *p = &glob_profile;
+	p->mutex.lock();
+	profile_site *site = profile_site_get(a->site);
+	site->flat_live_bytes += sign * bytes;
+	if (sign > 0) {
+		++p->sample_count;
+		site->flat_count += weight;
+		site->flat_bytes += bytes;
+	}
+	for (int i = first; i < trace_size; ++i) {
+		// A recursive function is counted once per stack.
+		bool is_dup = false;
+		for (int j = first; j < i && !is_dup; ++j)
+			is_dup = trace[j] == trace[i];
+		if (is_dup)
+			continue;
+		site = profile_site_get(trace[i]);
+		site->cum_live_bytes += sign * bytes;
+		if (sign > 0) {
+			site->cum_count += weight;
+			site->cum_bytes += bytes;
+		}
+	}
+	p->mutex.unlock();
+}
+
+static void
+profile_print_sites(const profile_site **sites, size_t count, bool is_flat)
+{
+	char *demangled_name = nullptr;
+	size_t demangled_size = 0;
+	printf("%14s %14s %14s  %s\n", "count", "bytes", "live bytes", "call site");
+	for (size_t i = 0; i < count && i < PROFILE_REPORT_LIMIT; ++i) {
+		const profile_site *s = sites[i];
+		double site_count = is_flat ? s->flat_count : s->cum_count;
+		double site_bytes = is_flat ? s->flat_bytes : s->cum_bytes;
+		double site_live = is_flat ? s->flat_live_bytes : s->cum_live_bytes;
+		if (site_bytes <= 0)
+			break;
+		Dl_info info;
+		const char *name = nullptr;
+		size_t offset = 0;
+		if (dladdr(s->pc, &info) != 0 && info.dli_sname != nullptr) {
+			int status = 0;
+			name = abi::__cxa_demangle(info.dli_sname, demangled_name,
+				&demangled_size, &status);
+			if (name != nullptr)
+				demangled_name = (char *)name;
+			else
+				name = info.dli_sname;
+			offset = (char *)s->pc - (char *)info.dli_saddr;
+		}
+		printf("%14.0f %14.0f %14.0f  ", site_count, site_bytes, site_live);
+		if (name != nullptr)
+			printf("%s+0x%zx\n", name, offset);
+		else
+			printf("%p\n", s->pc);
+	}
+	std::free(demangled_name);
+}
+
+static int
+profile_cmp_flat(const void *a, const void *b)
+{
+	double va = (*(const profile_site **)a)->flat_bytes;
+	double vb = (*(const profile_site **)b)->flat_bytes;
+	return va < vb ? 1 : va > vb ? -1 : 0;
+}
+
+static int
+profile_cmp_cum(const void *a, const void *b)
+{
+	double va = (*(const profile_site **)a)->cum_bytes;
+	double vb = (*(const profile_site **)b)->cum_bytes;
+	return va < vb ? 1 : va > vb ? -1 : 0;
+}
+
+static void
+profile_print()
+{
+	allocation_profile *p = &glob_profile;
+	p->mutex.lock();
+	const profile_site **sites =
+		(const profile_site **)std::malloc((p->count + 1) * sizeof(sites[0]));
+	heaph_assert(sites != nullptr);
+	size_t count = 0;
+	for (size_t i = 0; i < p->capacity; ++i) {
+		if (p->sites[i].pc != nullptr)
+			sites[count++] = &p->sites[i];
+	}
+	printf("\n");
+	printf("HH: allocation profile, %llu samples, 1 per %lld bytes on average\n",
+		(long long)p->sample_count, (long long)glob_sample_period);
+	printf("HH: flat - allocated right in the call site\n");
+	qsort(sites, count, sizeof(sites[0]), profile_cmp_flat);
+	profile_print_sites(sites, count, true);
+	printf("HH: cumulative - allocated with the call site anywhere in the stack\n");
+	qsort(sites, count, sizeof(sites[0]), profile_cmp_cum);
+	profile_print_sites(sites, count, false);
+	fflush(stdout);
+	p->mutex.unlock();
+	std::free(sites);
+}
+
+static void
+profile_on_signal(int)
+{
+	glob_is_dump_requested = 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static inline int
+stats_size_class(size_t size)
+{
+	if (size <= 8)
+		return 0;
+	int cls = 64 - __builtin_clzll(size - 1) - 3;
+	return cls < HEAPH_SIZE_CLASS_COUNT ? cls : HEAPH_SIZE_CLASS_COUNT - 1;
+}
+
+static inline void
+stats_inc(std::atomic<uint64_t> &counter, uint64_t value)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value,
+		std::memory_order_relaxed);
+}
+
+static uint64_t
+stats_now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t
+stats_get_rss()
+{
+	// Not via stdio, it would allocate.
+	int fd = open("/proc/self/statm", O_RDONLY);
+	if (fd < 0)
+		return 0;
+	char buf[128];
+	ssize_t rc = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (rc <= 0)
+		return 0;
+	buf[rc] = 0;
+	// The second number is the resident page count.
+	const char *pos = strchr(buf, ' ');
+	if (pos == nullptr)
+		return 0;
+	return strtoull(pos + 1, nullptr, 10) * sysconf(_SC_PAGESIZE);
+}
+
+static uint64_t
+stats_get_peak_rss()
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+	return (uint64_t)usage.ru_maxrss * 1024;
+}
+
+static inline void
+stats_add(std::atomic<uint64_t> &dst, const std::atomic<uint64_t> &src)
+{
+	stats_inc(dst, src.load(std::memory_order_relaxed));
+}
+
+static void
+stats_thread_reset(thread_stats *ts)
+{
+	ts->alloc_count.store(0, std::memory_order_relaxed);
+	ts->free_count.store(0, std::memory_order_relaxed);
+	ts->alloc_bytes.store(0, std::memory_order_relaxed);
+	ts->free_bytes.store(0, std::memory_order_relaxed);
+	for (int i = 0; i < HEAPH_SIZE_CLASS_COUNT; ++i) {
+		ts->size_class_alloc_count[i].store(0, std::memory_order_relaxed);
+		ts->size_class_free_count[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+static thread_stats *
+stats_thread_get()
+{
+	thread_stats *ts = tls_stats;
+	if (ts != nullptr)
+		return ts;
+	thread_stats_list *list = &glob_thread_stats;
+	list->mutex.lock();
+	ts = list->free_list;
+	if (ts != nullptr) {
+		list->free_list = ts->next;
+		stats_thread_reset(ts);
+	} else {
+		void *mem = std::malloc(sizeof(*ts));
+		heaph_assert(mem != nullptr);
+		ts = new (mem) thread_stats();
+	}
+	ts->tid = syscall(SYS_gettid);
+	ts->prev = list->tail;
+	ts->next = nullptr;
+	if (list->tail != nullptr)
+		list->tail->next = ts;
+	else
+		list->head = ts;
+	list->tail = ts;
+	++list->live_count;
+	list->mutex.unlock();
+	tls_stats = ts;
+	return ts;
+}
+
+// Called on the thread exit. If the thread still uses the heap after that, it gets a new
+// object.
+static void
+stats_thread_exit()
+{
+	thread_stats *ts = tls_stats;
+	if (ts == nullptr)
+		return;
+	tls_stats = nullptr;
+	thread_stats_list *list = &glob_thread_stats;
+	list->mutex.lock();
+	thread_stats *exited = &list->exited;
+	stats_add(exited->alloc_count, ts->alloc_count);
+	stats_add(exited->free_count, ts->free_count);
+	stats_add(exited->alloc_bytes, ts->alloc_bytes);
+	stats_add(exited->free_bytes, ts->free_bytes);
+	for (int i = 0; i < HEAPH_SIZE_CLASS_COUNT; ++i) {
+		stats_add(exited->size_class_alloc_count[i], ts->size_class_alloc_count[i]);
+		stats_add(exited->size_class_free_count[i], ts->size_class_free_count[i]);
+	}
+	++list->exited_count;
+	if (ts->prev != nullptr)
+		ts->prev->next = ts->next;
+	else
+		list->head = ts->next;
+	if (ts->next != nullptr)
+		ts->next->prev = ts->prev;
+	else
+		list->tail = ts->prev;
+	--list->live_count;
+	ts->next = list->free_list;
+	list->free_list = ts;
+	list->mutex.unlock();
+}
+
+static void
+stats_collect_thread(heaph_stats *stats, const thread_stats *ts)
+{
+	stats->alloc_count += ts->alloc_count.load(std::memory_order_relaxed);
+	stats->free_count += ts->free_count.load(std::memory_order_relaxed);
+	stats->alloc_bytes += ts->alloc_bytes.load(std::memory_order_relaxed);
+	stats->free_bytes += ts->free_bytes.load(std::memory_order_relaxed);
+	for (int i = 0; i < HEAPH_SIZE_CLASS_COUNT; ++i) {
+		stats->size_class_alloc_count[i] +=
+			ts->size_class_alloc_count[i].load(std::memory_order_relaxed);
+		stats->size_class_free_count[i] +=
+			ts->size_class_free_count[i].load(std::memory_order_relaxed);
+	}
+}
+
+// Sum of all the threads' counters. The peaks and the timeline are not touched.
+static void
+stats_collect(heaph_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	thread_stats_list *list = &glob_thread_stats;
+	list->mutex.lock();
+	for (const thread_stats *ts = list->head; ts != nullptr; ts = ts->next)
+		stats_collect_thread(stats, ts);
+	stats_collect_thread(stats, &list->exited);
+	stats->live_thread_count = list->live_count;
+	stats->thread_count = list->live_count + list->exited_count;
+	list->mutex.unlock();
+	// The counters of different threads are read at slightly different moments. The
+	// frees could be seen without their allocations.
+	if (stats->free_bytes < stats->alloc_bytes)
+		stats->live_bytes = stats->alloc_bytes - stats->free_bytes;
+}
+
+// Update the peaks with the current values, and store them as a new timeline point if
+// asked. Must be called under the timeline lock.
+static void
+stats_timeline_update(heaph_stats *stats, bool is_point)
+{
+	stats_timeline *t = &glob_timeline;
+	uint64_t now = stats_now_ms();
+	stats_collect(stats);
+	stats->rss_bytes = stats_get_rss();
+	if (stats->live_bytes > t->peak_live_bytes)
+		t->peak_live_bytes = stats->live_bytes;
+	if (stats->rss_bytes > t->peak_rss_bytes) {
+		t->peak_rss_bytes = stats->rss_bytes;
+		t->live_bytes_at_peak_rss = stats->live_bytes;
+	}
+	stats->peak_live_bytes = t->peak_live_bytes;
+	stats->live_bytes_at_peak_rss = t->live_bytes_at_peak_rss;
+	stats->peak_rss_bytes = stats_get_peak_rss();
+	if (stats->peak_rss_bytes < t->peak_rss_bytes)
+		stats->peak_rss_bytes = t->peak_rss_bytes;
+	if (!is_point)
+		return;
+	if (t->count == 0)
+		t->start_ms = now;
+	if (t->count == STATS_TIMELINE_SIZE) {
+		for (int i = 0; i < STATS_TIMELINE_SIZE / 2; ++i)
+			t->points[i] = t->points[i * 2];
+		t->count = STATS_TIMELINE_SIZE / 2;
+		t->interval_ms *= 2;
+	}
+	stats_point *p = &t->points[t->count++];
+	p->time_ms = now - t->start_ms;
+	p->live_bytes = stats->live_bytes;
+	p->rss_bytes = stats->rss_bytes;
+	t->next_ms.store(now + t->interval_ms, std::memory_order_relaxed);
+}
+
+static void
+stats_check_timeline()
+{
+	stats_timeline *t = &glob_timeline;
+	if (stats_now_ms() < t->next_ms.load(std::memory_order_relaxed))
+		return;
+	// Someone else is already adding the point.
+	if (!t->mutex.try_lock())
+		return;
+	if (stats_now_ms() >= t->next_ms.load(std::memory_order_relaxed)) {
+		heaph_stats stats;
+		stats_timeline_update(&stats, true);
+	}
+	t->mutex.unlock();
+}
+
+static void
+stats_on_alloc(size_t size)
+{
+	thread_stats *ts = stats_thread_get();
+	uint64_t count = ts->alloc_count.load(std::memory_order_relaxed) + 1;
+	ts->alloc_count.store(count, std::memory_order_relaxed);
+	stats_inc(ts->alloc_bytes, size);
+	stats_inc(ts->size_class_alloc_count[stats_size_class(size)], 1);
+	if (count % STATS_CHECK_PERIOD == 0)
+		stats_check_timeline();
+}
+
+static void
+stats_on_free(size_t size)
+{
+	thread_stats *ts = stats_thread_get();
+	stats_inc(ts->free_count, 1);
+	stats_inc(ts->free_bytes, size);
+	stats_inc(ts->size_class_free_count[stats_size_class(size)], 1);
+}
+
+static void
+stats_get(heaph_stats *stats)
+{
+	glob_timeline.mutex.lock();
+	stats_timeline_update(stats, false);
+	glob_timeline.mutex.unlock();
+}
+
+static int
+stats_thread_get_by_idx(uint32_t idx, heaph_thread_stats *stats)
+{
+	thread_stats_list *list = &glob_thread_stats;
+	list->mutex.lock();
+	const thread_stats *ts = nullptr;
+	if (idx < list->live_count) {
+		ts = list->head;
+		for (uint32_t i = 0; i < idx; ++i)
+			ts = ts->next;
+	} else if (idx == list->live_count && list->exited_count > 0) {
+		ts = &list->exited;
+	}
+	if (ts == nullptr) {
+		list->mutex.unlock();
+		return -1;
+	}
+	stats->tid = ts->tid;
+	stats->alloc_count = ts->alloc_count.load(std::memory_order_relaxed);
+	stats->free_count = ts->free_count.load(std::memory_order_relaxed);
+	stats->alloc_bytes = ts->alloc_bytes.load(std::memory_order_relaxed);
+	stats->free_bytes = ts->free_bytes.load(std::memory_order_relaxed);
+	list->mutex.unlock();
+	return 0;
+}
+
+static void
+stats_print()
+{
+	heaph_stats stats;
+	glob_timeline.mutex.lock();
+	stats_timeline_update(&stats, true);
+	printf("\n");
+	printf("HH: allocation statistics\n");
+	printf("HH: allocations - %llu (%llu bytes), frees - %llu (%llu bytes)\n",
+		(long long)stats.alloc_count, (long long)stats.alloc_bytes,
+		(long long)stats.free_count, (long long)stats.free_bytes);
+	printf("HH: live bytes - %llu, peak live bytes - %llu\n",
+		(long long)stats.live_bytes, (long long)stats.peak_live_bytes);
+	printf("HH: peak RSS - %llu bytes, live bytes at the peak RSS - %llu\n",
+		(long long)stats.peak_rss_bytes, (long long)stats.live_bytes_at_peak_rss);
+
+	printf("HH: size classes\n");
+	printf("%24s %14s %14s\n", "size", "allocs", "frees");
+	for (int i = 0; i < HEAPH_SIZE_CLASS_COUNT; ++i) {
+		if (stats.size_class_alloc_count[i] == 0 &&
+		    stats.size_class_free_count[i] == 0)
+			continue;
+		char range[64];
+		uint64_t min = i == 0 ? 0 : (1ull << (i + 2)) + 1;
+		if (i == HEAPH_SIZE_CLASS_COUNT - 1)
+			snprintf(range, sizeof(range), ">= %llu", (long long)min);
+		else
+			snprintf(range, sizeof(range), "%llu - %llu", (long long)min,
+				(long long)(1ull << (i + 3)));
+		printf("%24s %14llu %14llu\n", range,
+			(long long)stats.size_class_alloc_count[i],
+			(long long)stats.size_class_free_count[i]);
+	}
+
+	printf("HH: threads - %llu, running - %llu\n", (long long)stats.thread_count,
+		(long long)stats.live_thread_count);
+	printf("%10s %14s %14s %14s %14s\n", "tid", "allocs", "frees", "alloc bytes",
+		"free bytes");
+	heaph_thread_stats ts;
+	for (uint32_t i = 0; i < stats.live_thread_count && i < STATS_REPORT_THREAD_LIMIT;
+	     ++i) {
+		if (stats_thread_get_by_idx(i, &ts) != 0)
+			continue;
+		printf("%10llu %14llu %14llu %14llu %14llu\n", (long long)ts.tid,
+			(long long)ts.alloc_count, (long long)ts.free_count,
+			(long long)ts.alloc_bytes, (long long)ts.free_bytes);
+	}
+	if (stats.live_thread_count > STATS_REPORT_THREAD_LIMIT) {
+		printf("HH: only first %d running threads are shown\n",
+			(int)STATS_REPORT_THREAD_LIMIT);
+	}
+	if (stats_thread_get_by_idx(stats.live_thread_count, &ts) == 0) {
+		printf("%10s %14llu %14llu %14llu %14llu\n", "finished",
+			(long long)ts.alloc_count, (long long)ts.free_count,
+			(long long)ts.alloc_bytes, (long long)ts.free_bytes);
+	}
+
+	const stats_timeline *t = &glob_timeline;
+	printf("HH: timeline\n");
+	printf("%10s %14s %14s\n", "ms", "live bytes", "rss bytes");
+	for (int i = 0; i < t->count; ++i) {
+		const stats_point *p = &t->points[i];
+		printf("%10llu %14llu %14llu\n", (long long)p->time_ms,
+			(long long)p->live_bytes, (long long)p->rss_bytes);
+	}
+	fflush(stdout);
+	glob_timeline.mutex.unlock();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static void *
+guard_alloc(size_t size, size_t align)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	// The mapping is only page-aligned, so the end of a bigger aligned block can't be
+	// put right at the guard page. Such blocks are rare and go to the normal heap.
+	if (align > page_size)
+		return nullptr;
+	if (align < GUARD_MIN_ALIGN)
+		align = GUARD_MIN_ALIGN;
+	size_t data_size = (size + page_size - 1) & ~(page_size - 1);
+	char *base = (char *)mmap(nullptr, data_size + page_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base != MAP_FAILED) {
+		if (mprotect(base + data_size, page_size, PROT_NONE) == 0)
+			return base + data_size - ((size + align - 1) & ~(align - 1));
+		munmap(base, data_size + page_size);
+	}
+	// Most likely too many mappings. Each guarded allocation takes 2 of them, and the
+	// limit is in /proc/sys/vm/max_map_count. The caller falls back to the normal heap.
+	if (!glob_is_guard_exhausted.exchange(true)) {
+		printf("\n");
+		printf("HH: couldn't allocate guarded memory, the next allocations might be "
+			"not guarded\n");
+		fflush(stdout);
+	}
+	return nullptr;
+}
+
+static void
+guard_free(void *ptr, size_t size)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	// The memory takes less than a page before the end of its first page, or starts
+	// right at the guard page when is empty.
+	void *base = (void *)((uintptr_t)ptr & ~(page_size - 1));
+	size_t map_size = ((size + page_size - 1) & ~(page_size - 1)) + page_size;
+	if (glob_quarantine_budget == 0) {
+		heaph_assert(munmap(base, map_size) == 0);
+		return;
+	}
+	heaph_assert(mprotect(base, map_size, PROT_NONE) == 0);
+	guard_quarantine *q = &glob_quarantine;
+	q->mutex.lock();
+	if (q->count == q->capacity) {
+		size_t capacity = q->capacity == 0 ?
+			(size_t)GUARD_QUARANTINE_MIN_CAPACITY : q->capacity * 2;
+		guard_region *regions =
+			(guard_region *)std::malloc(capacity * sizeof(regions[0]));
+		heaph_assert(regions != nullptr);
+		for (size_t i = 0; i < q->count; ++i)
+			regions[i] = q->regions[(q->head + i) % q->capacity];
+		std::free(q->regions);
+		q->regions = regions;
+		q->capacity = capacity;
+		q->head = 0;
+	}
+	q->regions[(q->head + q->count++) % q->capacity] = {base, map_size};
+	q->size += map_size;
+	while (q->size > glob_quarantine_budget) {
+		guard_region *r = &q->regions[q->head];
+		heaph_assert(munmap(r->base, r->size) == 0);
+		q->size -= r->size;
+		q->head = (q->head + 1) % q->capacity;
+		--q->count;
+	}
+	q->mutex.unlock();
+}
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
@@ -142,33 +1296,49 @@ public:
 	heap_help();
 	~heap_help();
 
+	void *
+	alloc(size_t size, size_t align, void *site);
+
 	void
-	trace(void *ptr, size_t size);
+	dealloc(void *ptr);
+
+	uint64_t
+	get_alloc_count();
+
+	uint64_t
+	get_alloc_total_count();
 
 	void
-	untrace(void *ptr);
+	get_stats(heaph_stats *stats);
+
+	int
+	get_thread_stats(uint32_t idx, heaph_thread_stats *stats);
 
 private:
-	std::mutex m_mutex;
-	allocation_map m_allocations;
-	// Unused allocation objects. For re-use.
-	allocation *m_alloc_pool;
-	// Freshly created allocation objects. Taken from here when the pool is empty.
-	allocation_batch *m_alloc_batch;
-	uint64_t m_alloc_count;
+	void
+	trace(void *ptr, size_t size, void *site, bool is_guarded);
+
+	// Returns whether the memory was allocated in the guard mode, and its size.
+	bool
+	untrace(void *ptr, size_t *size);
+
+	allocation *
+	alloc_object();
+
+	void
+	free_object(allocation *a);
 
 	report_mode m_report_mode;
 	content_mode m_content_mode;
 	backtrace_mode m_backtrace_mode;
+	guard_mode m_guard_mode;
 };
 
 heap_help::heap_help()
-	: m_alloc_pool(nullptr)
-	, m_alloc_batch(nullptr)
-	, m_alloc_count(0)
-	, m_report_mode(REPORT_MODE_LEAKS)
+	: m_report_mode(REPORT_MODE_LEAKS)
 	, m_content_mode(CONTENT_MODE_ORIGINAL)
 	, m_backtrace_mode(BACKTRACE_ON)
+	, m_guard_mode(GUARD_MODE_OFF)
 {
 	const char *hh_report = getenv("HHREPORT");
 	if (hh_report != nullptr) {
@@ -178,7 +1348,16 @@ heap_help::heap_help()
 			m_report_mode = REPORT_MODE_LEAKS;
 		else if (strcmp(hh_report, "q") == 0)
 			m_report_mode = REPORT_MODE_QUIET;
+		else if (strcmp(hh_report, "p") == 0)
+			m_report_mode = REPORT_MODE_PROFILE;
+		else if (strcmp(hh_report, "s") == 0)
+			m_report_mode = REPORT_MODE_STATS;
 	}
+	if (m_report_mode == REPORT_MODE_PROFILE)
+		signal(SIGUSR1, profile_on_signal);
+	const char *hh_sample = getenv("HHSAMPLE");
+	if (hh_sample != nullptr && atoll(hh_sample) > 0)
+		glob_sample_period = atoll(hh_sample);
 
 	const char *hh_content = getenv("HHCONTENT");
 	if (hh_content != nullptr) {
@@ -195,23 +1374,52 @@ heap_help::heap_help()
 		else if (strcmp(bt_mode, "off") == 0)
 			m_backtrace_mode = BACKTRACE_OFF;
 	}
+
+	const char *hh_guard = getenv("HHGUARD");
+	if (hh_guard != nullptr) {
+		if (strcmp(hh_guard, "on") == 0)
+			m_guard_mode = GUARD_MODE_ON;
+		else if (strcmp(hh_guard, "off") == 0)
+			m_guard_mode = GUARD_MODE_OFF;
+	}
+	// Not all the allocations are tracked in the profile mode. Then it would be unknown
+	// how to free them.
+	if (m_report_mode == REPORT_MODE_PROFILE)
+		m_guard_mode = GUARD_MODE_OFF;
+	const char *hh_quarantine = getenv("HHQUARANTINE");
+	if (hh_quarantine != nullptr && atoll(hh_quarantine) >= 0)
+		glob_quarantine_budget = atoll(hh_quarantine);
 }
 
 heap_help::~heap_help()
 {
 	if (m_report_mode == REPORT_MODE_QUIET)
 		return;
-	m_mutex.lock();
-	if (m_allocations.empty())
+	if (m_report_mode == REPORT_MODE_PROFILE) {
+		profile_print();
+		return;
+	}
+	if (m_report_mode == REPORT_MODE_STATS)
+		stats_print();
+	for (allocation_shard &shard : glob_shards)
+		shard.mutex.lock();
+	uint64_t leak_count = 0;
+	uint64_t total_count = 0;
+	for (const allocation_shard &shard : glob_shards) {
+		leak_count += shard.count;
+		total_count += shard.total_count;
+	}
+	if (leak_count == 0)
 	{
-		uint64_t count = m_alloc_count;
-		m_mutex.unlock();
+		for (allocation_shard &shard : glob_shards)
+			shard.mutex.unlock();
 
-		if (m_report_mode == REPORT_MODE_VERBOSE) {
+		if (m_report_mode == REPORT_MODE_VERBOSE ||
+		    m_report_mode == REPORT_MODE_STATS) {
 			printf("\n");
 			printf("HH: found no leaks\n");
 			printf("HH: total allocation count - %llu\n",
-			       (long long)count);
+			       (long long)total_count);
 		}
 		return;
 	}
@@ -224,88 +1432,282 @@ heap_help::~heap_help()
 	const char *prefix = "\n";
 	char *demangled_name = nullptr;
 	size_t demangled_size = 0;
-	for (const auto& [ptr, a] : m_allocations) {
-		leak_size += a->size;
-		if (report_count >= report_limit)
-			continue;
-		bool has_trace = trace_resolve(a->trace, a->trace_size, syms) == 0;
-		printf("%s", prefix);
-		prefix = "";
-		printf("#### Leak %llu (%zu bytes) ####\n",
-			(long long)++report_count, a->size);
-		if (!has_trace) {
-			printf("Couldn't get the trace\n");
-			continue;
-		}
-		for (int i = 0; i < a->trace_size; ++i) {
-			int status = 0;
-			const char *original_name = syms[i].name;
-			const char *name = abi::__cxa_demangle(
-				original_name, demangled_name, &demangled_size, &status);
-			if (name == nullptr)
-				name = original_name;
-			printf("%d - %s\n", i, name);
+	for (const allocation_shard &shard : glob_shards) {
+		for (size_t slot_i = 0; slot_i < shard.capacity; ++slot_i) {
+			const allocation *a = shard.slots[slot_i].alloc;
+			if (a == nullptr)
+				continue;
+			leak_size += a->size;
+			if (report_count >= report_limit)
+				continue;
+			int trace_size = 0;
+			void *const *trace = stack_get(a->stack_id, &trace_size);
+			// The symbols are looked up only now, for the reported leaks.
+			bool has_trace = trace_resolve(trace, trace_size, syms) == 0;
+			printf("%s", prefix);
+			prefix = "";
+			printf("#### Leak %llu (%zu bytes) ####\n",
+				(long long)++report_count, a->size);
+			if (!has_trace) {
+				printf("Couldn't get the trace\n");
+				continue;
+			}
+			for (int i = 0; i < trace_size; ++i) {
+				int status = 0;
+				const char *original_name = syms[i].name;
+				const char *name = abi::__cxa_demangle(
+					original_name, demangled_name, &demangled_size, &status);
+				if (name == nullptr)
+					name = original_name;
+				printf("%d - %s\n", i, name);
+			}
 		}
 	}
 	std::free(demangled_name);
 	printf("%s", prefix), prefix = "";
-	printf("HH: found %lld leaks (%llu bytes)\n", (long long)m_allocations.size(),
+	printf("HH: found %lld leaks (%llu bytes)\n", (long long)leak_count,
 		(long long)leak_size);
-	if (report_count < m_allocations.size()) {
+	if (report_count < leak_count) {
 		printf("HH: only first %llu reports are shown\n",
 			(long long)report_count);
 	}
-	printf("HH: total allocation count - %llu\n", (long long)m_alloc_count);
-	m_mutex.unlock();
+	printf("HH: total allocation count - %llu\n", (long long)total_count);
+	for (allocation_shard &shard : glob_shards)
+		shard.mutex.unlock();
 	_exit(-1);
 }
 
+// Give all the cached records back to the pool, the thread's counters to the statistics
+// of the finished threads, and free its stack cache. Called on the thread exit,
+// otherwise each thread would keep them forever, and a program starting many short
+// threads would pile them up.
+static void
+cache_return(void *)
+{
+	allocation_cache *cache = &tls_cache;
+	cache->is_registered = false;
+	stats_thread_exit();
+	stack_cache_free();
+	allocation *first = cache->free_list;
+	if (first == nullptr)
+		return;
+	allocation *last = first;
+	while (last->next != nullptr)
+		last = last->next;
+	cache->free_list = nullptr;
+	cache->size = 0;
+	glob_pool.mutex.lock();
+	last->next = glob_pool.free_list;
+	glob_pool.free_list = first;
+	glob_pool.mutex.unlock();
+}
+
+static void
+cache_key_create()
+{
+	heaph_assert(pthread_key_create(&glob_cache_key, cache_return) == 0);
+}
+
+// Make cache_return() run when the thread exits. A pthread key is used instead of a
+// thread_local destructor, because registering the latter allocates memory. The key
+// destructors run after the thread_local ones, and if those free something into the
+// cache, the key is set again and its destructor is called one more time.
+static inline void
+cache_register(allocation_cache *cache)
+{
+	if (cache->is_registered)
+		return;
+	pthread_once(&glob_cache_key_once, cache_key_create);
+	// Any non-null value makes the destructor called.
+	pthread_setspecific(glob_cache_key, cache);
+	cache->is_registered = true;
+}
+
+allocation *
+heap_help::alloc_object()
+{
+	allocation_cache *cache = &tls_cache;
+	if (cache->free_list == nullptr) {
+		cache_register(cache);
+		// Take a bunch at once to come back to the common pool rarely.
+		glob_pool.mutex.lock();
+		while (cache->size < THREAD_CACHE_SIZE) {
+			allocation *a = glob_pool.free_list;
+			if (a != nullptr) {
+				glob_pool.free_list = a->next;
+			} else {
+				allocation_batch *batch = glob_pool.batch;
+				if (batch == nullptr || batch->used == ALLOCATION_BATCH_SIZE) {
+					batch = (allocation_batch *)std::malloc(sizeof(*batch));
+					heaph_assert(batch != nullptr);
+					batch->used = 0;
+					glob_pool.batch = batch;
+				}
+				a = &batch->allocs[batch->used++];
+			}
+			a->next = cache->free_list;
+			cache->free_list = a;
+			++cache->size;
+		}
+		glob_pool.mutex.unlock();
+	}
+	allocation *a = cache->free_list;
+	cache->free_list = a->next;
+	--cache->size;
+	return a;
+}
+
 void
-heap_help::trace(void *ptr, size_t size)
+heap_help::free_object(allocation *a)
 {
-	m_mutex.lock();
-	allocation *a = m_alloc_pool;
-	if (a != nullptr) {
-		m_alloc_pool = a->next;
-	} else {
-		if (m_alloc_batch == nullptr ||
-		    m_alloc_batch->used == ALLOCATION_BATCH_SIZE) {
-			m_alloc_batch =
-				(allocation_batch *)std::malloc(sizeof(*m_alloc_batch));
-			heaph_assert(m_alloc_batch != nullptr);
-			m_alloc_batch->used = 0;
-		} else {
-			heaph_assert(m_alloc_batch->used < ALLOCATION_BATCH_SIZE);
+	allocation_cache *cache = &tls_cache;
+	cache_register(cache);
+	a->next = cache->free_list;
+	cache->free_list = a;
+	if (++cache->size < THREAD_CACHE_SIZE * 2)
+		return;
+	// Give the extra objects to the other threads. Otherwise a thread only freeing
+	// memory allocated by others would pile them up.
+	allocation *first = cache->free_list;
+	allocation *last = first;
+	for (int i = 1; i < THREAD_CACHE_SIZE; ++i)
+		last = last->next;
+	cache->free_list = last->next;
+	cache->size -= THREAD_CACHE_SIZE;
+	glob_pool.mutex.lock();
+	last->next = glob_pool.free_list;
+	glob_pool.free_list = first;
+	glob_pool.mutex.unlock();
+}
+
+// Inlined so operator new stays a frame of the collected stack instead of a tail call.
+inline __attribute__((always_inline)) void *
+heap_help::alloc(size_t size, size_t align, void *site)
+{
+	void *res = nullptr;
+	if (m_guard_mode == GUARD_MODE_ON)
+		res = guard_alloc(size, align);
+	bool is_guarded = res != nullptr;
+	if (!is_guarded)
+		res = align != 0 ? std::aligned_alloc(align, size) : std::malloc(size);
+	heaph_assert(res != nullptr);
+	if (m_content_mode == CONTENT_MODE_TRASH)
+		memset(res, CONTENT_TRASH_BYTE, size);
+	trace(res, size, site, is_guarded);
+	return res;
+}
+
+void
+heap_help::dealloc(void *ptr)
+{
+	// Deletion of nullptr is legal and does nothing.
+	if (ptr == nullptr)
+		return;
+	size_t size = 0;
+	if (untrace(ptr, &size))
+		guard_free(ptr, size);
+	else
+		std::free(ptr);
+}
+
+void
+heap_help::trace(void *ptr, size_t size, void *site, bool is_guarded)
+{
+	bool is_sampled = false;
+	if (m_report_mode == REPORT_MODE_PROFILE) {
+		if (glob_is_dump_requested) {
+			glob_is_dump_requested = 0;
+			profile_print();
 		}
-		a = &m_alloc_batch->allocs[m_alloc_batch->used++];
+		// Only the sampled allocations are tracked in this mode.
+		if (!sampler_is_sampled(size))
+			return;
+		is_sampled = true;
 	}
+	allocation *a = alloc_object();
 	a->mem = ptr;
 	a->size = size;
-	heaph_assert(m_allocations.emplace(ptr, a).second);
-	++m_alloc_count;
-	m_mutex.unlock();
-
+	a->site = site;
+	a->is_sampled = is_sampled;
+	a->is_guarded = is_guarded;
+	a->stack_id = STACK_ID_NONE;
 	if (m_backtrace_mode == BACKTRACE_ON)
-		a->trace_size = backtrace(a->trace, MAX_BACKTRACE_LEN);
-	heaph_assert(a->trace_size >= 0);
+		a->stack_id = stack_collect(site);
+	if (is_sampled) {
+		profile_account(a, 1);
+		glob_sampled_live_count.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	allocation_shard *shard = shard_get(ptr);
+	shard->mutex.lock();
+	shard_insert(shard, ptr, a);
+	shard->mutex.unlock();
+	stats_on_alloc(size);
 }
 
-void
-heap_help::untrace(void *ptr)
+bool
+heap_help::untrace(void *ptr, size_t *size)
 {
-	m_mutex.lock();
-	auto it = m_allocations.find(ptr);
-	if (it == m_allocations.end())
-	{
-		m_mutex.unlock();
+	bool is_profile = m_report_mode == REPORT_MODE_PROFILE;
+	if (is_profile &&
+	    glob_sampled_live_count.load(std::memory_order_relaxed) == 0)
+		return false;
+	allocation_shard *shard = shard_get(ptr);
+	shard->mutex.lock();
+	allocation *a = shard_remove(shard, ptr);
+	shard->mutex.unlock();
+	if (a == nullptr) {
+		// Not sampled.
+		if (is_profile)
+			return false;
 		heaph_assert(! "Freeing unknown or already freed memory");
-		return;
+		return false;
 	}
-	allocation *a = it->second;
-	a->next = m_alloc_pool;
-	m_alloc_pool = a;
-	m_allocations.erase(it);
-	m_mutex.unlock();
+	if (a->is_sampled) {
+		profile_account(a, -1);
+		glob_sampled_live_count.fetch_sub(1, std::memory_order_relaxed);
+	}
+	stats_on_free(a->size);
+	*size = a->size;
+	bool is_guarded = a->is_guarded;
+	free_object(a);
+	return is_guarded;
+}
+
+uint64_t
+heap_help::get_alloc_count()
+{
+	uint64_t res = 0;
+	for (allocation_shard &shard : glob_shards) {
+		shard.mutex.lock();
+		res += shard.count;
+		shard.mutex.unlock();
+	}
+	return res;
+}
+
+uint64_t
+heap_help::get_alloc_total_count()
+{
+	uint64_t res = 0;
+	for (allocation_shard &shard : glob_shards) {
+		shard.mutex.lock();
+		res += shard.total_count;
+		shard.mutex.unlock();
+	}
+	return res;
+}
+
+void
+heap_help::get_stats(heaph_stats *stats)
+{
+	stats_get(stats);
+}
+
+int
+heap_help::get_thread_stats(uint32_t idx, heaph_thread_stats *stats)
+{
+	return stats_thread_get_by_idx(idx, stats);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -313,41 +1715,56 @@ heap_help::untrace(void *ptr)
 static heap_help glob_hh;
 }
 
+uint64_t
+heaph_get_alloc_count(void)
+{
+	return glob_hh.get_alloc_count();
+}
+
+uint64_t
+heaph_get_alloc_total_count(void)
+{
+	return glob_hh.get_alloc_total_count();
+}
+
+void
+heaph_get_stats(struct heaph_stats *stats)
+{
+	glob_hh.get_stats(stats);
+}
+
+int
+heaph_get_thread_stats(uint32_t idx, struct heaph_thread_stats *stats)
+{
+	return glob_hh.get_thread_stats(idx, stats);
+}
+
 void *
 operator new(std::size_t n)
 {
-	void *res = std::malloc(n);
-	heaph_assert(res != nullptr);
-	glob_hh.trace(res, n);
-	return res;
+	return glob_hh.alloc(n, 0, __builtin_return_address(0));
 }
 
 void *
 operator new(std::size_t count, std::align_val_t al)
 {
-	void *res = std::aligned_alloc((size_t)al, count);
-	heaph_assert(res != nullptr);
-	glob_hh.trace(res, count);
-	return res;
+	return glob_hh.alloc(count, (size_t)al, __builtin_return_address(0));
 }
 
 void
 operator delete(void *ptr) noexcept
 {
-	glob_hh.untrace(ptr);
-	std::free(ptr);
+	glob_hh.dealloc(ptr);
 }
 
 void
 operator delete(void *ptr, std::size_t) noexcept
 {
-	glob_hh.untrace(ptr);
-	std::free(ptr);
+	glob_hh.dealloc(ptr);
 }
 
 void
 operator delete(void *ptr, std::align_val_t) noexcept
 {
-	glob_hh.untrace(ptr);
-	std::free(ptr);
+	glob_hh.dealloc(ptr);
 }
@@ -2,5 +2,78 @@
 
 #include <stdint.h>
 
+/** Number of allocations which are not freed yet. */
 uint64_t
 heaph_get_alloc_count(void);
+
+/**
+ * Number of allocations done since the process start, including the freed ones. A
+ * difference between two calls shows how many allocations were done in between.
+ */
+uint64_t
+heaph_get_alloc_total_count(void);
+
+enum {
+	/**
+	 * Allocations are counted by size classes, powers of 2. Class 0 is up to 8 bytes,
+	 * class N is from 2^(N+2) + 1 to 2^(N+3) bytes. The last one takes all the bigger
+	 * sizes too.
+	 */
+	HEAPH_SIZE_CLASS_COUNT = 32,
+};
+
+struct heaph_stats {
+	uint64_t alloc_count;
+	uint64_t free_count;
+	uint64_t alloc_bytes;
+	uint64_t free_bytes;
+	/** Allocated and not freed yet. */
+	uint64_t live_bytes;
+	/**
+	 * The biggest live bytes seen so far. It is checked periodically, not on each
+	 * allocation, so short spikes can be missed.
+	 */
+	uint64_t peak_live_bytes;
+	/** Resident memory of the process now and at its peak. */
+	uint64_t rss_bytes;
+	uint64_t peak_rss_bytes;
+	/**
+	 * Live bytes at the moment when the biggest RSS was seen. If it is much smaller than
+	 * the RSS, then the memory is taken by something else than the heap, or by the heap
+	 * fragmentation.
+	 */
+	uint64_t live_bytes_at_peak_rss;
+	/** Number of threads which have ever allocated or freed anything. */
+	uint64_t thread_count;
+	/** Of them the ones still running. The finished ones are kept only as a sum. */
+	uint64_t live_thread_count;
+	uint64_t size_class_alloc_count[HEAPH_SIZE_CLASS_COUNT];
+	uint64_t size_class_free_count[HEAPH_SIZE_CLASS_COUNT];
+};
+
+/**
+ * Allocation statistics of the whole process. The counters are kept per thread and are
+ * summed up on each call, so it is not free. In the profile mode only the sampled
+ * allocations are counted.
+ */
+void
+heaph_get_stats(struct heaph_stats *stats);
+
+struct heaph_thread_stats {
+	/** Thread ID as gettid() returns. */
+	uint64_t tid;
+	uint64_t alloc_count;
+	uint64_t free_count;
+	uint64_t alloc_bytes;
+	/** Memory freed by this thread. Could be allocated by another one. */
+	uint64_t free_bytes;
+};
+
+/**
+ * Allocation statistics of a running thread with the given index, from 0 to
+ * live_thread_count - 1 in heaph_stats. The oldest threads go first, and the indexes
+ * shift when threads finish. The index live_thread_count is the sum of all the finished
+ * threads, with tid 0. Returns -1 if there is no such record.
+ */
+int
+heaph_get_thread_stats(uint32_t idx, struct heaph_thread_stats *stats);
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+#ifndef offsetof
+#  define offsetof(type, member) ((size_t)&((type *)0)->member)
+#endif /* offsetof */
+
+/**
+ * Intrusive hash table with open addressing. The link is embedded into the stored
+ * object, and the table is a flat array of pointers to the links. So an insertion
+ * doesn't allocate anything except when the array grows, and a lookup touches one
+ * cache line of the array plus the objects with the same hash.
+ *
+ * The collisions are resolved with linear probing, and a deletion shifts the next
+ * colliding links back instead of leaving a tombstone. So the lookups never get
+ * slower after many deletions.
+ *
+ * The table doesn't know how to compare the keys. The caller computes the hash, and
+ * gives a function checking if the object has the searched key. Since all the
+ * functions are inline, the comparator is usually inlined too.
+ */
+struct ihash_link {
+	/** Hash of the object's key, saved on insertion. */
+	uint64_t hash;
+};
+
+struct ihash {
+	/** Power of 2 or 0. NULL slots are free. */
+	struct ihash_link **slots;
+	uint32_t capacity;
+	uint32_t size;
+};
+
+/** Check if the object behind the link has the given key. */
+typedef bool
+(*ihash_is_equal_f)(const struct ihash_link *link, const void *key);
+
+enum {
+	IHASH_MIN_CAPACITY = 16,
+};
+
+static inline void
+ihash_create(struct ihash *h)
+{
+	h->slots = NULL;
+	h->capacity = 0;
+	h->size = 0;
+}
+
+/** Free the table. The objects are not touched. */
+static inline void
+ihash_destroy(struct ihash *h)
+{
+	free(h->slots);
+	ihash_create(h);
+}
+
+static inline uint32_t
+ihash_size(const struct ihash *h)
+{
+	return h->size;
+}
+
+/** Mix an integer key, so the close keys get far hashes. */
+static inline uint64_t
+ihash_u64(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key;
+}
+
+static inline uint64_t
+ihash_mem(const void *data, size_t size)
+{
+	/* FNV-1a, then mixed for the low bits used as the index. */
+	const unsigned char *pos = (const unsigned char *)data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= pos[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return ihash_u64(hash);
+}
+
+static inline uint64_t
+ihash_str(const char *str)
+{
+	return ihash_mem(str, strlen(str));
+}
+
+static inline uint32_t
+ihash_home(const struct ihash *h, uint64_t hash)
+{
+	return (uint32_t)hash & (h->capacity - 1);
+}
+
+/** Put the link into the first free slot from its home one. */
+static inline void
+ihash_place(struct ihash *h, struct ihash_link *link)
+{
+	uint32_t mask = h->capacity - 1;
+	uint32_t i = ihash_home(h, link->hash);
+	while (h->slots[i] != NULL)
+		i = (i + 1) & mask;
+	h->slots[i] = link;
+}
+
+/**
+ * Make sure the table can take one more link while staying at most 3/4 full.
+ * Returns -1 if the memory couldn't be allocated.
+ */
+static inline int
+ihash_reserve(struct ihash *h, uint32_t size)
+{
+	if ((uint64_t)size * 4 <= (uint64_t)h->capacity * 3)
+		return 0;
+	uint32_t capacity = IHASH_MIN_CAPACITY;
+	if (h->capacity > 0)
+		capacity = h->capacity;
+	while ((uint64_t)size * 4 > (uint64_t)capacity * 3)
+		capacity *= 2;
+	struct ihash_link **slots = (struct ihash_link **)calloc(capacity,
+		sizeof(slots[0]));
+	if (slots == NULL)
+		return -1;
+	struct ihash_link **old_slots = h->slots;
+	uint32_t old_capacity = h->capacity;
+	h->slots = slots;
+	h->capacity = capacity;
+	for (uint32_t i = 0; i < old_capacity; ++i) {
+		if (old_slots[i] != NULL)
+			ihash_place(h, old_slots[i]);
+	}
+	free(old_slots);
+	return 0;
+}
+
+/**
+ * Add the link with the given hash of its key. The table doesn't check if an object
+ * with this key is already stored. Returns -1 if the table couldn't grow.
+ */
+static inline int
+ihash_insert(struct ihash *h, struct ihash_link *link, uint64_t hash)
+{
+	if (ihash_reserve(h, h->size + 1) != 0)
+		return -1;
+	link->hash = hash;
+	ihash_place(h, link);
+	++h->size;
+	return 0;
+}
+
+/** Find the object with the given key, or return NULL. */
+static inline struct ihash_link *
+ihash_find(const struct ihash *h, uint64_t hash, const void *key,
+	   ihash_is_equal_f is_equal)
+{
+	if (h->size == 0)
+		return NULL;
+	uint32_t mask = h->capacity - 1;
+	for (uint32_t i = ihash_home(h, hash); h->slots[i] != NULL; i = (i + 1) & mask) {
+		struct ihash_link *link = h->slots[i];
+		if (link->hash == hash && is_equal(link, key))
+			return link;
+	}
+	return NULL;
+}
+
+/** Delete the stored link. */
+static inline void
+ihash_delete(struct ihash *h, struct ihash_link *link)
+{
+	uint32_t mask = h->capacity - 1;
+	uint32_t i = ihash_home(h, link->hash);
+	while (h->slots[i] != link)
+		i = (i + 1) & mask;
+	/*
+	 * Shift back the next links which can't be found after the slot becomes free -
+	 * the ones whose home slot is not between the free slot and their current one.
+	 */
+	uint32_t j = i;
+	while (true) {
+		j = (j + 1) & mask;
+		struct ihash_link *next = h->slots[j];
+		if (next == NULL)
+			break;
+		uint32_t home = ihash_home(h, next->hash);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			h->slots[i] = next;
+			i = j;
+		}
+	}
+	h->slots[i] = NULL;
+	--h->size;
+}
+
+/**
+ * return entry by hash link
+ */
+#define ihash_entry(link, type, member) ({				\
+	(type *)( (char *)(link) - offsetof(type, member));		\
+})
+
+/**
+ * foreach through all the stored links. The table must not be changed
+ * meanwhile.
+ */
+#define ihash_foreach(h, link, idx)					\
+	for ((idx) = 0; (idx) < (h)->capacity; ++(idx))			\
+		if (((link) = (h)->slots[(idx)]) != NULL)
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
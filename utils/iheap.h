@@ -0,0 +1,249 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+#ifndef offsetof
+#  define offsetof(type, member) ((size_t)&((type *)0)->member)
+#endif /* offsetof */
+
+/**
+ * Intrusive 4-ary min-heap. The link is embedded into the stored object and knows its
+ * position in the heap. So any object can be deleted or moved after its key changed in
+ * O(log n), not only the top one. For example, a timer can be cancelled by its owner.
+ *
+ * The keys are integers, like deadlines, and are kept in the heap array next to the
+ * link pointers. So sifting compares the array items and doesn't touch the objects
+ * or call a comparator, except for updating the positions in the moved links.
+ *
+ * 4 children per node make the tree twice lower than a binary one, and the children
+ * are adjacent in the array. So sifting down does fewer cache misses, while checking 4
+ * children instead of 2 is cheap.
+ */
+struct iheap_link {
+	/** Index in the heap array, IHEAP_POS_NONE if not in a heap. */
+	uint32_t pos;
+};
+
+struct iheap_node {
+	uint64_t key;
+	struct iheap_link *link;
+};
+
+struct iheap {
+	struct iheap_node *nodes;
+	uint32_t size;
+	uint32_t capacity;
+};
+
+enum {
+	IHEAP_ARITY = 4,
+	IHEAP_MIN_CAPACITY = 16,
+	IHEAP_POS_NONE = UINT32_MAX,
+};
+
+static inline void
+iheap_create(struct iheap *h)
+{
+	h->nodes = NULL;
+	h->size = 0;
+	h->capacity = 0;
+}
+
+/** Free the heap. The objects are not touched. */
+static inline void
+iheap_destroy(struct iheap *h)
+{
+	free(h->nodes);
+	iheap_create(h);
+}
+
+static inline void
+iheap_link_create(struct iheap_link *link)
+{
+	link->pos = IHEAP_POS_NONE;
+}
+
+static inline bool
+iheap_link_is_in_heap(const struct iheap_link *link)
+{
+	return link->pos != IHEAP_POS_NONE;
+}
+
+static inline uint32_t
+iheap_size(const struct iheap *h)
+{
+	return h->size;
+}
+
+static inline bool
+iheap_is_empty(const struct iheap *h)
+{
+	return h->size == 0;
+}
+
+/** The link with the minimal key, or NULL if the heap is empty. */
+static inline struct iheap_link *
+iheap_top(const struct iheap *h)
+{
+	return h->size > 0 ? h->nodes[0].link : NULL;
+}
+
+/** Key of the stored link. */
+static inline uint64_t
+iheap_key(const struct iheap *h, const struct iheap_link *link)
+{
+	return h->nodes[link->pos].key;
+}
+
+static inline void
+iheap_set(struct iheap *h, uint32_t pos, struct iheap_node node)
+{
+	h->nodes[pos] = node;
+	node.link->pos = pos;
+}
+
+static inline void
+iheap_sift_up(struct iheap *h, uint32_t pos)
+{
+	struct iheap_node node = h->nodes[pos];
+	while (pos > 0) {
+		uint32_t parent = (pos - 1) / IHEAP_ARITY;
+		if (node.key >= h->nodes[parent].key)
+			break;
+		iheap_set(h, pos, h->nodes[parent]);
+		pos = parent;
+	}
+	iheap_set(h, pos, node);
+}
+
+static inline void
+iheap_sift_down(struct iheap *h, uint32_t pos)
+{
+	struct iheap_node node = h->nodes[pos];
+	while (true) {
+		uint32_t first = pos * IHEAP_ARITY + 1;
+		if (first >= h->size)
+			break;
+		uint32_t end = first + IHEAP_ARITY;
+		if (end > h->size)
+			end = h->size;
+		uint32_t min = first;
+		for (uint32_t i = first + 1; i < end; ++i) {
+			if (h->nodes[i].key < h->nodes[min].key)
+				min = i;
+		}
+		if (h->nodes[min].key >= node.key)
+			break;
+		iheap_set(h, pos, h->nodes[min]);
+		pos = min;
+	}
+	iheap_set(h, pos, node);
+}
+
+/** Move the node at the position up or down to where it belongs. */
+static inline void
+iheap_sift(struct iheap *h, uint32_t pos)
+{
+	if (pos > 0 && h->nodes[pos].key < h->nodes[(pos - 1) / IHEAP_ARITY].key)
+		iheap_sift_up(h, pos);
+	else
+		iheap_sift_down(h, pos);
+}
+
+/** Add the link with the given key. Returns -1 if the heap couldn't grow. */
+static inline int
+iheap_insert(struct iheap *h, struct iheap_link *link, uint64_t key)
+{
+	if (h->size == h->capacity) {
+		uint32_t capacity = IHEAP_MIN_CAPACITY;
+		if (h->capacity > 0)
+			capacity = h->capacity * 2;
+		struct iheap_node *nodes = (struct iheap_node *)realloc(h->nodes,
+			capacity * sizeof(nodes[0]));
+		if (nodes == NULL)
+			return -1;
+		h->nodes = nodes;
+		h->capacity = capacity;
+	}
+	struct iheap_node node;
+	node.key = key;
+	node.link = link;
+	iheap_set(h, h->size++, node);
+	iheap_sift_up(h, link->pos);
+	return 0;
+}
+
+/** Delete the link, wherever it is in the heap. */
+static inline void
+iheap_delete(struct iheap *h, struct iheap_link *link)
+{
+	uint32_t pos = link->pos;
+	iheap_link_create(link);
+	if (pos == --h->size)
+		return;
+	/* Fill the hole with the last node. It can go either way from there. */
+	iheap_set(h, pos, h->nodes[h->size]);
+	iheap_sift(h, pos);
+}
+
+/** Delete and return the link with the minimal key, or NULL if the heap is empty. */
+static inline struct iheap_link *
+iheap_pop(struct iheap *h)
+{
+	if (h->size == 0)
+		return NULL;
+	struct iheap_link *top = h->nodes[0].link;
+	iheap_link_create(top);
+	if (--h->size == 0)
+		return top;
+	/*
+	 * The last node usually goes back to the bottom. So move the hole down along the
+	 * minimal children to a leaf without comparing them with the last node, then put
+	 * it into the hole and sift up. That is fewer comparisons than a normal sift down.
+	 */
+	uint32_t pos = 0;
+	while (true) {
+		uint32_t first = pos * IHEAP_ARITY + 1;
+		if (first >= h->size)
+			break;
+		uint32_t end = first + IHEAP_ARITY;
+		if (end > h->size)
+			end = h->size;
+		uint32_t min = first;
+		for (uint32_t i = first + 1; i < end; ++i) {
+			if (h->nodes[i].key < h->nodes[min].key)
+				min = i;
+		}
+		iheap_set(h, pos, h->nodes[min]);
+		pos = min;
+	}
+	iheap_set(h, pos, h->nodes[h->size]);
+	iheap_sift_up(h, pos);
+	return top;
+}
+
+/** Change the key of the stored link. */
+static inline void
+iheap_update(struct iheap *h, struct iheap_link *link, uint64_t key)
+{
+	h->nodes[link->pos].key = key;
+	iheap_sift(h, link->pos);
+}
+
+/**
+ * return entry by heap link
+ */
+#define iheap_entry(link, type, member) ({				\
+	(type *)( (char *)(link) - offsetof(type, member));		\
+})
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
+#include "unit_bench.h"
+
 #define unit_test_start() \
 	printf("\t-------- %s started --------\n", __func__)
 
@@ -34,4 +36,31 @@
 	}								\
 } while(0)
 
+/**
+ * Time the body doing one operation, see unit_bench.h. For example:
+ *
+ *	unit_bench("push", 100000, vec_push(&v, 1));
+ *	unit_assert_faster_than(50);
+ */
+#define unit_bench(name, iterations, ...) do {				\
+	struct unit_bench_run unit_bench_state;				\
+	char unit_bench_msg[256];					\
+	unit_bench_loop(&unit_bench_state, (name), (iterations),	\
+		__VA_ARGS__);						\
+	unit_bench_finish(&unit_bench_state, unit_bench_msg,		\
+		sizeof(unit_bench_msg));				\
+	unit_msg("%s", unit_bench_msg);					\
+} while (0)
+
+/**
+ * Check the last unit_bench() took at most the given nanoseconds per operation on the
+ * reference machine. The budget is scaled to the current one.
+ */
+#define unit_assert_faster_than(ns_per_op) do {				\
+	char unit_bench_msg[256];					\
+	bool unit_bench_ok = unit_bench_check_budget((ns_per_op),	\
+		unit_bench_msg, sizeof(unit_bench_msg));		\
+	unit_check(unit_bench_ok, unit_bench_msg);			\
+} while (0)
+
 bool doCmdMaxPoints(int argc, char **argv);
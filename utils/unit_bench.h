@@ -0,0 +1,218 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/**
+ * Timing for the benchmark assertions of unit.h and unitpp.h. The benchmarked body is
+ * run in several rounds of the given number of iterations, each round is timed with
+ * CLOCK_MONOTONIC, and the median time per operation is taken. So a round hit by
+ * something else on the machine doesn't affect the result.
+ *
+ * The budgets are in nanoseconds of a reference machine, where one iteration of the
+ * calibration loop below takes UNIT_BENCH_REFERENCE_NS. On the current machine they
+ * are scaled by the calibration loop's own speed. That way the same budget works on
+ * a slow laptop and on a fast server, and in the debug and release builds, because
+ * the loop is compiled with the same flags as the test.
+ *
+ * The budgets are not checked with heap_help or the sanitizers - they make everything
+ * slower in a way the calibration loop doesn't show.
+ */
+
+enum {
+	/** Rounds done before the measured ones, to warm the caches up. */
+	UNIT_BENCH_WARMUP_COUNT = 1,
+	UNIT_BENCH_RUN_COUNT = 5,
+	UNIT_BENCH_CALIBRATION_ITERATIONS = 1000000,
+	UNIT_BENCH_CALIBRATION_TABLE_SIZE = 4096,
+};
+
+/**
+ * Time of one calibration loop iteration on the reference machine, the one the budgets
+ * in the tests were chosen on, with the default test build flags (-g, no optimization).
+ */
+#define UNIT_BENCH_REFERENCE_NS 3.5
+
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define UNIT_BENCH_IS_SANITIZED 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer) || \
+	__has_feature(memory_sanitizer)
+#define UNIT_BENCH_IS_SANITIZED 1
+#endif
+#endif
+#ifndef UNIT_BENCH_IS_SANITIZED
+#define UNIT_BENCH_IS_SANITIZED 0
+#endif
+
+#ifdef __cplusplus
+/** Defined when the test is linked with heap_help. */
+uint64_t
+heaph_get_alloc_count(void) __attribute__((weak));
+#endif
+
+struct unit_bench_run {
+	const char *name;
+	uint64_t iteration_count;
+	/** Rounds done so far, including the warmup ones. */
+	uint32_t round;
+	uint64_t start_ns;
+	double round_ns[UNIT_BENCH_RUN_COUNT];
+	/** Time per operation of the measured rounds. */
+	double median_ns;
+	double min_ns;
+	double max_ns;
+};
+
+static inline uint64_t
+unit_bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Sort the few round times in place and return the median. */
+static inline double
+unit_bench_median(double *values, uint32_t count)
+{
+	for (uint32_t i = 1; i < count; ++i) {
+		double v = values[i];
+		uint32_t j = i;
+		for (; j > 0 && values[j - 1] > v; --j)
+			values[j] = values[j - 1];
+		values[j] = v;
+	}
+	if (count % 2 == 1)
+		return values[count / 2];
+	return (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+/** The result of the last unit_bench() for the budget assertion. */
+static inline struct unit_bench_run *
+unit_bench_last(void)
+{
+	static struct unit_bench_run run;
+	return &run;
+}
+
+static inline void
+unit_bench_start(struct unit_bench_run *run, const char *name, uint64_t iteration_count)
+{
+	run->name = name;
+	run->iteration_count = iteration_count > 0 ? iteration_count : 1;
+	run->round = 0;
+	run->start_ns = 0;
+}
+
+/**
+ * Finish the previous round, if any, and start the next one. Returns false when all the
+ * rounds are done.
+ */
+static inline bool
+unit_bench_next(struct unit_bench_run *run)
+{
+	uint64_t now = unit_bench_now_ns();
+	if (run->round > UNIT_BENCH_WARMUP_COUNT) {
+		run->round_ns[run->round - UNIT_BENCH_WARMUP_COUNT - 1] =
+			(double)(now - run->start_ns) / run->iteration_count;
+	}
+	if (run->round == UNIT_BENCH_WARMUP_COUNT + UNIT_BENCH_RUN_COUNT)
+		return false;
+	++run->round;
+	run->start_ns = unit_bench_now_ns();
+	return true;
+}
+
+/** Compute the result, save it for the assertion, and describe it in msg. */
+static inline void
+unit_bench_finish(struct unit_bench_run *run, char *msg, size_t size)
+{
+	run->median_ns = unit_bench_median(run->round_ns, UNIT_BENCH_RUN_COUNT);
+	run->min_ns = run->round_ns[0];
+	run->max_ns = run->round_ns[UNIT_BENCH_RUN_COUNT - 1];
+	*unit_bench_last() = *run;
+	snprintf(msg, size, "bench %s: %.1lf ns/op (min %.1lf, max %.1lf), %llu "
+		"iterations x %d rounds", run->name, run->median_ns, run->min_ns,
+		run->max_ns, (unsigned long long)run->iteration_count,
+		(int)UNIT_BENCH_RUN_COUNT);
+}
+
+/**
+ * Time of one calibration loop iteration on this machine. The loop mixes a dependent
+ * chain of multiplications with reads and writes of a table fitting into L1, which is
+ * roughly what the tested code does. Measured once per process.
+ */
+static inline double
+unit_bench_calibration_ns(void)
+{
+	static double result = 0;
+	static uint64_t table[UNIT_BENCH_CALIBRATION_TABLE_SIZE];
+	if (result > 0)
+		return result;
+	double round_ns[UNIT_BENCH_RUN_COUNT];
+	uint64_t x = 1;
+	uint64_t sum = 0;
+	for (int r = -UNIT_BENCH_WARMUP_COUNT; r < UNIT_BENCH_RUN_COUNT; ++r) {
+		uint64_t start = unit_bench_now_ns();
+		for (int i = 0; i < UNIT_BENCH_CALIBRATION_ITERATIONS; ++i) {
+			x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+			uint64_t *slot = &table[(x >> 52) % UNIT_BENCH_CALIBRATION_TABLE_SIZE];
+			sum += *slot;
+			*slot = x ^ sum;
+			/* Keep the compiler from vectorizing or dropping the loop. */
+			__asm__ volatile("" : "+r"(x), "+r"(sum) : : "memory");
+		}
+		if (r >= 0) {
+			round_ns[r] = (double)(unit_bench_now_ns() - start) /
+				UNIT_BENCH_CALIBRATION_ITERATIONS;
+		}
+	}
+	result = unit_bench_median(round_ns, UNIT_BENCH_RUN_COUNT);
+	return result;
+}
+
+/**
+ * Check the last unit_bench() result against the budget in the reference machine
+ * nanoseconds. Returns false if it is exceeded. The verdict is described in msg.
+ */
+static inline bool
+unit_bench_check_budget(double ref_ns_per_op, char *msg, size_t size)
+{
+	const struct unit_bench_run *run = unit_bench_last();
+	const char *skip = NULL;
+	if (UNIT_BENCH_IS_SANITIZED)
+		skip = "sanitizer";
+#ifdef __cplusplus
+	else if (heaph_get_alloc_count != NULL)
+		skip = "heap_help";
+#endif
+	if (skip != NULL) {
+		snprintf(msg, size, "bench %s: %.1lf ns/op # SKIP budget with %s",
+			run->name, run->median_ns, skip);
+		return true;
+	}
+	double scale = unit_bench_calibration_ns() / UNIT_BENCH_REFERENCE_NS;
+	double budget = ref_ns_per_op * scale;
+	bool ok = run->median_ns <= budget;
+	snprintf(msg, size, "bench %s: %.1lf ns/op %s budget %.1lf ns/op (%.1lf on the "
+		"reference machine, scale %.2lf)", run->name, run->median_ns,
+		ok ? "within" : "exceeds", budget, ref_ns_per_op, scale);
+	return ok;
+}
+
+/**
+ * Run the body in rounds of the given iterations. The body is executed
+ * (UNIT_BENCH_WARMUP_COUNT + UNIT_BENCH_RUN_COUNT) * iterations times in total.
+ */
+#define unit_bench_loop(run, name, iterations, ...) do {			\
+	unit_bench_start((run), (name), (iterations));				\
+	while (unit_bench_next(run)) {						\
+		for (uint64_t unit_bench_i = 0;					\
+		     unit_bench_i < (run)->iteration_count; ++unit_bench_i) {	\
+			__VA_ARGS__;						\
+		}								\
+	}									\
+} while (0)
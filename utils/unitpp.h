@@ -2,6 +2,8 @@
 
 #include <iostream>
 
+#include "unit_bench.h"
+
 class UnitTestCaseGuard
 {
 public:
@@ -24,7 +26,7 @@ private:
 #define unit_test_start() UnitTestCaseGuard test_case_guard(__func__)
 
 #define unit_assert(cond) do {													\
-	if (cond) {																	\
+	if (not (cond)) {															\
 		std::cout <<"Test failed, line " << __LINE__ << "\n";					\
 		exit(-1);																\
 	}																			\
@@ -42,3 +44,18 @@ private:
 		std::cout << "ok - " << msg << '\n';									\
 	}																			\
 } while(0)
+
+#define unit_bench(name, iterations, ...) do {									\
+	unit_bench_run unit_bench_state;											\
+	char unit_bench_msg[256];													\
+	unit_bench_loop(&unit_bench_state, (name), (iterations), __VA_ARGS__);		\
+	unit_bench_finish(&unit_bench_state, unit_bench_msg, sizeof(unit_bench_msg));	\
+	unit_msg(unit_bench_msg);													\
+} while (0)
+
+#define unit_assert_faster_than(ns_per_op) do {									\
+	char unit_bench_msg[256];													\
+	bool unit_bench_ok = unit_bench_check_budget((ns_per_op), unit_bench_msg,	\
+		sizeof(unit_bench_msg));												\
+	unit_check(unit_bench_ok, unit_bench_msg);									\
+} while (0)